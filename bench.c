@@ -0,0 +1,745 @@
+/*
+ *  bench.c - Benchmarks for the onkyocontrol daemon and client library
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each benchmark starts the daemon built next to us on a UNIX socket, with
+ * fake receivers on pseudo terminals that answer commands the way a real
+ * one does, and drives it through libonkyoclient:
+ *
+ * fleet  - command round trips to one receiver, and the daemon CPU time
+ *          they take, as the number of idle receivers grows. Both should
+ *          stay flat from 1 to 500 receivers.
+ * shards - round trips to a quiet receiver, and how long commands take to
+ *          reach it, with and without every other receiver flooding
+ *          status messages; with all receivers on the main loop, then
+ *          spread over worker threads.
+ * client - commands the daemon answers from its state cache, sent one at
+ *          a time and then pipelined, through the client library.
+ *
+ * Commands to receivers are not paced, so the wait between commands does
+ * not hide the time the daemon itself takes.
+ */
+
+#define _XOPEN_SOURCE 600 /* posix_openpt */
+#define _DEFAULT_SOURCE /* cfmakeraw */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "onkyoclient.h"
+
+/** Commands timed for each measurement */
+#define BENCH_COMMANDS 500
+/** Status messages each flooding receiver sends per second, about twenty
+ * times what a serial link carries */
+#define FLOOD_RATE 2000
+/** Longest we wait for the daemon to come up, in milliseconds */
+#define STARTUP_WAIT 10000
+
+/** A fake receiver on the master side of a pseudo terminal */
+struct fake {
+	int fd;
+	char *slave;
+	char buf[256];
+	size_t len;
+	/** set if the receiver sends status messages nonstop, and how many it
+	 * has sent */
+	int flood;
+	unsigned long flooded;
+	/** when the last command got to us */
+	struct timeval last_cmd;
+	/** set once the daemon has asked for the power status */
+	int seen;
+};
+
+static const char *daemon_path = "./onkyocontrol";
+static pid_t daemon_pid = -1;
+static char sock_path[64];
+static char conf_path[64];
+
+static struct fake *fakes = NULL;
+static size_t fake_count = 0;
+/** fakes we poll for commands; all of them while starting up, otherwise
+ * only those the benchmark talks to or that flood */
+static int poll_all = 1;
+/** when the floods started, 0 if nothing floods */
+static struct timeval flood_start;
+
+static struct onkyo_client *client = NULL;
+static struct pollfd *pollfds = NULL;
+
+static long usecs_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000L +
+		(now.tv_usec - start->tv_usec);
+}
+
+/**
+ * Answer the commands a fake receiver has been sent. Queries get a canned
+ * value, anything else is echoed back as the new value.
+ * @param f the fake receiver
+ */
+static void fake_read(struct fake *f)
+{
+	char *start, *next, *end;
+	ssize_t count;
+
+	count = read(f->fd, f->buf + f->len, sizeof(f->buf) - f->len - 1);
+	if(count <= 0)
+		return;
+	f->len += (size_t)count;
+	f->buf[f->len] = '\0';
+
+	start = f->buf;
+	while((next = strstr(start, "!1")) && (end = strpbrk(next, "\r\n"))) {
+		char reply[64], prefix[4];
+		const char *arg = next + 5;
+
+		*end = '\0';
+		gettimeofday(&f->last_cmd, NULL);
+		snprintf(prefix, sizeof(prefix), "%s", next + 2);
+		if(strcmp(arg, "QSTN") == 0) {
+			f->seen = 1;
+			arg = strcmp(prefix, "PWR") == 0 ? "01" : "00";
+		}
+		snprintf(reply, sizeof(reply), "!1%s%s\x1a", prefix, arg);
+		if(write(f->fd, reply, strlen(reply)) == -1 && errno != EAGAIN)
+			perror("write()");
+		start = end + 1;
+	}
+	/* keep a partial command for next time */
+	start = next ? next : f->buf + f->len;
+	f->len -= (size_t)(start - f->buf);
+	memmove(f->buf, start, f->len);
+	if(f->len >= sizeof(f->buf) - 1)
+		f->len = 0;
+}
+
+/**
+ * Send the status messages a flooding receiver is due to have sent by now.
+ * @param f the fake receiver
+ */
+static void fake_flood(struct fake *f)
+{
+	char burst[256];
+	unsigned long due;
+	size_t len = 0;
+
+	due = (unsigned long)(usecs_since(&flood_start) / (1000000L / FLOOD_RATE));
+	while(f->flooded < due && len + 9 <= sizeof(burst)) {
+		len += (size_t)sprintf(burst + len, "!1MVL%02X\x1a",
+				(unsigned int)(f->flooded++ % 80));
+	}
+	/* if the daemon falls behind, whatever does not fit is lost */
+	if(len && write(f->fd, burst, len) == -1 && errno != EAGAIN)
+		perror("write()");
+}
+
+/**
+ * Set up fake receivers on pseudo terminals.
+ * @param count the number of receivers
+ * @return 0 on success, -1 on failure
+ */
+static int fakes_open(size_t count)
+{
+	size_t i;
+
+	fakes = calloc(count, sizeof(struct fake));
+	pollfds = calloc(count + 1, sizeof(struct pollfd));
+	if(!fakes || !pollfds)
+		return -1;
+	for(i = 0; i < count; i++) {
+		struct fake *f = &fakes[i];
+		struct termios tio;
+
+		f->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if(f->fd == -1 || grantpt(f->fd) == -1 || unlockpt(f->fd) == -1) {
+			perror("posix_openpt()");
+			return -1;
+		}
+		tcgetattr(f->fd, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(f->fd, TCSANOW, &tio);
+		f->slave = strdup(ptsname(f->fd));
+		fake_count++;
+	}
+	return 0;
+}
+
+static void fakes_close(void)
+{
+	size_t i;
+
+	for(i = 0; i < fake_count; i++) {
+		close(fakes[i].fd);
+		free(fakes[i].slave);
+	}
+	free(fakes);
+	free(pollfds);
+	fakes = NULL;
+	pollfds = NULL;
+	fake_count = 0;
+}
+
+/**
+ * Start the daemon with our fake receivers, named r0, r1 and so on.
+ * @param threads the number of worker threads, 0 for none
+ * @return 0 on success, -1 on failure
+ */
+static int daemon_start(int threads)
+{
+	char **argv, thread_arg[16];
+	size_t i, argc = 0;
+	FILE *conf;
+
+	snprintf(sock_path, sizeof(sock_path), "/tmp/onkyobench-%d.sock",
+			(int)getpid());
+	snprintf(conf_path, sizeof(conf_path), "/tmp/onkyobench-%d.conf",
+			(int)getpid());
+	conf = fopen(conf_path, "w");
+	if(!conf) {
+		perror(conf_path);
+		return -1;
+	}
+	fprintf(conf, "pacing 0\n");
+	fclose(conf);
+
+	argv = calloc(fake_count * 2 + 10, sizeof(char *));
+	if(!argv)
+		return -1;
+	argv[argc++] = (char *)daemon_path;
+	argv[argc++] = "--socket";
+	argv[argc++] = sock_path;
+	argv[argc++] = "--config";
+	argv[argc++] = conf_path;
+	snprintf(thread_arg, sizeof(thread_arg), "%d", threads);
+	argv[argc++] = "--threads";
+	argv[argc++] = thread_arg;
+	for(i = 0; i < fake_count; i++) {
+		char *spec = malloc(strlen(fakes[i].slave) + 16);
+		if(!spec)
+			return -1;
+		sprintf(spec, "r%zu=%s", i, fakes[i].slave);
+		argv[argc++] = "-s";
+		argv[argc++] = spec;
+	}
+
+	daemon_pid = fork();
+	if(daemon_pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		execv(daemon_path, argv);
+		_exit(127);
+	}
+	for(i = 0; i < fake_count; i++)
+		free(argv[i * 2 + 8]);
+	free(argv);
+	if(daemon_pid == -1) {
+		perror("fork()");
+		return -1;
+	}
+	return 0;
+}
+
+static void daemon_stop(void)
+{
+	if(daemon_pid > 0) {
+		kill(daemon_pid, SIGTERM);
+		waitpid(daemon_pid, NULL, 0);
+		daemon_pid = -1;
+	}
+	unlink(sock_path);
+	unlink(conf_path);
+}
+
+/**
+ * Get the CPU time the daemon has used so far, over all of its threads.
+ * @return the time in microseconds
+ */
+static long daemon_cpu(void)
+{
+	char path[64];
+	struct dirent *ent;
+	DIR *dir;
+	long total = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", (int)daemon_pid);
+	dir = opendir(path);
+	if(!dir)
+		return 0;
+	while((ent = readdir(dir))) {
+		char stat[PATH_MAX];
+		unsigned long long ns;
+		FILE *f;
+
+		if(ent->d_name[0] == '.')
+			continue;
+		snprintf(stat, sizeof(stat), "%s/%s/schedstat", path, ent->d_name);
+		f = fopen(stat, "r");
+		if(!f)
+			continue;
+		if(fscanf(f, "%llu", &ns) == 1)
+			total += (long)(ns / 1000);
+		fclose(f);
+	}
+	closedir(dir);
+	return total;
+}
+
+/**
+ * Run one pass of our loop: answer the fake receivers, keep the floods
+ * going, and let the client library do its work.
+ * @param timeout the longest to wait, in milliseconds
+ */
+static void pump(int timeout)
+{
+	size_t i, nfds = 0;
+	int lib_timeout;
+
+	if(timerisset(&flood_start)) {
+		for(i = 0; i < fake_count; i++) {
+			if(fakes[i].flood)
+				fake_flood(&fakes[i]);
+		}
+		/* come back soon to send the next messages */
+		timeout = 1;
+	}
+	if(onkyo_client_fd(client) > -1) {
+		pollfds[nfds].fd = onkyo_client_fd(client);
+		pollfds[nfds].events = onkyo_client_events(client);
+		nfds++;
+	}
+	for(i = 0; i < fake_count; i++) {
+		if(!poll_all && !fakes[i].flood && !fakes[i].seen)
+			continue;
+		pollfds[nfds].fd = fakes[i].fd;
+		pollfds[nfds].events = POLLIN;
+		nfds++;
+	}
+	lib_timeout = onkyo_client_timeout(client);
+	if(lib_timeout > -1 && lib_timeout < timeout)
+		timeout = lib_timeout;
+	if(poll(pollfds, (nfds_t)nfds, timeout) == -1 && errno != EINTR) {
+		perror("poll()");
+		return;
+	}
+
+	nfds = 0;
+	if(onkyo_client_fd(client) > -1)
+		onkyo_client_process(client, pollfds[nfds++].revents);
+	else
+		onkyo_client_process(client, 0);
+	for(i = 0; i < fake_count; i++) {
+		if(!poll_all && !fakes[i].flood && !fakes[i].seen)
+			continue;
+		/* a terminal nobody has opened yet reads as hung up */
+		if(pollfds[nfds++].revents & POLLIN)
+			fake_read(&fakes[i]);
+	}
+}
+
+static int hello = 0;
+static size_t powered = 0;
+
+static void on_event(struct onkyo_client *c, const struct onkyo_event *event,
+		void *data)
+{
+	(void)c;
+	(void)data;
+	if(event->type == ONKYO_EVENT_HELLO)
+		hello = 1;
+	else if(event->type == ONKYO_EVENT_STATUS && event->field &&
+			strcmp(event->field, "power") == 0)
+		powered++;
+	else if(event->type == ONKYO_EVENT_CLOSED)
+		hello = -1;
+}
+
+/**
+ * Start the daemon, connect to it, and wait for every receiver to report
+ * its power status.
+ * @param threads the number of worker threads, 0 for none
+ * @return 0 on success, -1 on failure
+ */
+static int setup(int threads)
+{
+	struct timeval start;
+	size_t i = 0;
+
+	hello = 0;
+	powered = 0;
+	poll_all = 1;
+	if(daemon_start(threads) == -1)
+		return -1;
+	client = onkyo_client_new(on_event, NULL);
+	if(!client)
+		return -1;
+
+	gettimeofday(&start, NULL);
+	while(usecs_since(&start) < STARTUP_WAIT * 1000L) {
+		if(hello < 1 && onkyo_client_fd(client) == -1)
+			onkyo_client_connect_unix(client, sock_path);
+		pump(10);
+		if(hello == -1) {
+			/* not listening yet; try again */
+			hello = 0;
+			continue;
+		}
+		for(i = 0; i < fake_count && fakes[i].seen; i++)
+			;
+		if(hello == 1 && i == fake_count)
+			break;
+	}
+	if(hello != 1 || i != fake_count) {
+		fprintf(stderr, "daemon did not come up with %zu receivers\n",
+				fake_count);
+		return -1;
+	}
+	/* let the power replies work their way through */
+	gettimeofday(&start, NULL);
+	while(usecs_since(&start) < 200000)
+		pump(10);
+	for(i = 0; i < fake_count; i++)
+		fakes[i].seen = 0;
+	poll_all = 0;
+	return 0;
+}
+
+static void teardown(void)
+{
+	onkyo_client_free(client);
+	client = NULL;
+	timerclear(&flood_start);
+	daemon_stop();
+	fakes_close();
+}
+
+/** One timed command */
+struct timing {
+	struct timeval sent;
+	int done;
+	long rtt;
+};
+
+static void on_done(struct onkyo_client *c, const struct onkyo_event *event,
+		void *data)
+{
+	struct timing *t = data;
+
+	(void)c;
+	if(event->type == ONKYO_EVENT_TIMEOUT || event->type == ONKYO_EVENT_CLOSED)
+		t->rtt = -1;
+	else
+		t->rtt = usecs_since(&t->sent);
+	t->done = 1;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+/** Results of timing commands to one receiver */
+struct result {
+	long rtt_p50;
+	long rtt_p99;
+	long arrive_p50;
+	long arrive_p99;
+	long cpu_per_cmd;
+	int failed;
+};
+
+/**
+ * Time commands to one receiver, one at a time, from when each is sent to
+ * when its status comes back, and to when it reaches the receiver.
+ * @param target the index of the receiver
+ * @param res location to store the results
+ */
+static void time_commands(size_t target, struct result *res)
+{
+	long rtt[BENCH_COMMANDS], arrive[BENCH_COMMANDS];
+	struct fake *f = &fakes[target];
+	long cpu;
+	int i, n = 0;
+
+	f->seen = 1;
+	memset(res, 0, sizeof(*res));
+	cpu = daemon_cpu();
+	for(i = 0; i < BENCH_COMMANDS; i++) {
+		struct timing t;
+		char cmd[64];
+
+		/* the default receiver answers without an "@name " prefix */
+		if(target == 0)
+			snprintf(cmd, sizeof(cmd), "volume %d", 20 + i % 2);
+		else
+			snprintf(cmd, sizeof(cmd), "@r%zu volume %d", target, 20 + i % 2);
+		memset(&t, 0, sizeof(t));
+		timerclear(&f->last_cmd);
+		gettimeofday(&t.sent, NULL);
+		if(onkyo_client_send(client, cmd, on_done, &t) == -1) {
+			res->failed++;
+			continue;
+		}
+		while(!t.done)
+			pump(100);
+		if(t.rtt < 0) {
+			res->failed++;
+			continue;
+		}
+		rtt[n] = t.rtt;
+		arrive[n] = (f->last_cmd.tv_sec - t.sent.tv_sec) * 1000000L +
+			(f->last_cmd.tv_usec - t.sent.tv_usec);
+		n++;
+	}
+	res->cpu_per_cmd = (daemon_cpu() - cpu) / BENCH_COMMANDS;
+	if(n == 0)
+		return;
+	qsort(rtt, (size_t)n, sizeof(long), cmp_long);
+	qsort(arrive, (size_t)n, sizeof(long), cmp_long);
+	res->rtt_p50 = rtt[n / 2];
+	res->rtt_p99 = rtt[n * 99 / 100];
+	res->arrive_p50 = arrive[n / 2];
+	res->arrive_p99 = arrive[n * 99 / 100];
+}
+
+/**
+ * Measure command round trips to one receiver among a growing number of
+ * idle ones.
+ * @param counts the receiver counts to try
+ * @param count the number of receiver counts
+ * @return 0 on success, -1 on failure
+ */
+static int bench_fleet(const size_t *counts, size_t count)
+{
+	size_t i;
+
+	printf("fleet: %d commands to the last receiver, the others idle\n",
+			BENCH_COMMANDS);
+	printf("%10s %12s %12s %14s %14s\n", "receivers", "rtt p50 us",
+			"rtt p99 us", "cpu/cmd us", "idle cpu us/s");
+	for(i = 0; i < count; i++) {
+		struct result res;
+		struct timeval start;
+		long cpu;
+
+		if(fakes_open(counts[i]) == -1 || setup(0) == -1) {
+			teardown();
+			return -1;
+		}
+		/* an idle second, with nothing due but the receivers' timers */
+		cpu = daemon_cpu();
+		gettimeofday(&start, NULL);
+		while(usecs_since(&start) < 1000000)
+			pump(100);
+		cpu = daemon_cpu() - cpu;
+		time_commands(counts[i] - 1, &res);
+		printf("%10zu %12ld %12ld %14ld %14ld", counts[i], res.rtt_p50,
+				res.rtt_p99, res.cpu_per_cmd, cpu);
+		if(res.failed)
+			printf("  (%d failed)", res.failed);
+		printf("\n");
+		teardown();
+	}
+	return 0;
+}
+
+/**
+ * Measure command round trips to a quiet receiver, first with the others
+ * idle and then with them all flooding status messages, with and without
+ * worker threads.
+ * @param receivers the number of receivers
+ * @param threads the worker thread counts to try
+ * @param count the number of thread counts
+ * @return 0 on success, -1 on failure
+ */
+static int bench_shards(size_t receivers, const int *threads, size_t count)
+{
+	size_t i, j;
+	int flood;
+
+	printf("shards: %d commands to a quiet receiver, %zu others idle or "
+			"sending %d messages/s\n", BENCH_COMMANDS, receivers - 1,
+			FLOOD_RATE);
+	/* worker threads only pay off with cores to run them on */
+	printf("%ld CPUs online\n", sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%8s %8s %12s %12s %14s %14s\n", "threads", "others",
+			"rtt p50 us", "rtt p99 us", "arrive p50 us", "arrive p99 us");
+	for(i = 0; i < count; i++) {
+		for(flood = 0; flood <= 1; flood++) {
+			struct result res;
+
+			if(fakes_open(receivers) == -1 || setup(threads[i]) == -1) {
+				teardown();
+				return -1;
+			}
+			if(flood) {
+				for(j = 0; j < receivers - 1; j++)
+					fakes[j].flood = 1;
+				gettimeofday(&flood_start, NULL);
+			}
+			time_commands(receivers - 1, &res);
+			printf("%8d %8s %12ld %12ld %14ld %14ld", threads[i],
+					flood ? "flood" : "idle", res.rtt_p50, res.rtt_p99,
+					res.arrive_p50, res.arrive_p99);
+			if(res.failed)
+				printf("  (%d failed)", res.failed);
+			printf("\n");
+			teardown();
+		}
+	}
+	return 0;
+}
+
+/** commands finished, and how many of them timed out or were cut off */
+static unsigned int completed = 0;
+static unsigned int failed = 0;
+
+static void on_count(struct onkyo_client *c, const struct onkyo_event *event,
+		void *data)
+{
+	(void)c;
+	(void)data;
+	completed++;
+	if(event->type == ONKYO_EVENT_TIMEOUT || event->type == ONKYO_EVENT_CLOSED)
+		failed++;
+}
+
+/**
+ * Measure commands answered by the daemon itself, sent through the client
+ * library one at a time and then all at once.
+ * @param commands the number of commands
+ * @return 0 on success, -1 on failure
+ */
+static int bench_client(unsigned int commands)
+{
+	struct timeval start;
+	long one, all;
+	unsigned int i;
+
+	if(fakes_open(1) == -1 || setup(0) == -1) {
+		teardown();
+		return -1;
+	}
+	printf("client: %u \"get power\" commands answered from the state cache\n",
+			commands);
+
+	completed = failed = 0;
+	gettimeofday(&start, NULL);
+	for(i = 0; i < commands; i++) {
+		onkyo_client_send(client, "get power", on_count, NULL);
+		while(completed <= i && onkyo_client_fd(client) > -1)
+			pump(100);
+	}
+	one = usecs_since(&start);
+
+	gettimeofday(&start, NULL);
+	for(i = 0; i < commands; i++)
+		onkyo_client_send(client, "get power", on_count, NULL);
+	while(completed < commands * 2 && onkyo_client_fd(client) > -1)
+		pump(100);
+	all = usecs_since(&start);
+
+	printf("%12s %12s %14s\n", "mode", "total ms", "commands/s");
+	printf("%12s %12ld %14.0f\n", "one by one", one / 1000,
+			commands * 1e6 / (double)(one ? one : 1));
+	printf("%12s %12ld %14.0f\n", "pipelined", all / 1000,
+			commands * 1e6 / (double)(all ? all : 1));
+	if(failed || completed < commands * 2)
+		printf("(%u of %u failed or did not finish)\n",
+				failed + commands * 2 - completed, commands * 2);
+	teardown();
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-d daemon] [fleet|shards|client]...\n\n", prog);
+	printf("Benchmarks the onkyocontrol daemon with fake receivers on pseudo\n"
+			"terminals. The daemon defaults to ./onkyocontrol; with no\n"
+			"benchmark named, all of them are run.\n");
+}
+
+/**
+ * Run one benchmark.
+ * @param name the name of the benchmark
+ * @return 0 on success, -1 on failure or an unknown name
+ */
+static int run(const char *name)
+{
+	static const size_t fleet_counts[] = { 1, 10, 100, 250, 500 };
+	static const int shard_threads[] = { 0, 1, 4 };
+
+	if(strcmp(name, "fleet") == 0)
+		return bench_fleet(fleet_counts,
+				sizeof(fleet_counts) / sizeof(fleet_counts[0]));
+	if(strcmp(name, "shards") == 0)
+		return bench_shards(8, shard_threads,
+				sizeof(shard_threads) / sizeof(shard_threads[0]));
+	if(strcmp(name, "client") == 0)
+		return bench_client(5000);
+	fprintf(stderr, "unknown benchmark: %s\n", name);
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret = 0;
+
+	while((opt = getopt(argc, argv, "d:h")) != -1) {
+		switch(opt) {
+			case 'd':
+				daemon_path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	/* results show up as each run finishes */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if(optind == argc) {
+		ret |= run("fleet");
+		ret |= run("shards");
+		ret |= run("client");
+	}
+	for(; optind < argc; optind++)
+		ret |= run(argv[optind]);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 noet: */
@@ -30,6 +30,15 @@
 /* forward-declared because of the circular reference */
 struct command;
 
+/** spare command queue entries kept for reuse, shared by all shards */
+static struct cmdqueue *cmd_pool = NULL;
+static pthread_mutex_t cmd_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef TINY
+/** the tiny build never allocates entries; they all come from here */
+static struct cmdqueue cmd_slab[QUEUE_POOL_SIZE];
+static size_t cmd_slab_used = 0;
+#endif
+
 typedef int (cmd_handler) (struct receiver *, const struct command *, char *);
 
 /** A specific command and associated handler function */
@@ -38,6 +47,26 @@ struct command {
 	const char *name;
 	const char *prefix;
 	cmd_handler *handler;
+	/** zone the command applies to, 1 for the main zone */
+	int zone;
+};
+
+/** A command that exists for every zone other than the main zone. These
+ * are expanded into "zone<N><name>" commands by init_commands(). */
+struct zone_command {
+	const char *name;
+	/** prefix to use from the zone_codes table, -1 if none */
+	int code;
+	cmd_handler *handler;
+};
+
+/** Receiver command prefixes for each zone, indexed by zone number - 1 */
+const char * const zone_codes[ZONE_COUNT][CODE_COUNT] = {
+	/* power, volume, mute,  input, tune,  preset */
+	{ "PWR",  "MVL",  "AMT", "SLI", "TUN", "PRS" },
+	{ "ZPW",  "ZVL",  "ZMT", "SLZ", "TUZ", "PRZ" },
+	{ "PW3",  "VL3",  "MT3", "SL3", "TU3", "PR3" },
+	{ "PW4",  "VL4",  "MT4", "SL4", "TU4", "PR4" },
 };
 
 /** A text to value mapping of code values, such as for inputs or modes */
@@ -47,6 +76,22 @@ struct code_map {
 	const char *value;
 };
 
+/**
+ * A collision-free lookup table of code values. Names are first hashed into
+ * a bucket; each bucket has a seed picked when the table is built so that
+ * every name in it lands in its own slot. A lookup is then always one bucket
+ * read and one slot read, for built-in names and aliases alike.
+ */
+struct code_table {
+	unsigned int *seeds;
+	size_t bucket_count;
+	const struct code_map **slots;
+	size_t slot_count;
+};
+
+/** Seeds to try for a bucket before the table is made larger */
+#define CODE_SEED_TRIES 4096
+
 /**
  * Convert a string, in place, to uppercase.
  * @param str string to convert (in place)
@@ -60,6 +105,87 @@ static void strtoupper(char *str)
 	}
 }
 
+/**
+ * Get a command queue entry, reusing a spare one if we have any. This may
+ * be called from any shard thread.
+ * @return the entry, NULL on allocation failure
+ */
+struct cmdqueue *cmdqueue_alloc(void)
+{
+	struct cmdqueue *q;
+
+	pthread_mutex_lock(&cmd_pool_lock);
+	q = cmd_pool;
+	if(q)
+		cmd_pool = q->next;
+#ifdef TINY
+	else if(cmd_slab_used < QUEUE_POOL_SIZE)
+		q = &cmd_slab[cmd_slab_used++];
+#endif
+	pthread_mutex_unlock(&cmd_pool_lock);
+#ifndef TINY
+	if(!q)
+		q = malloc(sizeof(struct cmdqueue));
+#endif
+	return q;
+}
+
+/**
+ * Give back a command queue entry got from cmdqueue_alloc(). It is kept for
+ * reuse rather than freed.
+ * @param q the entry
+ */
+void cmdqueue_free(struct cmdqueue *q)
+{
+	pthread_mutex_lock(&cmd_pool_lock);
+	q->next = cmd_pool;
+	cmd_pool = q;
+	pthread_mutex_unlock(&cmd_pool_lock);
+}
+
+/**
+ * Allocate spare command queue entries up front so queueing commands does
+ * not have to allocate memory later.
+ * @param count the number of entries to allocate
+ * @return 0 on success, -1 on allocation failure
+ */
+int cmdqueue_reserve(size_t count)
+{
+#ifdef TINY
+	/* the whole pool is always there */
+	return count <= QUEUE_POOL_SIZE ? 0 : -1;
+#else
+	size_t i;
+
+	for(i = 0; i < count; i++) {
+		struct cmdqueue *q = calloc(1, sizeof(struct cmdqueue));
+		if(!q)
+			return -1;
+		cmdqueue_free(q);
+	}
+	return 0;
+#endif
+}
+
+/**
+ * Free all spare command queue entries.
+ */
+void cmdqueue_clear(void)
+{
+	pthread_mutex_lock(&cmd_pool_lock);
+#ifdef TINY
+	cmd_pool = NULL;
+	cmd_slab_used = 0;
+#else
+	while(cmd_pool) {
+		struct cmdqueue *q = cmd_pool;
+		cmd_pool = q->next;
+		free(q);
+	}
+#endif
+	pthread_mutex_unlock(&cmd_pool_lock);
+}
+
 /**
  * Queue a receiver command to be sent when the device file descriptor
  * is available for writing. Queueing and sending asynchronously allows
@@ -82,12 +208,15 @@ static int cmd_attempt(struct receiver *rcvr,
 	if(strlen(cmd->prefix) + strlen(arg) >= BUF_SIZE)
 		return -1;
 
-	q = malloc(sizeof(struct cmdqueue));
+	q = cmdqueue_alloc();
 	if(!q)
 		return -1;
 
 	sprintf(q->cmd, "%s%s", cmd->prefix, arg);
 	q->hash = hash_sdbm(q->cmd);
+	timeval_clear(q->not_before);
+	gettimeofday(&q->queued, NULL);
+	q->sync = NULL;
 	q->next = NULL;
 
 	if(rcvr->queue == NULL) {
@@ -97,7 +226,7 @@ static int cmd_attempt(struct receiver *rcvr,
 		for(;;) {
 			if(ptr->hash == q->hash) {
 				/* command already in our queue, skip second copy */
-				free(q);
+				cmdqueue_free(q);
 				return 0;
 			}
 			if(!ptr->next)
@@ -147,10 +276,8 @@ static int handle_boolean(struct receiver *rcvr,
 	else if(strcmp(arg, "off") == 0)
 		return cmd_attempt(rcvr, cmd, "00");
 	else if(strcmp(arg, "toggle") == 0) {
-		const char *prefix = cmd->prefix;
 		/* toggle is applicable for mute, not for power */
-		if(strcmp(prefix, "AMT") == 0 || strcmp(prefix, "ZMT") == 0
-				|| strcmp(prefix, "MT3") == 0)
+		if(strcmp(cmd->prefix, zone_codes[cmd->zone - 1][CODE_MUTE]) == 0)
 			return cmd_attempt(rcvr, cmd, "TG");
 	}
 
@@ -247,6 +374,192 @@ static int handle_swlevel(struct receiver *rcvr,
 	return cmd_attempt(rcvr, cmd, cmdstr);
 }
 
+/** lookup tables for the built-in input and mode names and any aliases */
+static struct code_table input_table;
+static struct code_table mode_table;
+/** input and mode aliases read from the aliases file */
+static struct code_map *input_aliases = NULL;
+static size_t input_alias_count = 0;
+static struct code_map *mode_aliases = NULL;
+static size_t mode_alias_count = 0;
+
+/**
+ * Get the slot a name hashes to for a given seed.
+ * @param hash the name hash
+ * @param seed the seed of the bucket the name is in
+ * @param count the number of slots
+ * @return the slot index
+ */
+static size_t code_slot(unsigned long hash, unsigned int seed, size_t count)
+{
+	unsigned long long h = (unsigned long long)hash ^
+		((unsigned long long)seed * 0x9E3779B97F4A7C15ULL);
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return (size_t)(h % count);
+}
+
+/**
+ * Look up a code value by name hash.
+ * @param table the table to look in
+ * @param hash the hash of the upper case name
+ * @return the code value, NULL if there is no such name
+ */
+static const struct code_map *code_table_find(const struct code_table *table,
+		unsigned long hash)
+{
+	const struct code_map *code;
+	unsigned int seed;
+
+	if(!table->slot_count)
+		return NULL;
+	seed = table->seeds[hash % table->bucket_count];
+	code = table->slots[code_slot(hash, seed, table->slot_count)];
+	return code && code->hash == hash ? code : NULL;
+}
+
+static void code_table_free(struct code_table *table)
+{
+	free(table->seeds);
+	free(table->slots);
+	memset(table, 0, sizeof(struct code_table));
+}
+
+/**
+ * Compare buckets by the number of names in them, largest first.
+ */
+static int bucket_cmp(const void *a, const void *b)
+{
+	const size_t *x = a, *y = b;
+	return x[1] < y[1] ? 1 : x[1] > y[1] ? -1 : 0;
+}
+
+/**
+ * Place names into a table of a given size, picking a seed for each bucket
+ * so no two names share a slot. The largest buckets are placed first while
+ * the most slots are free.
+ * @param table the table, with its sizes set and its arrays allocated
+ * @param codes the names to place, all with different hashes
+ * @param count the number of names
+ * @return 0 on success, -1 if some bucket found no seed, -2 on allocation
+ * failure
+ */
+static int code_table_place(struct code_table *table,
+		const struct code_map **codes, size_t count)
+{
+	/* pairs of bucket number and bucket size, and slots for one bucket */
+	size_t (*order)[2], *placed;
+	size_t i, j, n;
+	int ret = 0;
+
+	order = calloc(table->bucket_count, sizeof(*order));
+	placed = calloc(count, sizeof(size_t));
+	if(!order || !placed) {
+		free(order);
+		free(placed);
+		return -2;
+	}
+	for(i = 0; i < table->bucket_count; i++)
+		order[i][0] = i;
+	for(i = 0; i < count; i++)
+		order[codes[i]->hash % table->bucket_count][1]++;
+	qsort(order, table->bucket_count, sizeof(*order), bucket_cmp);
+
+	for(i = 0; i < table->bucket_count && order[i][1] && ret == 0; i++) {
+		size_t bucket = order[i][0];
+		unsigned int seed;
+
+		for(seed = 0; seed < CODE_SEED_TRIES; seed++) {
+			n = 0;
+			for(j = 0; j < count; j++) {
+				size_t slot, k;
+				if(codes[j]->hash % table->bucket_count != bucket)
+					continue;
+				slot = code_slot(codes[j]->hash, seed, table->slot_count);
+				if(table->slots[slot])
+					break;
+				for(k = 0; k < n && placed[k] != slot; k++)
+					;
+				if(k < n)
+					break;
+				placed[n++] = slot;
+			}
+			if(j == count)
+				break;
+		}
+		if(seed == CODE_SEED_TRIES) {
+			ret = -1;
+			break;
+		}
+		table->seeds[bucket] = seed;
+		for(j = 0; j < count; j++) {
+			if(codes[j]->hash % table->bucket_count == bucket)
+				table->slots[code_slot(codes[j]->hash, seed,
+						table->slot_count)] = codes[j];
+		}
+	}
+
+	free(order);
+	free(placed);
+	return ret;
+}
+
+/**
+ * Build a lookup table from a built-in code list and its aliases. An alias
+ * with the name of a built-in code, or of an earlier alias, replaces it.
+ * @param table location to store the table
+ * @param builtin the built-in codes, ending with a NULL key
+ * @param extra the aliases
+ * @param extra_count the number of aliases
+ * @return 0 on success, -1 on allocation failure
+ */
+static int code_table_build(struct code_table *table,
+		const struct code_map *builtin,
+		const struct code_map *extra, size_t extra_count)
+{
+	const struct code_map **codes;
+	const struct code_map *code;
+	size_t count = 0, size, i, j;
+	int ret = -1;
+
+	for(code = builtin; code->key; code++)
+		count++;
+	codes = calloc(count + extra_count, sizeof(struct code_map *));
+	if(!codes)
+		return -1;
+
+	count = 0;
+	for(code = builtin; code->key; code++)
+		codes[count++] = code;
+	for(i = 0; i < extra_count; i++) {
+		for(j = 0; j < count && codes[j]->hash != extra[i].hash; j++)
+			;
+		codes[j] = &extra[i];
+		if(j == count)
+			count++;
+	}
+
+	memset(table, 0, sizeof(struct code_table));
+	/* start at a quarter more slots than names, and grow until every
+	 * bucket finds a seed */
+	for(size = count + count / 4 + 1; ret == -1 && size <= count * 8 + 8;
+			size += size / 4 + 1) {
+		code_table_free(table);
+		table->bucket_count = count / 4 + 1;
+		table->slot_count = size;
+		table->seeds = calloc(table->bucket_count, sizeof(unsigned int));
+		table->slots = calloc(size, sizeof(struct code_map *));
+		if(!table->seeds || !table->slots)
+			break;
+		ret = code_table_place(table, codes, count);
+	}
+	if(ret != 0)
+		code_table_free(table);
+	free(codes);
+	return ret == 0 ? 0 : -1;
+}
+
 static struct code_map inputs[] = {
 	{ 0, "DVR",       "00" },
 	{ 0, "VCR",       "00" },
@@ -282,7 +595,7 @@ static int handle_input(struct receiver *rcvr,
 {
 	int ret;
 	unsigned long hashval;
-	struct code_map *input;
+	const struct code_map *input;
 
 	ret = handle_standard(rcvr, cmd, arg);
 	if(ret != -2)
@@ -293,16 +606,11 @@ static int handle_input(struct receiver *rcvr,
 	ret = -1;
 
 	hashval = hash_sdbm(arg);
-	for(input = inputs; input->key; input++) {
-		if(input->hash == hashval) {
-			ret = cmd_attempt(rcvr, cmd, input->value);
-			break;
-		}
-	}
+	input = code_table_find(&input_table, hashval);
+	if(input)
+		ret = cmd_attempt(rcvr, cmd, input->value);
 	/* the following are only valid for zones */
-	if(ret == -1 &&
-			(strcmp(cmd->prefix, "SLZ") == 0 ||
-			 strcmp(cmd->prefix, "SL3") == 0)) {
+	if(ret == -1 && cmd->zone > 1) {
 		if(strcmp(arg, "OFF") == 0)
 			ret = cmd_attempt(rcvr, cmd, "7F");
 		else if(strcmp(arg, "SOURCE") == 0)
@@ -350,7 +658,7 @@ static int handle_mode(struct receiver *rcvr,
 {
 	int ret;
 	unsigned long hashval;
-	struct code_map *mode;
+	const struct code_map *mode;
 
 	ret = handle_standard(rcvr, cmd, arg);
 	if(ret != -2)
@@ -361,12 +669,9 @@ static int handle_mode(struct receiver *rcvr,
 	ret = -1;
 
 	hashval = hash_sdbm(arg);
-	for(mode = modes; mode->key; mode++) {
-		if(mode->hash == hashval) {
-			ret = cmd_attempt(rcvr, cmd, mode->value);
-			break;
-		}
-	}
+	mode = code_table_find(&mode_table, hashval);
+	if(mode)
+		ret = cmd_attempt(rcvr, cmd, mode->value);
 
 	return ret;
 }
@@ -455,22 +760,19 @@ static int handle_sleep(struct receiver *rcvr,
 }
 
 int write_fakesleep_status(struct receiver *rcvr,
-		struct timeval now, char zone)
+		struct timeval now, int zone)
 {
 	long mins;
 	time_t when;
 	char msg[BUF_SIZE];
 
-	if(zone == '2')
-		when = rcvr->zone2_sleep.tv_sec;
-	else if(zone == '3')
-		when = rcvr->zone3_sleep.tv_sec;
-	else
-		return - 1;
+	if(zone < 2 || zone > ZONE_COUNT)
+		return -1;
 
+	when = rcvr->zones[zone - 1].sleep.tv_sec;
 	mins = when > now.tv_sec ? (when - now.tv_sec + 59) / 60 : 0;
-	snprintf(msg, sizeof(msg), "OK:zone%csleep:%ld\n", zone, mins);
-	write_to_connections(msg);
+	snprintf(msg, sizeof(msg), "OK:zone%dsleep:%ld\n", zone, mins);
+	write_status(rcvr, msg);
 	return 0;
 }
 
@@ -479,23 +781,18 @@ static int handle_fakesleep(struct receiver *rcvr,
 {
 	struct timeval now;
 	char *test;
-	char zone;
+	struct zone *zone;
 
 	gettimeofday(&now, NULL);
-	zone = cmd->prefix[0];
-
-	if(zone != '2' && zone != '3')
+	if(cmd->zone < 2 || cmd->zone > ZONE_COUNT)
 		return -1;
+	zone = &rcvr->zones[cmd->zone - 1];
 
 	if(!arg || strcmp(arg, "status") == 0) {
 		/* do nothing with the arg, we'll end up writing a message */
 	} else if(strcmp(arg, "off") == 0) {
 		/* clear out any future receiver set sleep time */
-		if(zone == '2') {
-			timeval_clear(rcvr->zone2_sleep);
-		} else if(zone == '3') {
-			timeval_clear(rcvr->zone3_sleep);
-		}
+		timeval_clear(zone->sleep);
 	} else {
 		/* otherwise we probably have a number */
 		long mins = strtol(arg, &test, 10);
@@ -507,16 +804,11 @@ static int handle_fakesleep(struct receiver *rcvr,
 			/* range error */
 			return -1;
 		}
-		if(zone == '2') {
-			rcvr->zone2_sleep = now;
-			rcvr->zone2_sleep.tv_sec += 60 * mins;
-		} else if(zone == '3') {
-			rcvr->zone3_sleep = now;
-			rcvr->zone3_sleep.tv_sec += 60 * mins;
-		}
+		zone->sleep = now;
+		zone->sleep.tv_sec += 60 * mins;
 	}
 
-	write_fakesleep_status(rcvr, now, zone);
+	write_fakesleep_status(rcvr, now, cmd->zone);
 	return 0;
 }
 
@@ -537,31 +829,30 @@ static int handle_status(struct receiver *rcvr,
 		const struct command *cmd, char *arg)
 {
 	int ret = 0;
+	int zone = cmd->zone;
+	const char * const *codes;
+
+	/* plain "status" can be pointed at a zone, e.g. "status zone2" */
+	if(zone == 1 && arg && strcmp(arg, "main") != 0) {
+		char *test;
+		if(strncmp(arg, "zone", 4) != 0)
+			return -1;
+		zone = (int)strtol(arg + 4, &test, 10);
+		if(*test != '\0' || zone < 2 || zone > ZONE_COUNT)
+			return -1;
+	}
+	codes = zone_codes[zone - 1];
 
 	/* this handler is a bit different in that we call
 	 * multiple receiver commands */
-	if(strcmp(cmd->name, "status") == 0 && (!arg || strcmp(arg, "main") == 0)) {
-		ret += cmd_attempt_raw(rcvr, "PWR", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "MVL", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "AMT", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "SLI", "QSTN");
+	ret += cmd_attempt_raw(rcvr, codes[CODE_POWER], "QSTN");
+	ret += cmd_attempt_raw(rcvr, codes[CODE_VOLUME], "QSTN");
+	ret += cmd_attempt_raw(rcvr, codes[CODE_MUTE], "QSTN");
+	ret += cmd_attempt_raw(rcvr, codes[CODE_INPUT], "QSTN");
+	/* listening mode only exists for the main zone */
+	if(zone == 1)
 		ret += cmd_attempt_raw(rcvr, "LMD", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "TUN", "QSTN");
-	} else if(strcmp(cmd->name, "zone2status") == 0 || (arg && strcmp(arg, "zone2") == 0)) {
-		ret += cmd_attempt_raw(rcvr, "ZPW", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "ZVL", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "ZMT", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "SLZ", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "TUZ", "QSTN");
-	} else if(strcmp(cmd->name, "zone3status") == 0 || (arg && strcmp(arg, "zone3") == 0)) {
-		ret += cmd_attempt_raw(rcvr, "PW3", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "VL3", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "MT3", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "SL3", "QSTN");
-		ret += cmd_attempt_raw(rcvr, "TU3", "QSTN");
-	} else {
-		return -1;
-	}
+	ret += cmd_attempt_raw(rcvr, codes[CODE_TUNE], "QSTN");
 
 	return ret < 0 ? -2 : 0;
 }
@@ -580,76 +871,291 @@ static int handle_quit(UNUSED struct receiver *rcvr,
 
 static struct command command_list[] = {
 	/*
-	{ 0, name,      prefix, handle_func }, */
-	{ 0, "power",    "PWR", handle_boolean },
-	{ 0, "volume",   "MVL", handle_volume },
-	{ 0, "dbvolume", "MVL", handle_dbvolume },
-	{ 0, "mute",     "AMT", handle_boolean },
-	{ 0, "input",    "SLI", handle_input },
-	{ 0, "mode",     "LMD", handle_mode },
-	{ 0, "tune",     "TUN", handle_tune },
-	{ 0, "preset",   "PRS", handle_preset },
-	{ 0, "swlevel",  "SWL", handle_swlevel },
-	{ 0, "avsync",   "AVS", handle_avsync },
-	{ 0, "memory",   "MEM", handle_memory },
-	{ 0, "audyssey", "ADY", handle_boolean },
-	{ 0, "dyneq",    "ADQ", handle_boolean },
-
-	{ 0, "status",   NULL,  handle_status },
-
-	{ 0, "zone2power",  "ZPW", handle_boolean },
-	{ 0, "zone2volume", "ZVL", handle_volume },
-	{ 0, "zone2dbvolume","ZVL",handle_dbvolume },
-	{ 0, "zone2mute",   "ZMT", handle_boolean },
-	{ 0, "zone2input",  "SLZ", handle_input },
-	{ 0, "zone2tune",   "TUZ", handle_tune },
-	{ 0, "zone2preset", "PRZ", handle_preset },
-
-	{ 0, "zone2status", NULL,  handle_status },
-
-	{ 0, "zone3power",  "PW3", handle_boolean },
-	{ 0, "zone3volume", "VL3", handle_volume },
-	{ 0, "zone3dbvolume","VL3",handle_dbvolume },
-	{ 0, "zone3mute",   "MT3", handle_boolean },
-	{ 0, "zone3input",  "SL3", handle_input },
-	{ 0, "zone3tune",   "TU3", handle_tune },
-	{ 0, "zone3preset", "PR3", handle_preset },
-
-	{ 0, "zone3status", NULL,  handle_status },
-
-	{ 0, "sleep",       "SLP", handle_sleep },
-	{ 0, "zone2sleep",  "2",   handle_fakesleep },
-	{ 0, "zone3sleep",  "3",   handle_fakesleep },
-
-	{ 0, "raw",  "", handle_raw },
-	{ 0, "quit", "", handle_quit },
-
-	{ 0, NULL, NULL, NULL },
+	{ 0, name,      prefix, handle_func,     zone }, */
+	{ 0, "power",    "PWR", handle_boolean,  1 },
+	{ 0, "volume",   "MVL", handle_volume,   1 },
+	{ 0, "dbvolume", "MVL", handle_dbvolume, 1 },
+	{ 0, "mute",     "AMT", handle_boolean,  1 },
+	{ 0, "input",    "SLI", handle_input,    1 },
+	{ 0, "mode",     "LMD", handle_mode,     1 },
+	{ 0, "tune",     "TUN", handle_tune,     1 },
+	{ 0, "preset",   "PRS", handle_preset,   1 },
+	{ 0, "swlevel",  "SWL", handle_swlevel,  1 },
+	{ 0, "avsync",   "AVS", handle_avsync,   1 },
+	{ 0, "memory",   "MEM", handle_memory,   1 },
+	{ 0, "audyssey", "ADY", handle_boolean,  1 },
+	{ 0, "dyneq",    "ADQ", handle_boolean,  1 },
+
+	{ 0, "status",   NULL,  handle_status,   1 },
+
+	{ 0, "sleep",    "SLP", handle_sleep,    1 },
+
+	{ 0, "raw",  "", handle_raw,  1 },
+	{ 0, "quit", "", handle_quit, 1 },
+
+	{ 0, NULL, NULL, NULL, 0 },
+};
+
+static const struct zone_command zone_command_list[] = {
+	/*
+	{ name,       code,        handle_func }, */
+	{ "power",    CODE_POWER,  handle_boolean },
+	{ "volume",   CODE_VOLUME, handle_volume },
+	{ "dbvolume", CODE_VOLUME, handle_dbvolume },
+	{ "mute",     CODE_MUTE,   handle_boolean },
+	{ "input",    CODE_INPUT,  handle_input },
+	{ "tune",     CODE_TUNE,   handle_tune },
+	{ "preset",   CODE_PRESET, handle_preset },
+
+	{ "status",   -1,          handle_status },
+	{ "sleep",    -1,          handle_fakesleep },
 };
 
+#define ZONE_COMMANDS \
+	(sizeof(zone_command_list) / sizeof(zone_command_list[0]))
+
+/** The zone command list expanded for zones 2 and up, and their names
+ * packed together */
+static struct command zone_commands[(ZONE_COUNT - 1) * ZONE_COMMANDS + 1];
+static struct strpool zone_command_names;
+
 /**
  * Initialize our list of commands. This must be called before the first
  * call to process_command().
+ * @return 0 on success, -1 on allocation failure
  */
-void init_commands(void)
+int init_commands(void)
 {
+	/* offsets of each expanded name, which may move while being added to */
+	long names[(ZONE_COUNT - 1) * ZONE_COMMANDS];
 	unsigned int cmd_count = 0;
 	struct command *ptr;
 	struct code_map *code;
+	int zone;
+	size_t i;
 
 	for(ptr = command_list; ptr->name; ptr++) {
 		ptr->hash = hash_sdbm(ptr->name);
 		cmd_count++;
 	}
 
+	ptr = zone_commands;
+	for(zone = 2; zone <= ZONE_COUNT; zone++) {
+		for(i = 0; i < ZONE_COMMANDS; i++) {
+			const struct zone_command *zc = &zone_command_list[i];
+			long *name = &names[ptr - zone_commands];
+
+			*name = strpool_add(&zone_command_names, "zone%d%s",
+					zone, zc->name);
+			if(*name == -1)
+				return -1;
+			ptr->prefix = zc->code >= 0 ? zone_codes[zone - 1][zc->code] : NULL;
+			ptr->handler = zc->handler;
+			ptr->zone = zone;
+			ptr++;
+			cmd_count++;
+		}
+	}
+	strpool_trim(&zone_command_names);
+	for(i = 0; i < (ZONE_COUNT - 1) * ZONE_COMMANDS; i++) {
+		zone_commands[i].name = zone_command_names.buf + names[i];
+		zone_commands[i].hash = hash_sdbm(zone_commands[i].name);
+	}
+
 	for(code = inputs; code->key; code++) {
 		code->hash = hash_sdbm(code->key);
 	}
 	for(code = modes; code->key; code++) {
 		code->hash = hash_sdbm(code->key);
 	}
+	if(code_table_build(&input_table, inputs, NULL, 0) == -1 ||
+			code_table_build(&mode_table, modes, NULL, 0) == -1)
+		return -1;
 
 	printf("%u commands added to command list.\n", cmd_count);
+	return 0;
+}
+
+static void free_aliases(struct code_map *list, size_t count)
+{
+	size_t i;
+	for(i = 0; i < count; i++) {
+		free((char *)list[i].key);
+		free((char *)list[i].value);
+	}
+	free(list);
+}
+
+/**
+ * Add an alias to a list of aliases.
+ * @param list the list to add to
+ * @param count the number of aliases in the list
+ * @param name the alias name, which is copied in upper case
+ * @param value the receiver code, which is copied in upper case
+ * @return 0 on success, -1 on allocation failure
+ */
+static int add_alias(struct code_map **list, size_t *count,
+		const char *name, const char *value)
+{
+	struct code_map *new_list, *a;
+
+	new_list = realloc(*list, (*count + 1) * sizeof(struct code_map));
+	if(!new_list)
+		return -1;
+	*list = new_list;
+	a = &new_list[*count];
+	a->key = strdup(name);
+	a->value = strdup(value);
+	if(!a->key || !a->value) {
+		free((char *)a->key);
+		free((char *)a->value);
+		return -1;
+	}
+	strtoupper((char *)a->key);
+	strtoupper((char *)a->value);
+	a->hash = hash_sdbm(a->key);
+	(*count)++;
+	return 0;
+}
+
+/**
+ * Read an aliases file and rebuild the input and mode lookup tables with
+ * the aliases in it, so aliases are found as quickly as built-in names.
+ * Each line is the command the alias is for, the alias name (which may
+ * contain spaces), and the two character receiver code it stands for:
+ *
+ *   # comments and blank lines are ignored
+ *   input apple tv 10
+ *   mode movie 82
+ *
+ * If the file cannot be read or has errors, the current aliases are kept.
+ * This must only be called from the main thread.
+ * @param path the aliases file, NULL to drop all aliases
+ * @return 0 on success, -1 on failure
+ */
+int load_aliases(const char *path)
+{
+	struct code_map *new_inputs = NULL, *new_modes = NULL;
+	size_t new_input_count = 0, new_mode_count = 0;
+	struct code_table new_input_table, new_mode_table;
+	unsigned int lineno = 0;
+	int ret = 0;
+
+	if(path) {
+		char line[BUF_SIZE];
+		FILE *fp = fopen(path, "r");
+		if(!fp) {
+			perror(path);
+			return -1;
+		}
+		while(ret == 0 && fgets(line, sizeof(line), fp)) {
+			char *command = line, *name, *value, *end;
+
+			lineno++;
+			while(isspace((unsigned char)*command))
+				command++;
+			end = command + strlen(command);
+			while(end > command && isspace((unsigned char)end[-1]))
+				*--end = '\0';
+			if(*command == '\0' || *command == '#')
+				continue;
+
+			/* the command is the first word, the code the last */
+			name = strchr(command, ' ');
+			value = strrchr(command, ' ');
+			ret = -1;
+			if(!name || name == value)
+				break;
+			*name++ = '\0';
+			*value++ = '\0';
+			while(isspace((unsigned char)*name))
+				name++;
+			end = name + strlen(name);
+			while(end > name && isspace((unsigned char)end[-1]))
+				*--end = '\0';
+			if(*name == '\0' || strlen(value) != 2 ||
+					!isxdigit((unsigned char)value[0]) ||
+					!isxdigit((unsigned char)value[1]))
+				break;
+			if(strcmp(command, "input") == 0)
+				ret = add_alias(&new_inputs, &new_input_count, name, value);
+			else if(strcmp(command, "mode") == 0)
+				ret = add_alias(&new_modes, &new_mode_count, name, value);
+		}
+		fclose(fp);
+		if(ret == -1)
+			fprintf(stderr, "%s:%u: invalid alias\n", path, lineno);
+	}
+
+	if(ret == 0 && code_table_build(&new_input_table, inputs,
+				new_inputs, new_input_count) == -1)
+		ret = -1;
+	if(ret == 0 && code_table_build(&new_mode_table, modes,
+				new_modes, new_mode_count) == -1) {
+		code_table_free(&new_input_table);
+		ret = -1;
+	}
+	if(ret == -1) {
+		free_aliases(new_inputs, new_input_count);
+		free_aliases(new_modes, new_mode_count);
+		return -1;
+	}
+
+	code_table_free(&input_table);
+	code_table_free(&mode_table);
+	free_aliases(input_aliases, input_alias_count);
+	free_aliases(mode_aliases, mode_alias_count);
+	input_table = new_input_table;
+	mode_table = new_mode_table;
+	input_aliases = new_inputs;
+	input_alias_count = new_input_count;
+	mode_aliases = new_modes;
+	mode_alias_count = new_mode_count;
+	printf("%lu input and %lu mode aliases loaded.\n",
+			(unsigned long)input_alias_count, (unsigned long)mode_alias_count);
+	return 0;
+}
+
+/**
+ * Split a command string into the standard "<cmd> <arg>" format and look up
+ * the handler for it.
+ * @param str the full command string, e.g. "power on"
+ * @param cmdstr location to store the split string (must be freed)
+ * @param argstr location to store the argument, NULL if there is none
+ * @return the command, NULL if no handler was found
+ */
+static struct command *find_command(const char *str,
+		char **cmdstr, char **argstr)
+{
+	unsigned long hashval;
+	char *c;
+	struct command *cmd;
+
+	*cmdstr = strdup(str);
+	if(!*cmdstr)
+		return NULL;
+	/* start by killing trailing whitespace of any sort */
+	c = *cmdstr + strlen(*cmdstr) - 1;
+	while(c >= *cmdstr && isspace(*c))
+		*c-- = '\0';
+	/* start by splitting the string after the cmd */
+	*argstr = strchr(*cmdstr, ' ');
+	/* if we had an arg, set our pointers correctly */
+	if(*argstr) {
+		**argstr = '\0';
+		(*argstr)++;
+	}
+
+	hashval = hash_sdbm(*cmdstr);
+	for(cmd = command_list; cmd->name; cmd++) {
+		if(cmd->hash == hashval)
+			return cmd;
+	}
+	for(cmd = zone_commands; cmd->name; cmd++) {
+		if(cmd->hash == hashval)
+			return cmd;
+	}
+	return NULL;
 }
 
 /** 
@@ -665,42 +1171,105 @@ void init_commands(void)
  */
 int process_command(struct receiver *rcvr, const char *str)
 {
-	unsigned long hashval;
+	int ret = -1;
 	char *cmdstr, *argstr;
-	char *c;
 	struct command *cmd;
 
 	if(!str)
 		return -1;
 
-	cmdstr = strdup(str);
-	/* start by killing trailing whitespace of any sort */
-	c = cmdstr + strlen(cmdstr) - 1;
-	while(isspace(*c) && c >= cmdstr)
-		*c-- = '\0';
-	/* start by splitting the string after the cmd */
-	argstr = strchr(cmdstr, ' ');
-	/* if we had an arg, set our pointers correctly */
-	if(argstr) {
-		*argstr = '\0';
-		argstr++;
+	cmd = find_command(str, &cmdstr, &argstr);
+	if(cmd) {
+		/* we found the handler, call it and return the result */
+		ret = cmd->handler(rcvr, cmd, argstr);
 	}
+	/* otherwise we didn't find a handler, must be an invalid command */
+	free(cmdstr);
+	return ret;
+}
 
-	hashval = hash_sdbm(cmdstr);
-	for(cmd = command_list; cmd->name; cmd++) {
-		if(cmd->hash == hashval) {
-			/* we found the handler, call it and return the result */
-			int ret = cmd->handler(rcvr, cmd, argstr);
-			free(cmdstr);
-			return ret;
+/**
+ * Parse a command into the receiver commands it would queue, without
+ * queueing them for any receiver. This allows a command to be parsed once
+ * and sent to many receivers. Commands that act on daemon state rather than
+ * sending receiver commands, such as the virtual zone sleep timers, are
+ * rejected.
+ * @param str the full command string, e.g. "mute on"
+ * @return the list of parsed commands (must be freed), NULL on an invalid
+ * command
+ */
+struct cmdqueue *parse_command(const char *str)
+{
+	int ret = -1;
+	char *cmdstr, *argstr;
+	struct command *cmd;
+	struct receiver scratch;
+
+	if(!str)
+		return NULL;
+
+	memset(&scratch, 0, sizeof(struct receiver));
+	cmd = find_command(str, &cmdstr, &argstr);
+	if(cmd && cmd->handler != handle_fakesleep && cmd->handler != handle_quit)
+		ret = cmd->handler(&scratch, cmd, argstr);
+	free(cmdstr);
+
+	if(ret != 0) {
+		while(scratch.queue) {
+			struct cmdqueue *ptr = scratch.queue;
+			scratch.queue = ptr->next;
+			cmdqueue_free(ptr);
 		}
 	}
+	return scratch.queue;
+}
 
-	/* we didn't find a handler, must be an invalid command */
-	free(cmdstr);
-	return -1;
+
+/**
+ * Check if a receiver command only asks for status, e.g. "MVLQSTN".
+ * @param cmd the receiver command
+ * @return whether the command is a status query
+ */
+static int is_query(const char *cmd)
+{
+	size_t len = strlen(cmd);
+	return len > 4 && strcmp(cmd + len - 4, "QSTN") == 0;
 }
 
+/**
+ * Queue commands for a receiver ahead of anything already waiting, so they
+ * go out in the next pacing slot. A queued command setting the same field
+ * as one of the new commands is superseded and dropped, as is a queued copy
+ * of one of them; group commands are left alone.
+ * @param rcvr the receiver to queue the commands for
+ * @param cmds the commands, e.g. from parse_command(), which now belong to
+ * the queue
+ */
+void cmdqueue_supersede(struct receiver *rcvr, struct cmdqueue *cmds)
+{
+	struct cmdqueue *c, *last = NULL;
+
+	for(c = cmds; c; c = c->next) {
+		int query = is_query(c->cmd);
+		struct cmdqueue **ptr = &rcvr->queue;
+
+		while(*ptr) {
+			struct cmdqueue *q = *ptr;
+			if(!q->sync && (q->hash == c->hash || (!query && !is_query(q->cmd)
+							&& strncmp(q->cmd, c->cmd, 3) == 0))) {
+				*ptr = q->next;
+				cmdqueue_free(q);
+				continue;
+			}
+			ptr = &q->next;
+		}
+		last = c;
+	}
+	if(last) {
+		last->next = rcvr->queue;
+		rcvr->queue = cmds;
+	}
+}
 
 /**
  * Determine if a command is related to the receiver power status. This can
@@ -709,10 +1278,36 @@ int process_command(struct receiver *rcvr, const char *str)
  * @return whether the command is related to receiver power
  */
 int is_power_command(const char *cmd) {
-	if(strstr(cmd, "PWR") != NULL || strstr(cmd, "ZPW") != NULL
-			|| strstr(cmd, "PW3") != NULL)
-		return 1;
+	int zone;
+	for(zone = 1; zone <= ZONE_COUNT; zone++) {
+		if(strstr(cmd, zone_codes[zone - 1][CODE_POWER]) != NULL)
+			return 1;
+	}
 	return 0;
 }
 
+/**
+ * Find the status field a receiver command reports on, e.g. "volume" for
+ * "MVLQSTN".
+ * @param cmd the receiver command, without the start and end characters
+ * @return the field name, NULL if the command is not for a known field
+ */
+const char *command_field(const char *cmd)
+{
+	const struct command *ptr;
+
+	if(strlen(cmd) < 3)
+		return NULL;
+	for(ptr = command_list; ptr->name; ptr++) {
+		if(ptr->prefix && strlen(ptr->prefix) == 3
+				&& strncmp(ptr->prefix, cmd, 3) == 0)
+			return ptr->name;
+	}
+	for(ptr = zone_commands; ptr->name; ptr++) {
+		if(ptr->prefix && strncmp(ptr->prefix, cmd, 3) == 0)
+			return ptr->name;
+	}
+	return NULL;
+}
+
 /* vim: set ts=4 sw=4 noet: */
@@ -0,0 +1,323 @@
+/*
+ *  config.c - Onkyo receiver daemon configuration file
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The configuration file holds the settings that can be changed while the
+ * daemon is running; it is read at startup and again on SIGHUP. Each line
+ * is a setting name followed by its value, named after the matching long
+ * option where there is one:
+ *
+ *   # comments and blank lines are ignored
+ *   bind localhost:8701
+ *   socket /var/run/onkyo.sock
+ *   log /var/log/onkyo-raw.log
+ *   group downstairs=den,kitchen
+ *   aliases /etc/onkyo-aliases
+ *   pacing 80
+ *   expire 30000
+ *   slack 10000
+ *   timerslack 500
+ *   pipeline den=4
+ *   rule @den input = phono => mode pure
+ *
+ * bind, socket, group, pipeline, and rule may be given more than once.
+ * expire is how long (in milliseconds) a command waits for a disconnected
+ * receiver before it is dropped; 0 keeps commands until the receiver is
+ * back. The aliases file (see load_aliases()) is read again on every
+ * reload, even if its path did not change. pipeline is how many commands an
+ * eISCP receiver is sent back to back in one write; models differ in how
+ * many they take without dropping any, so it is set per receiver and
+ * defaults to 1.
+ *
+ * slack is how late (in milliseconds) deadlines that need not be exact,
+ * such as virtual sleep timers, may run so those of all receivers share a
+ * few wakeups a minute; 0 makes them exact. timerslack (in microseconds)
+ * is handed to the kernel with PR_SET_TIMERSLACK for every thread and
+ * applies to every wakeup, so it should stay well below pacing.
+ *
+ * A rule reacts to a receiver, the default one unless addressed with
+ * "@name ", with a command of its own: when its predicate (see predicate.c)
+ * becomes true, the command is queued right away ahead of anything else
+ * waiting for the receiver, superseding any queued command setting the same
+ * field.
+ */
+
+#define _XOPEN_SOURCE 600 /* strdup */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h> /* isspace */
+#include <string.h>
+
+#include "onkyo.h"
+
+/**
+ * Add a string to a list of strings.
+ * @param list the list to add to
+ * @param count the number of strings in the list
+ * @param str the string to add, which is copied
+ * @return 0 on success, -1 on allocation failure
+ */
+static int config_add(char ***list, size_t *count, const char *str)
+{
+	char **new_list = realloc(*list, (*count + 1) * sizeof(char *));
+	if(!new_list)
+		return -1;
+	*list = new_list;
+	new_list[*count] = strdup(str);
+	if(!new_list[*count])
+		return -1;
+	(*count)++;
+	return 0;
+}
+
+static void config_free_list(char **list, size_t count)
+{
+	size_t i;
+	for(i = 0; i < count; i++)
+		free(list[i]);
+	free(list);
+}
+
+/**
+ * Split a rule setting into its parts, in place.
+ * @param rule the rule, e.g. "@den input = phono => mode pureaudio"
+ * @param rcvr location to store the receiver name, NULL if not addressed
+ * @param pred location to store the predicate expression
+ * @param action location to store the command
+ * @return 0 on success, -1 if the rule is malformed
+ */
+int config_split_rule(char *rule, char **rcvr, char **pred, char **action)
+{
+	char *arrow = strstr(rule, "=>"), *end;
+
+	*rcvr = NULL;
+	if(!arrow)
+		return -1;
+	if(*rule == '@') {
+		*rcvr = rule + 1;
+		rule = strchr(rule, ' ');
+		if(!rule || rule > arrow)
+			return -1;
+		*rule++ = '\0';
+	}
+	*pred = rule;
+	for(end = arrow; end > rule && isspace((unsigned char)end[-1]); end--)
+		;
+	*end = '\0';
+	for(*action = arrow + 2; isspace((unsigned char)**action); (*action)++)
+		;
+	return **pred && **action ? 0 : -1;
+}
+
+/**
+ * Check a rule setting compiles, so a bad rule is reported along with its
+ * line in the configuration file.
+ * @param rule the rule
+ * @return 0 if the rule is valid, -1 otherwise
+ */
+static int config_check_rule(const char *rule)
+{
+	char *copy = strdup(rule), *rcvr, *pred, *action;
+	struct predicate *p = NULL;
+	struct cmdqueue *cmds = NULL;
+	int ret = -1;
+
+	if(copy && config_split_rule(copy, &rcvr, &pred, &action) == 0) {
+		p = predicate_compile(pred);
+		cmds = parse_command(action);
+		ret = p && cmds ? 0 : -1;
+	}
+	predicate_free(p);
+	while(cmds) {
+		struct cmdqueue *q = cmds;
+		cmds = q->next;
+		cmdqueue_free(q);
+	}
+	free(copy);
+	return ret;
+}
+
+/**
+ * Apply a single setting to a configuration.
+ * @param cfg the configuration being read
+ * @param key the setting name
+ * @param value the setting value, an empty string if none was given
+ * @return 0 on success, -1 on an unknown or invalid setting
+ */
+static int config_set(struct config *cfg, const char *key, const char *value)
+{
+	if(strcmp(key, "bind") == 0) {
+		return config_add(&cfg->binds, &cfg->bind_count, value);
+	} else if(strcmp(key, "socket") == 0 && *value) {
+		return config_add(&cfg->sockets, &cfg->socket_count, value);
+	} else if(strcmp(key, "group") == 0 && *value) {
+		return config_add(&cfg->groups, &cfg->group_count, value);
+	} else if(strcmp(key, "pipeline") == 0) {
+		char *test, *sep = strchr(value, '=');
+		long depth;
+		if(!sep || sep == value)
+			return -1;
+		depth = strtol(sep + 1, &test, 10);
+		if(sep[1] == '\0' || *test != '\0' || depth < 1
+				|| depth > PIPELINE_MAX)
+			return -1;
+		return config_add(&cfg->pipelines, &cfg->pipeline_count, value);
+	} else if(strcmp(key, "rule") == 0) {
+		if(config_check_rule(value) == -1)
+			return -1;
+		return config_add(&cfg->rules, &cfg->rule_count, value);
+	} else if(strcmp(key, "log") == 0 && *value) {
+		free(cfg->log_path);
+		cfg->log_path = strdup(value);
+		return cfg->log_path ? 0 : -1;
+	} else if(strcmp(key, "aliases") == 0 && *value) {
+		free(cfg->aliases_path);
+		cfg->aliases_path = strdup(value);
+		return cfg->aliases_path ? 0 : -1;
+	} else if(strcmp(key, "pacing") == 0) {
+		char *test;
+		long ms = strtol(value, &test, 10);
+		if(*value == '\0' || *test != '\0' || ms < 0 || ms > 10000)
+			return -1;
+		cfg->pacing = (int)ms;
+		return 0;
+	} else if(strcmp(key, "expire") == 0) {
+		char *test;
+		long ms = strtol(value, &test, 10);
+		if(*value == '\0' || *test != '\0' || ms < 0 || ms > 86400000)
+			return -1;
+		cfg->expire = (int)ms;
+		return 0;
+	} else if(strcmp(key, "slack") == 0) {
+		char *test;
+		long ms = strtol(value, &test, 10);
+		if(*value == '\0' || *test != '\0' || ms < 0 || ms > 60000)
+			return -1;
+		cfg->slack = (int)ms;
+		return 0;
+	} else if(strcmp(key, "timerslack") == 0) {
+		char *test;
+		long us = strtol(value, &test, 10);
+		if(*value == '\0' || *test != '\0' || us < 0 || us > 1000000)
+			return -1;
+		cfg->timerslack = us;
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * Read a configuration file.
+ * @param path the path to the configuration file
+ * @return the configuration (must be freed with config_free()), NULL if the
+ * file could not be read or contained errors
+ */
+struct config *config_load(const char *path)
+{
+	FILE *fp;
+	char line[BUF_SIZE * 2];
+	unsigned int lineno = 0;
+	struct config *cfg;
+
+	fp = fopen(path, "r");
+	if(!fp) {
+		perror(path);
+		return NULL;
+	}
+	cfg = calloc(1, sizeof(struct config));
+	if(!cfg) {
+		fclose(fp);
+		return NULL;
+	}
+	cfg->pacing = -1;
+	cfg->expire = -1;
+	cfg->slack = -1;
+	cfg->timerslack = -1;
+
+	while(fgets(line, sizeof(line), fp)) {
+		char *key = line, *value, *end;
+
+		lineno++;
+		/* trim leading and trailing whitespace, skip blanks and comments */
+		while(isspace((unsigned char)*key))
+			key++;
+		end = key + strlen(key);
+		while(end > key && isspace((unsigned char)end[-1]))
+			*--end = '\0';
+		if(*key == '\0' || *key == '#')
+			continue;
+
+		/* split the setting name from its value */
+		value = key;
+		while(*value && !isspace((unsigned char)*value))
+			value++;
+		if(*value) {
+			*value++ = '\0';
+			while(isspace((unsigned char)*value))
+				value++;
+		}
+		if(config_set(cfg, key, value) == -1) {
+			fprintf(stderr, "%s:%u: invalid setting: %s\n", path, lineno, key);
+			fclose(fp);
+			config_free(cfg);
+			return NULL;
+		}
+	}
+
+	fclose(fp);
+	return cfg;
+}
+
+/**
+ * Free a configuration read by config_load().
+ * @param cfg the configuration to free
+ */
+void config_free(struct config *cfg)
+{
+	if(!cfg)
+		return;
+	config_free_list(cfg->binds, cfg->bind_count);
+	config_free_list(cfg->sockets, cfg->socket_count);
+	config_free_list(cfg->groups, cfg->group_count);
+	config_free_list(cfg->pipelines, cfg->pipeline_count);
+	config_free_list(cfg->rules, cfg->rule_count);
+	free(cfg->log_path);
+	free(cfg->aliases_path);
+	free(cfg);
+}
+
+/**
+ * Check if a list of strings from a configuration contains a string.
+ * @param list the list to search
+ * @param count the number of strings in the list
+ * @param str the string to look for
+ * @return 1 if the string is in the list, 0 otherwise
+ */
+int config_has(char **list, size_t count, const char *str)
+{
+	size_t i;
+	for(i = 0; i < count; i++) {
+		if(strcmp(list[i], str) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* vim: set ts=4 sw=4 noet: */
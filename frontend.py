@@ -12,6 +12,10 @@ import pygtk, gtk, gobject
 import os, socket
 
 HELLO_MESSAGE = "OK:onkyocontrol"
+SNAPSHOT_MESSAGE = "OK:snapshot:"
+# time (in milliseconds) slider values are held back so only the last
+# value in a quick series is sent
+DEBOUNCE_WAIT = 150
 STATUSES = [ 'power', 'mute', 'mode', 'volume', 'input', 'tune', 'sleep',
         'zone2power', 'zone2mute', 'zone2volume', 'zone2input', 'zone2tune',
         'zone2sleep' ]
@@ -64,8 +68,16 @@ class OnkyoClient:
         self._connectevent = -1
         self._iowatchevent = -1
 
-        # set up our socket descriptors
+        # set up our socket descriptors, and the partial line read so far
         self._sock = None
+        self._buffer = ""
+
+        # commands held back until DEBOUNCE_WAIT passes, keyed by status
+        self._pending = dict()
+        self._pendingevent = -1
+
+        # set while we wait for the end of the snapshot asked for on connect
+        self._snapshot = False
 
         # set up our notification file descriptor
         (fd_r, fd_w) = os.pipe()
@@ -125,6 +137,8 @@ class OnkyoClient:
         if self._sock:
             self._sock.close()
             self._sock = None
+        self._buffer = ""
+        self._snapshot = False
 
     def establish_connection(self, force=False):
         if self._sock:
@@ -146,8 +160,11 @@ class OnkyoClient:
                     gobject.IO_IN | gobject.IO_PRI | gobject.IO_ERR |
                     gobject.IO_HUP, self._processinput)
             self._iowatchevent = eventid
-            # we've verified the connection, get powered on status
-            self.querypower()
+            # we've verified the connection; the daemon already knows the
+            # receiver state, so ask for all of it at once rather than
+            # querying the receiver again
+            self._snapshot = True
+            self._writeline("snapshot")
             return True
         else:
             # connection failed, set up our timer connect event if it doesn't
@@ -159,9 +176,12 @@ class OnkyoClient:
             return True
 
     def _hello(self):
-        lines = self._read()
-        if len(lines) < 1 or not lines[0].startswith(HELLO_MESSAGE):
-            raise ConnectionError("Invalid hello message: '%s'" % lines[0])
+        while "\n" not in self._buffer:
+            self._fill()
+        # anything after the hello is left for _read()
+        line, self._buffer = self._buffer.split("\n", 1)
+        if not line.startswith(HELLO_MESSAGE):
+            raise ConnectionError("Invalid hello message: '%s'" % line)
 
     def _writeline(self, line):
         if DEBUG:
@@ -172,15 +192,60 @@ class OnkyoClient:
         self._sock.sendall("%s\n" % line)
         return True
 
-    def _read(self):
-        data = self._sock.recv(4096)
-        if not data.endswith("\n"):
+    def _fill(self):
+        try:
+            data = self._sock.recv(4096)
+        except socket.error:
+            data = ""
+        if not data:
             raise ConnectionError("Connection lost on read")
-        lines = data.rstrip("\n").split("\n")
+        self._buffer += data
+
+    def _read(self):
+        # a read may end in the middle of a line; keep the rest for later
+        self._fill()
+        lines = self._buffer.split("\n")
+        self._buffer = lines.pop()
         if DEBUG:
             print "received lines: %s" % lines
         return lines
 
+    def _debounce(self, key, line):
+        # hold the command back, replacing any still waiting for the same
+        # status, and send whatever is waiting once things settle
+        self._pending[key] = line
+        if self._pendingevent < 0:
+            self._pendingevent = gobject.timeout_add(DEBOUNCE_WAIT,
+                    self._flush)
+
+    def _flush(self):
+        self._pendingevent = -1
+        pending = self._pending
+        self._pending = dict()
+        for line in pending.values():
+            self._writeline(line)
+        return False
+
+    def _endsnapshot(self, count):
+        self._snapshot = False
+        # a daemon that has not seen the receiver yet has nothing to tell
+        # us, so ask the receiver itself
+        if count == 0:
+            self.querypower()
+        os.write(self._pipewrite, 'snapshot')
+
+    def _powered(self, key, state):
+        # only query the rest of a zone when it actually comes on, not
+        # when we learn it was already on
+        was_on = self.status[key]
+        self.status[key] = state
+        if state and was_on != True and not self._snapshot:
+            if key == 'power':
+                self.querystatus()
+                self.querysleep()
+            else:
+                self.queryzone2status()
+
     def _processinput(self, fd, condition):
         if condition & gobject.IO_HUP:
             # we were disconnected, attempt to reconnect
@@ -199,17 +264,26 @@ class OnkyoClient:
                 self.establish_connection(True)
                 return False
             for line in lines:
+                # we only show the default receiver
+                if line.startswith("@"):
+                    continue
+                if line.startswith(SNAPSHOT_MESSAGE):
+                    self._endsnapshot(int(line[len(SNAPSHOT_MESSAGE):]))
+                    continue
                 line = line.split(":")
+                # don't let a status we are about to change move back
+                if len(line) > 1 and line[1] in self._pending:
+                    continue
                 # first check for errors
                 if line[0] == "ERROR":
                     print "Error received: %s" % line
                     #raise OnkyoClientException("Error received: %s" % line)
+                    # a daemon too old to know snapshots
+                    if self._snapshot:
+                        self._endsnapshot(0)
                 # primary zone processing
                 elif line[1] == "power":
-                    if line[2] == "on":
-                        self.status['power'] = True
-                    else:
-                        self.status['power'] = False
+                    self._powered('power', line[2] == "on")
                 elif line[1] == "mute":
                     if line[2] == "on":
                         self.status['mute'] = True
@@ -230,10 +304,7 @@ class OnkyoClient:
                     self.status['sleep'] = int(line[2])
                 # zone 2 processing
                 elif line[1] == "zone2power":
-                    if line[2] == "on":
-                        self.status['zone2power'] = True
-                    else:
-                        self.status['zone2power'] = False
+                    self._powered('zone2power', line[2] == "on")
                 elif line[1] == "zone2mute":
                     if line[2] == "on":
                         self.status['zone2mute'] = True
@@ -253,8 +324,10 @@ class OnkyoClient:
                 else:
                     print "Unrecognized response: %s" % line
 
-                # notify the pipe that we processed input
-                os.write(self._pipewrite, '%r' % line)
+                # notify the pipe that we processed input; a snapshot is
+                # announced once it is complete
+                if not self._snapshot:
+                    os.write(self._pipewrite, '%r' % line)
 
         # return true in any case if we made it here
         return True
@@ -300,7 +373,7 @@ class OnkyoClient:
         if intval < 0 or intval > 100:
             raise CommandException("Volume out of range: %d" % intval)
         self.status['volume'] = intval
-        self._writeline("volume %d" % intval)
+        self._debounce('volume', "volume %d" % intval)
 
     def setinput(self, inp):
         valid_inputs = [ 'dvr', 'vcr', 'cable', 'sat', 'tv', 'aux', 'dvd',
@@ -365,7 +438,7 @@ class OnkyoClient:
         if intval < 0 or intval > 100:
             raise CommandException("Volume out of range: %d" % intval)
         self.status['zone2volume'] = intval
-        self._writeline("zone2volume %d" % intval)
+        self._debounce('zone2volume', "zone2volume %d" % intval)
 
     def setzone2input(self, inp):
         valid_inputs = [ 'dvr', 'vcr', 'cable', 'sat', 'tv', 'aux', 'dvd',
@@ -578,9 +651,9 @@ class OnkyoFrontend:
                 status_updated[item] = True
             else:
                 status_updated[item] = False
-        new_epoch = self.known_status['epoch'] != client_status['epoch']
-        if new_epoch:
-            self.known_status['epoch'] = client_status['epoch']
+        # a new epoch needs nothing more; the client refreshed its state
+        # from a snapshot when it reconnected
+        self.known_status['epoch'] = client_status['epoch']
 
 
         # make sure to call correct method for each type of control
@@ -588,16 +661,8 @@ class OnkyoFrontend:
         if client_status['power'] != None and status_updated['power'] == True:
             self.power.set_active(client_status['power'])
             self.set_main_sensitive(client_status['power'])
-            # query for a status update if the receiver power switched on
-            if client_status['power'] == True:
-                self.client.querystatus()
-                self.client.querysleep()
-            else:
+            if client_status['power'] == False:
                 self.sleep.set_text("Off")
-        # also query for a status update if power is on and new epoch
-        elif client_status['power'] == True and new_epoch:
-            self.client.querystatus()
-            self.client.querysleep()
         if client_status['mute'] != None and status_updated['mute'] == True:
             self.mute.set_active(client_status['mute'])
         if client_status['mode'] != None and status_updated['mode'] == True:
@@ -618,13 +683,8 @@ class OnkyoFrontend:
                 status_updated['zone2power'] == True:
             self.zone2power.set_active(client_status['zone2power'])
             self.set_zone2_sensitive(client_status['zone2power'])
-            if client_status['zone2power'] == True:
-                self.client.queryzone2status()
-            else:
+            if client_status['zone2power'] == False:
                 self.zone2sleep.set_text("Off")
-        # also query for a status update if power is on and new epoch
-        elif client_status['zone2power'] == True and new_epoch:
-            self.client.queryzone2status()
         if client_status['zone2mute'] != None and \
                 status_updated['zone2mute'] == True:
             self.zone2mute.set_active(client_status['zone2mute'])
@@ -0,0 +1,450 @@
+/*
+ *  history.c - Onkyo receiver state change history
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The history keeps every change of every state field of a receiver, so
+ * clients can ask what happened over the last days without polling. Each
+ * receiver has a ring of HISTORY_BLOCKS blocks; when the ring is full the
+ * oldest block is dropped to make room.
+ *
+ * A change is stored as three variable length numbers: the milliseconds
+ * since the change before it, the field index, and the value. Integer values
+ * are stored as the difference from the last value of the same field,
+ * otherwise the value is an index into a table of every distinct value seen.
+ * A typical change takes three or four bytes. Each block starts from a known
+ * time and without any previous values, so a block can be read on its own
+ * and dropping one never breaks the next. The history starts over on a
+ * live upgrade, and the tiny build has none.
+ */
+
+#define _XOPEN_SOURCE 600 /* strdup */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/time.h> /* struct timeval */
+
+#include "onkyo.h"
+
+/** Most bytes a single change takes */
+#define HISTORY_RECORD_MAX 30
+
+struct history_block {
+	/** time of the first change, the base of the block */
+	struct timeval start;
+	size_t len;
+	unsigned char data[HISTORY_BLOCK];
+};
+
+/** The history of one receiver */
+struct history {
+	char *rcvr;
+	/** ring of blocks, the oldest at first */
+	struct history_block *blocks[HISTORY_BLOCKS];
+	size_t first;
+	size_t count;
+	/** field names, indexed by field number */
+	char **fields;
+	size_t field_count;
+	/** distinct non-integer values, indexed by value number */
+	struct strpool values;
+	long *value_offsets;
+	unsigned long *value_hashes;
+	size_t value_count;
+	/** encoder state for the newest block: the time of the last change in
+	 * milliseconds from the block start, and the last integer value of each
+	 * field if has_last is set for it */
+	long last_ms;
+	long *last;
+	unsigned char *has_last;
+	unsigned long changes;
+	struct history *next;
+};
+
+static struct history *histories = NULL;
+
+/**
+ * Find the history of a receiver.
+ * @param rcvr the receiver name
+ * @param create whether to create an empty history if there is none
+ * @return the history, NULL if there is none (or it could not be created)
+ */
+static struct history *history_find(const char *rcvr, int create)
+{
+	struct history *h;
+
+	for(h = histories; h; h = h->next) {
+		if(strcmp(h->rcvr, rcvr) == 0)
+			return h;
+	}
+	if(!create)
+		return NULL;
+	h = calloc(1, sizeof(struct history));
+	if(!h)
+		return NULL;
+	h->rcvr = strdup(rcvr);
+	if(!h->rcvr) {
+		free(h);
+		return NULL;
+	}
+	h->next = histories;
+	histories = h;
+	return h;
+}
+
+/**
+ * Find the number of a field, adding it if it is new.
+ * @param h the history
+ * @param field the field name
+ * @return the field number, -1 on allocation failure
+ */
+static long field_index(struct history *h, const char *field)
+{
+	char **fields;
+	long *last;
+	unsigned char *has_last;
+	size_t i;
+
+	for(i = 0; i < h->field_count; i++) {
+		if(strcmp(h->fields[i], field) == 0)
+			return (long)i;
+	}
+	fields = realloc(h->fields, (i + 1) * sizeof(char *));
+	if(fields)
+		h->fields = fields;
+	last = realloc(h->last, (i + 1) * sizeof(long));
+	if(last)
+		h->last = last;
+	has_last = realloc(h->has_last, i + 1);
+	if(has_last)
+		h->has_last = has_last;
+	if(!fields || !last || !has_last || !(fields[i] = strdup(field)))
+		return -1;
+	has_last[i] = 0;
+	h->field_count++;
+	return (long)i;
+}
+
+/**
+ * Find the number of a non-integer value, adding it if it is new.
+ * @param h the history
+ * @param value the value
+ * @return the value number, -1 on allocation failure
+ */
+static long value_index(struct history *h, const char *value)
+{
+	unsigned long hashval = hash_sdbm(value), *hashes;
+	long offset, *offsets;
+	size_t i;
+
+	for(i = 0; i < h->value_count; i++) {
+		if(h->value_hashes[i] == hashval
+				&& strcmp(h->values.buf + h->value_offsets[i], value) == 0)
+			return (long)i;
+	}
+	offsets = realloc(h->value_offsets, (i + 1) * sizeof(long));
+	if(offsets)
+		h->value_offsets = offsets;
+	hashes = realloc(h->value_hashes, (i + 1) * sizeof(unsigned long));
+	if(hashes)
+		h->value_hashes = hashes;
+	if(!offsets || !hashes)
+		return -1;
+	offset = strpool_add(&h->values, "%s", value);
+	if(offset == -1)
+		return -1;
+	offsets[i] = offset;
+	hashes[i] = hashval;
+	h->value_count++;
+	return (long)i;
+}
+
+/**
+ * Parse an integer value that prints back exactly the same, so storing it
+ * as a number loses nothing.
+ * @param value the value, e.g. "-52"
+ * @param number location to store the number
+ * @return 1 if the value is such an integer, 0 otherwise
+ */
+static int parse_integer(const char *value, long *number)
+{
+	char buf[32];
+	char *end;
+
+	if(*value == '\0' || strlen(value) > 12)
+		return 0;
+	*number = strtol(value, &end, 10);
+	if(*end != '\0')
+		return 0;
+	snprintf(buf, sizeof(buf), "%ld", *number);
+	return strcmp(buf, value) == 0;
+}
+
+/**
+ * Compare two times.
+ * @return non-zero if a is before b
+ */
+static int before(const struct timeval *a, const struct timeval *b)
+{
+	if(a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_usec < b->tv_usec;
+}
+
+static size_t put_varint(unsigned char *buf, unsigned long val)
+{
+	size_t len = 0;
+
+	while(val >= 0x80) {
+		buf[len++] = (unsigned char)(val | 0x80);
+		val >>= 7;
+	}
+	buf[len++] = (unsigned char)val;
+	return len;
+}
+
+/**
+ * Read a variable length number from a block.
+ * @param b the block
+ * @param pos the read position, moved past the number
+ * @param val location to store the number
+ * @return 0 on success, -1 if the block ends in the middle of the number
+ */
+static int get_varint(const struct history_block *b, size_t *pos,
+		unsigned long *val)
+{
+	unsigned int shift = 0;
+
+	*val = 0;
+	while(*pos < b->len && shift < sizeof(unsigned long) * CHAR_BIT) {
+		unsigned char byte = b->data[(*pos)++];
+		*val |= (unsigned long)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+/**
+ * Get the block new changes go in, starting a new one if there is none or
+ * the newest is full. When the ring is full the oldest block is reused.
+ * @param h the history
+ * @param when the time of the change
+ * @return the block, NULL on allocation failure
+ */
+static struct history_block *history_block(struct history *h,
+		struct timeval *when)
+{
+	struct history_block *b = NULL;
+
+	if(h->count) {
+		b = h->blocks[(h->first + h->count - 1) % HISTORY_BLOCKS];
+		if(b->len + HISTORY_RECORD_MAX <= HISTORY_BLOCK)
+			return b;
+	}
+	if(h->count == HISTORY_BLOCKS) {
+		b = h->blocks[h->first];
+		h->first = (h->first + 1) % HISTORY_BLOCKS;
+		h->count--;
+	} else {
+		size_t slot = (h->first + h->count) % HISTORY_BLOCKS;
+		if(!h->blocks[slot])
+			h->blocks[slot] = malloc(sizeof(struct history_block));
+		b = h->blocks[slot];
+		if(!b)
+			return NULL;
+	}
+	h->count++;
+	b->start = *when;
+	b->len = 0;
+	h->last_ms = 0;
+	memset(h->has_last, 0, h->field_count);
+	return b;
+}
+
+/**
+ * Add a change of a state field to the history of its receiver.
+ * @param rcvr the receiver name
+ * @param field the field name, e.g. "volume"
+ * @param value the new value, e.g. "30"
+ * @param when the time of the change
+ * @return 0 on success, -1 on allocation failure
+ */
+int history_add(const char *rcvr, const char *field, const char *value,
+		struct timeval *when)
+{
+	struct history *h = history_find(rcvr, 1);
+	struct history_block *b;
+	unsigned long code;
+	long idx, ms, number;
+
+	if(!h || (idx = field_index(h, field)) == -1)
+		return -1;
+	b = history_block(h, when);
+	if(!b)
+		return -1;
+
+	ms = (long)(when->tv_sec - b->start.tv_sec) * 1000
+		+ (when->tv_usec - b->start.tv_usec) / 1000;
+	/* the clock going back is squashed into a zero delta */
+	if(ms < h->last_ms)
+		ms = h->last_ms;
+
+	if(parse_integer(value, &number)) {
+		/* zig-zag the difference so small negatives stay small */
+		long diff = number - (h->has_last[idx] ? h->last[idx] : 0);
+		code = (diff < 0 ? ((unsigned long)(-diff) * 2 - 1)
+				: (unsigned long)diff * 2) << 1;
+		h->last[idx] = number;
+		h->has_last[idx] = 1;
+	} else {
+		long vidx = value_index(h, value);
+		if(vidx == -1)
+			return -1;
+		code = ((unsigned long)vidx << 1) | 1;
+	}
+
+	b->len += put_varint(b->data + b->len, (unsigned long)(ms - h->last_ms));
+	b->len += put_varint(b->data + b->len, (unsigned long)idx);
+	b->len += put_varint(b->data + b->len, code);
+	h->last_ms = ms;
+	h->changes++;
+	return 0;
+}
+
+/**
+ * Go through the changes in the history of a receiver from a given time on,
+ * oldest first.
+ * @param rcvr the receiver name
+ * @param field the field to report, NULL for every field
+ * @param since the earliest time to report
+ * @param fn called for each change; a non-zero return stops the query
+ * @param data passed on to fn
+ * @return the number of changes reported, -1 if fn stopped the query or
+ * on allocation failure
+ */
+long history_query(const char *rcvr, const char *field,
+		struct timeval *since, history_fn *fn, void *data)
+{
+	struct history *h = history_find(rcvr, 0);
+	long *last;
+	long count = 0;
+	size_t i;
+
+	if(!h)
+		return 0;
+	last = calloc(h->field_count + 1, sizeof(long));
+	if(!last)
+		return -1;
+
+	for(i = 0; i < h->count; i++) {
+		const struct history_block *b =
+			h->blocks[(h->first + i) % HISTORY_BLOCKS];
+		unsigned long dt, idx, code;
+		size_t pos = 0;
+		long ms = 0;
+
+		/* a block is older than the one after it starts */
+		if(i + 1 < h->count) {
+			const struct history_block *n =
+				h->blocks[(h->first + i + 1) % HISTORY_BLOCKS];
+			if(!before(since, &n->start))
+				continue;
+		}
+		memset(last, 0, (h->field_count + 1) * sizeof(long));
+		while(get_varint(b, &pos, &dt) == 0 && get_varint(b, &pos, &idx) == 0
+				&& get_varint(b, &pos, &code) == 0 && idx < h->field_count) {
+			struct timeval when, offset, start = b->start;
+			char buf[32];
+			const char *value;
+
+			ms += (long)dt;
+			if(code & 1) {
+				if((code >> 1) >= h->value_count)
+					break;
+				value = h->values.buf + h->value_offsets[code >> 1];
+			} else {
+				unsigned long zz = code >> 1;
+				long diff = zz & 1 ? -(long)((zz + 1) / 2) : (long)(zz / 2);
+				last[idx] += diff;
+				snprintf(buf, sizeof(buf), "%ld", last[idx]);
+				value = buf;
+			}
+			offset.tv_sec = ms / 1000;
+			offset.tv_usec = (ms % 1000) * 1000;
+			timeval_add(&start, &offset, &when);
+			if(before(&when, since) ||
+					(field && strcmp(field, h->fields[idx]) != 0))
+				continue;
+			if(fn(data, h->fields[idx], &when, value)) {
+				free(last);
+				return -1;
+			}
+			count++;
+		}
+	}
+	free(last);
+	return count;
+}
+
+/**
+ * Get the size of the history of a receiver.
+ * @param rcvr the receiver name
+ * @param changes location to store the number of changes ever added
+ * @return the bytes of changes held, not counting the value table
+ */
+size_t history_bytes(const char *rcvr, unsigned long *changes)
+{
+	struct history *h = history_find(rcvr, 0);
+	size_t i, len = 0;
+
+	*changes = h ? h->changes : 0;
+	for(i = 0; h && i < h->count; i++)
+		len += h->blocks[(h->first + i) % HISTORY_BLOCKS]->len;
+	return len;
+}
+
+/**
+ * Free the history of every receiver.
+ */
+void history_clear(void)
+{
+	while(histories) {
+		struct history *h = histories;
+		size_t i;
+
+		histories = h->next;
+		for(i = 0; i < HISTORY_BLOCKS; i++)
+			free(h->blocks[i]);
+		for(i = 0; i < h->field_count; i++)
+			free(h->fields[i]);
+		free(h->fields);
+		free(h->last);
+		free(h->has_last);
+		free(h->values.buf);
+		free(h->value_offsets);
+		free(h->value_hashes);
+		free(h->rcvr);
+		free(h);
+	}
+}
+
+/* vim: set ts=4 sw=4 noet: */
@@ -26,7 +26,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -38,32 +38,180 @@
 #include <unistd.h> /* chdir, fork, pipe, setsid */
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h> /* PATH_MAX */
+#include <malloc.h> /* mallopt */
+#include <sys/mman.h> /* mlockall */
 #include <getopt.h>
-#include <termios.h>
 #include <string.h>
 #include <time.h>
+#ifndef TINY
+#include <zlib.h>
+#endif
 
 #include "onkyo.h"
 
+/** A named set of receivers that commands can be sent to at once */
+struct group {
+	char *name;
+	unsigned long name_hash;
+	struct receiver **members;
+	/** per member flag, set while a dispatched command is unconfirmed */
+	int *waiting;
+	size_t member_count;
+	struct timer timer;
+	/** set if the group came from the config file and may be reloaded */
+	int configured;
+	struct group *next;
+};
+
+/** A listener opened from the config file, so a reload can close it */
+struct config_listener {
+	char *spec;
+	int is_socket;
+	int fd;
+};
+
+/** A status field sent to a rate limited connection, and the latest
+ * message for it held back until the field may be sent again */
+struct conn_field {
+	unsigned long hash;
+	/** the field, "[@name ]field" */
+	char key[BUF_SIZE * 2];
+	struct timeval sent;
+	/** the held back message, empty if there is none */
+	char held[BUF_SIZE * 2];
+};
+
+/** A predicate over the state of a receiver a connection is watching; the
+ * connection is told whenever its result flips */
+struct watch {
+	unsigned int id;
+	struct receiver *rcvr;
+	struct predicate *pred;
+	/** the result last sent to the connection */
+	int state;
+	/** the expression as given, kept for a live upgrade */
+	char *expr;
+	struct watch *next;
+};
+
+/** A rule from the configuration file, see config_split_rule() */
+struct rule {
+	struct receiver *rcvr;
+	struct predicate *pred;
+	/** the parsed commands of the action, copied each time it fires */
+	struct cmdqueue *cmds;
+	/** the result of the predicate when last evaluated */
+	int state;
+	/** set when the rule became true and its action is not yet queued */
+	int due;
+	struct rule *next;
+};
+
 /** A connection to a receiver and associated receive buffer */
 struct conn {
 	int fd;
+	unsigned int id;
+	size_t pollidx;
 	char *recv_buf;
 	char *recv_buf_pos;
+	/** least time (in milliseconds) between messages for one field, 0 if
+	 * every message is sent as it comes */
+	long rate;
+	struct conn_field *fields;
+	size_t field_count;
+	struct timer timer;
+	struct watch *watches;
+	size_t watch_count;
+	unsigned int next_watch;
+	/** set if the connection turned off status broadcasts, so it only gets
+	 * replies and watch notifications */
+	int quiet;
+#ifndef TINY
+	/** deflate stream for everything written to the connection, NULL if
+	 * the connection did not ask for compression */
+	z_stream *zs;
+#endif
 	struct conn *next;
 };
 
 /** file descriptor for raw output logging */
-static int logfd = -1;
-/** our list of receivers we send commands to */
-static struct receiver *receivers = NULL;
+int logfd = -1;
+/** path of the raw output log, kept so it can be reopened */
+static char *raw_log_path = NULL;
+/** config file path and the settings currently applied from it */
+static char *config_path = NULL;
+static struct config *config = NULL;
+static struct config_listener *config_listeners = NULL;
+static size_t config_listener_count = 0;
+/** file descriptor for client session recording */
+static int recordfd = -1;
+/** time of the last recorded session event */
+static struct timeval record_last;
+/** id handed out to the next opened connection */
+static unsigned int next_conn_id = 1;
+/** when we started, for the wakeup rate shown with the status */
+static struct timeval started;
+/** watch notifications sent, shown with the status */
+static unsigned long watch_flips = 0;
+/** rules from the configuration file, and how often they fired */
+static struct rule *rules = NULL;
+static unsigned long rules_fired = 0;
+/** set when any rule has an action waiting for rules_run() */
+static int rules_due = 0;
+/** our array of receivers we send commands to */
+static struct receiver **receivers = NULL;
+static size_t receiver_count = 0;
+/** receiver that gets commands not addressed to a specific receiver */
+static struct receiver *default_rcvr = NULL;
+/** our list of receiver groups */
+static struct group *groups = NULL;
 /** our list of listening sockets/descriptors we accept connections on */
 static int *listeners;
 static size_t listener_count = 0;
+/** listeners passed in by our service manager, which owns their paths */
+static int *activated = NULL;
+static size_t activated_count = 0;
 /** our list of open connections we process commands on */
 static struct conn *connections = NULL;
-/** pipe used for async-safe signal handling in our select */
+#ifdef TINY
+/** the tiny build never allocates connections; they all come from here */
+static struct conn conn_slab[MAX_CONNECTIONS];
+static char conn_bufs[MAX_CONNECTIONS][BUF_SIZE];
+#endif
+/** pipe used for async-safe signal handling in our poll */
 static int signalpipe[2] = { -1, -1 };
+/** shard run inline by the main loop; its poll set holds the signal pipe,
+ * then the epoll set of the inline receivers, kept up to date as receivers
+ * change state, then listeners and connections. Group timers live here
+ * too. */
+static struct shard main_shard = { .epfd = -1 };
+/** worker shards running receivers on their own threads, if any */
+static struct shard *workers = NULL;
+static size_t worker_count = 0;
+#ifndef TINY
+/** our binary and original arguments, used to start a live upgrade */
+static char *exe_path = NULL;
+static char **saved_argv = NULL;
+/** totals for compressed connections, shown with the status */
+static unsigned long long compress_in = 0;
+static unsigned long long compress_out = 0;
+static unsigned long long compress_nsec = 0;
+static unsigned long compress_msgs = 0;
+#endif
+
+static int queue_command(struct receiver *rcvr, const char *cmd);
+static void conn_timer_fired(struct timer *t, struct timeval *now);
+static void flood_timer_fired(struct timer *t, struct timeval *now);
+static void flood_hold(struct receiver *rcvr);
+static void flood_end(struct receiver *rcvr);
+static struct watch *watch_add(struct conn *c, struct receiver *rcvr,
+		unsigned int id, const char *expr);
+static void reload_config(void);
+static void rules_free(void);
+#ifndef TINY
+static void upgrade(void);
+#endif
 
 /* common messages */
 static const char * const startup_msg = "OK:onkyocontrol v1.1\n";
@@ -72,28 +220,61 @@ static const char * const max_conns = "ERROR:Max Connections Reached\n";
 const char * const rcvr_err = "ERROR:Receiver Error\n";
 
 /**
- * Establish everything we need for a connection once it has been
- * accepted. This will set up send and receive buffers and start
- * tracking the connection in our array.
- * @param fd the newly opened connection's file descriptor
- * @return 0 if initial write was successful, -1 if max connections
- * reached, -2 on write failure (connection is closed for any failure)
+ * Record a client session event if session recording is enabled. Each event
+ * is written as a single line of the form "<delta> <id> <op><text>", where
+ * delta is the number of milliseconds since the previous event, id is the
+ * connection id, and op is one of '+' (opened), '-' (closed), or '>' (line
+ * received, followed by the line itself).
+ * @param c the connection the event happened on
+ * @param op the event type character
+ * @param line the received line for '>' events, NULL otherwise
  */
-static int open_connection(int fd)
+static void record_event(struct conn *c, char op, const char *line)
 {
-	int i, on = 1;
-	struct conn *ptr, *prev = NULL;
-
-	/* We don't need/want delay; messages are always short and complete */
-	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, (socklen_t)sizeof(on));
-	/* We also want sockets to timeout if they die and we don't notice */
-	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, (socklen_t)sizeof(on));
-
-	/* attempt an initial status message write */
-	if(xwrite(fd, startup_msg, strlen(startup_msg)) == -1) {
-		xclose(fd);
-		return -2;
+	int len;
+	struct timeval now, diff;
+	unsigned long msecs;
+	char buf[BUF_SIZE * 2];
+
+	if(recordfd < 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	timeval_diff(&now, &record_last, &diff);
+	record_last = now;
+	/* a clock rollback shouldn't produce a huge unsigned delay */
+	if(diff.tv_sec < 0)
+		msecs = 0;
+	else
+		msecs = (unsigned long)diff.tv_sec * 1000 +
+			(unsigned long)diff.tv_usec / 1000;
+
+	len = snprintf(buf, sizeof(buf), "%lu %u %c%s\n",
+			msecs, c->id, op, line ? line : "");
+	if(len < 0)
+		return;
+	if((size_t)len >= sizeof(buf)) {
+		/* truncated; still keep the record line-terminated */
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+	if(xwrite(recordfd, buf, (size_t)len) == -1) {
+		perror("session record");
+		xclose(recordfd);
+		recordfd = -1;
 	}
+}
+
+/**
+ * Start tracking a connection in our array, setting up its receive buffer.
+ * @param fd the connection's file descriptor
+ * @return the connection, NULL if max connections reached or on allocation
+ * failure
+ */
+static struct conn *add_connection(int fd)
+{
+	int i;
+	struct conn *ptr, *prev = NULL;
 
 	/* add it to our linked list, ensuring we don't have too many already */
 	ptr = connections;
@@ -107,30 +288,75 @@ static int open_connection(int fd)
 		fprintf(stderr, "max connections (%d) reached!\n", MAX_CONNECTIONS);
 		xwrite(fd, max_conns, strlen(max_conns));
 		xclose(fd);
-		return -1;
+		return NULL;
 	}
 
+#ifdef TINY
+	/* connections are never unlinked, so the i-th one is always slot i */
+	if(!ptr) {
+		ptr = &conn_slab[i];
+		ptr->recv_buf = conn_bufs[i];
+		ptr->recv_buf_pos = ptr->recv_buf;
+		ptr->next = NULL;
+	}
+#else
 	if(!ptr) {
 		ptr = calloc(1, sizeof(struct conn));
 		if(!ptr)
-			return -1;
+			return NULL;
 	}
 	if(!ptr->recv_buf) {
 		ptr->recv_buf = calloc(BUF_SIZE, sizeof(char));
 		if(!ptr->recv_buf) {
 			free(ptr);
-			return -1;
+			return NULL;
 		}
 		ptr->recv_buf_pos = ptr->recv_buf;
 		ptr->next = NULL;
 	}
+#endif
 	ptr->fd = fd;
+	ptr->id = next_conn_id++;
+	ptr->pollidx = 0;
+	ptr->rate = 0;
+	timer_init(&ptr->timer, conn_timer_fired, ptr);
 	if(prev) {
 		prev->next = ptr;
 	} else {
 		/* this was the first one */
 		connections = ptr;
 	}
+	return ptr;
+}
+
+/**
+ * Establish everything we need for a connection once it has been
+ * accepted. This will set up send and receive buffers and start
+ * tracking the connection in our array.
+ * @param fd the newly opened connection's file descriptor
+ * @return 0 if initial write was successful, -1 if max connections
+ * reached, -2 on write failure (connection is closed for any failure)
+ */
+static int open_connection(int fd)
+{
+	int on = 1;
+	struct conn *c;
+
+	/* We don't need/want delay; messages are always short and complete */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, (socklen_t)sizeof(on));
+	/* We also want sockets to timeout if they die and we don't notice */
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, (socklen_t)sizeof(on));
+
+	/* attempt an initial status message write */
+	if(xwrite(fd, startup_msg, strlen(startup_msg)) == -1) {
+		xclose(fd);
+		return -2;
+	}
+
+	c = add_connection(fd);
+	if(!c)
+		return -1;
+	record_event(c, '+', NULL);
 
 	return 0;
 }
@@ -148,8 +374,37 @@ static void end_connection(struct conn *c, int freebufs)
 {
 	int fd = c->fd;
 	c->fd = -1;
-	if(fd > -1)
+	if(fd > -1) {
+		record_event(c, '-', NULL);
 		xclose(fd);
+	}
+	/* anything held back for the connection goes with it */
+	timer_disarm(&main_shard.timers, &c->timer);
+	free(c->fields);
+	c->fields = NULL;
+	c->field_count = 0;
+	c->rate = 0;
+	while(c->watches) {
+		struct watch *w = c->watches;
+		c->watches = w->next;
+		predicate_free(w->pred);
+		free(w->expr);
+		free(w);
+	}
+	c->watch_count = 0;
+	c->next_watch = 0;
+	c->quiet = 0;
+#ifndef TINY
+	if(c->zs) {
+		deflateEnd(c->zs);
+		free(c->zs);
+		c->zs = NULL;
+	}
+#endif
+#ifdef TINY
+	/* buffers in the tiny build are static and always kept */
+	freebufs = 0;
+#endif
 	if(freebufs) {
 		free(c->recv_buf);
 		c->recv_buf = NULL;
@@ -160,15 +415,393 @@ static void end_connection(struct conn *c, int freebufs)
 	printf("connection closed\n");
 }
 
+#ifndef TINY
+/**
+ * Compress data into the deflate stream of a connection and write out
+ * whatever the stream produces.
+ * @param c the connection to write to
+ * @param msg the data to compress
+ * @param len the length of the data
+ * @param flush the deflate flush mode; Z_NO_FLUSH lets the stream hold on
+ * to the data until the end of a batch
+ * @return 0 on success, -1 on failure
+ */
+static int conn_deflate(struct conn *c, const char *msg, size_t len,
+		int flush)
+{
+	unsigned char out[BUF_SIZE * 4];
+	struct timespec start, end;
+
+	c->zs->next_in = (unsigned char *)msg;
+	c->zs->avail_in = (uInt)len;
+	do {
+		size_t have;
+		int ret;
+
+		c->zs->next_out = out;
+		c->zs->avail_out = sizeof(out);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+		ret = deflate(c->zs, flush);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+		compress_nsec += (unsigned long long)((end.tv_sec - start.tv_sec)
+				* 1000000000LL + (end.tv_nsec - start.tv_nsec));
+		if(ret == Z_STREAM_ERROR)
+			return -1;
+		have = sizeof(out) - c->zs->avail_out;
+		if(have && xwrite(c->fd, out, have) == -1)
+			return -1;
+		compress_out += have;
+	} while(c->zs->avail_out == 0);
+	compress_in += len;
+	if(len)
+		compress_msgs++;
+	return 0;
+}
+
+/**
+ * Start compressing everything written to a connection. The stream is a
+ * zlib stream with a small window; our messages are short and repetitive,
+ * and a large window would cost more memory per connection than it saves.
+ * @param c the connection
+ * @return 0 on success, -1 on failure
+ */
+static int conn_compress_start(struct conn *c)
+{
+	if(c->zs)
+		return 0;
+	c->zs = calloc(1, sizeof(z_stream));
+	if(!c->zs)
+		return -1;
+	if(deflateInit2(c->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 12, 5,
+				Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(c->zs);
+		c->zs = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Finish the deflate stream of a connection, if it has one, so the client
+ * sees the end of the stream; anything written afterwards is plain text.
+ * @param c the connection
+ * @return 0 on success, -1 on write failure
+ */
+static int conn_compress_end(struct conn *c)
+{
+	int ret;
+
+	if(!c->zs)
+		return 0;
+	ret = conn_deflate(c, "", 0, Z_FINISH);
+	deflateEnd(c->zs);
+	free(c->zs);
+	c->zs = NULL;
+	return ret;
+}
+#endif
+
+/**
+ * Write a message to a single connection, compressing it if the connection
+ * asked for compression.
+ * @param c the connection to write to
+ * @param msg the message to write
+ * @param len the length of the message
+ * @param more whether more messages of the same batch follow; a compressed
+ * stream is only flushed to the client at the end of a batch
+ * @return 0 on success, -1 on write failure
+ */
+static int conn_write(struct conn *c, const char *msg, size_t len, int more)
+{
+#ifndef TINY
+	if(c->zs)
+		return conn_deflate(c, msg, len, more ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+#endif
+	(void)more;
+	return xwrite(c->fd, msg, len) == -1 ? -1 : 0;
+}
+
+/**
+ * Write a message to a single connection, ending it if the write fails.
+ * @param c the connection to write to
+ * @param msg the message to write
+ * @param len the length of the message
+ * @return 0 on success, -1 if the connection was ended
+ */
+static int conn_send(struct conn *c, const char *msg, size_t len)
+{
+	if(conn_write(c, msg, len, 0) == -1) {
+		end_connection(c, 0);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Find the record of a status field on a rate limited connection, adding it
+ * if the field has not been sent to the connection before.
+ * @param c the connection
+ * @param key the field key, "[@name ]field"; must fit in the record
+ * @return the field record, NULL on allocation failure
+ */
+static struct conn_field *conn_field(struct conn *c, const char *key)
+{
+	struct conn_field *fields;
+	unsigned long hash = hash_sdbm(key);
+	size_t i;
+
+	for(i = 0; i < c->field_count; i++) {
+		if(c->fields[i].hash == hash && strcmp(c->fields[i].key, key) == 0)
+			return &c->fields[i];
+	}
+	fields = realloc(c->fields, (c->field_count + 1) * sizeof(*fields));
+	if(!fields)
+		return NULL;
+	c->fields = fields;
+	memset(&fields[c->field_count], 0, sizeof(*fields));
+	fields[c->field_count].hash = hash;
+	strcpy(fields[c->field_count].key, key);
+	return &fields[c->field_count++];
+}
+
+/**
+ * Find when a field on a rate limited connection may be sent again.
+ * @param c the connection
+ * @param f the field record
+ * @param due the time the field is due
+ */
+static void conn_field_due(struct conn *c, struct conn_field *f,
+		struct timeval *due)
+{
+	struct timeval rate;
+	rate.tv_sec = c->rate / 1000;
+	rate.tv_usec = (c->rate % 1000) * 1000;
+	timeval_add(&f->sent, &rate, due);
+}
+
+/**
+ * Write a message to a rate limited connection. A message for a field sent
+ * less than the rate ago is held back; a newer message for the same field
+ * replaces it, so only the latest value is written once the field is due.
+ * Messages that are not receiver state, such as errors, group
+ * confirmations and snapshots, are written right away.
+ * @param c the connection to write to
+ * @param msg the message to write, including trailing newline
+ * @param len the length of the message
+ * @param now the current time
+ */
+static void conn_write_limited(struct conn *c, const char *msg, size_t len,
+		struct timeval *now)
+{
+	struct conn_field *f;
+	struct timeval due, diff;
+	const char *body = msg;
+	char field[64], key[sizeof(f->key)];
+	int keylen;
+
+	/* the field key is the receiver prefix and the state field,
+	 * "[@name ]field"; anything that is not receiver state goes out now */
+	if(*msg == '@') {
+		body = strchr(msg, ' ');
+		body = body ? body + 1 : msg;
+	}
+	if(len >= sizeof(f->held)
+			|| state_field(body, field, sizeof(field)) == -1) {
+		conn_send(c, msg, len);
+		return;
+	}
+	keylen = snprintf(key, sizeof(key), "%.*s%s",
+			(int)(body - msg), msg, field);
+	if(keylen < 0 || (size_t)keylen >= sizeof(key)) {
+		conn_send(c, msg, len);
+		return;
+	}
+	f = conn_field(c, key);
+	if(!f) {
+		conn_send(c, msg, len);
+		return;
+	}
+
+	if(f->held[0]) {
+		/* already waiting; the newer value wins */
+		memcpy(f->held, msg, len + 1);
+		return;
+	}
+	conn_field_due(c, f, &due);
+	timeval_diff(&due, now, &diff);
+	if(!timeval_positive(&diff)) {
+		f->sent = *now;
+		conn_send(c, msg, len);
+		return;
+	}
+	memcpy(f->held, msg, len + 1);
+	/* the timer stays armed for the earliest held field */
+	if(c->timer.slot != TIMER_IDLE) {
+		timeval_diff(&due, &c->timer.when, &diff);
+		if(timeval_positive(&diff))
+			return;
+	}
+	timer_arm(&main_shard.timers, &c->timer, due);
+}
+
+/**
+ * Write the held back messages of a rate limited connection.
+ * @param c the connection
+ * @param now the current time
+ * @param all write every held message, not only those that are due
+ */
+static void conn_flush(struct conn *c, struct timeval *now, int all)
+{
+	struct timeval next = { 0, 0 };
+	size_t i;
+
+	for(i = 0; i < c->field_count; i++) {
+		struct conn_field *f = &c->fields[i];
+		struct timeval due, diff;
+
+		if(!f->held[0])
+			continue;
+		conn_field_due(c, f, &due);
+		timeval_diff(&due, now, &diff);
+		if(!all && timeval_positive(&diff)) {
+			next = timeval_min(&next, &due);
+			continue;
+		}
+		f->sent = *now;
+		/* a failed write ends the connection and frees the fields */
+		if(conn_send(c, f->held, strlen(f->held)) == -1)
+			return;
+		f->held[0] = '\0';
+	}
+	if(next.tv_sec || next.tv_usec)
+		timer_arm(&main_shard.timers, &c->timer, next);
+	else
+		timer_disarm(&main_shard.timers, &c->timer);
+}
+
+static void conn_timer_fired(struct timer *t, struct timeval *now)
+{
+	conn_flush(t->data, now, 0);
+}
+
+/**
+ * Set the rate limit of a connection from a "ratelimit <ms>" command.
+ * Anything held back is written out first, so a new rate starts clean.
+ * @param c the connection
+ * @param arg the command argument, the least time in milliseconds between
+ * messages for one field; 0 turns the limit off
+ * @return 0 on success, -1 on an invalid argument, -2 on write failure
+ */
+static int conn_set_rate(struct conn *c, const char *arg)
+{
+	char buf[32];
+	char *test;
+	struct timeval now;
+	long ms = strtol(arg, &test, 10);
+
+	if(*arg == '\0' || *test != '\0' || ms < 0 || ms > 60000)
+		return -1;
+	gettimeofday(&now, NULL);
+	conn_flush(c, &now, 1);
+	if(c->fd < 0)
+		return -2;
+	free(c->fields);
+	c->fields = NULL;
+	c->field_count = 0;
+	c->rate = ms;
+	snprintf(buf, sizeof(buf), "OK:ratelimit:%ld\n", ms);
+	if(conn_write(c, buf, strlen(buf), 0) == -1)
+		return -2;
+	return 0;
+}
+
+#ifndef TINY
+/**
+ * Turn compression of a connection on or off from a "compress <mode>"
+ * command. The reply is always written uncompressed: when turning
+ * compression on, the deflate stream starts right after it; when turning it
+ * off, the stream is finished right before it.
+ * @param c the connection
+ * @param arg the command argument, "deflate" or "off"
+ * @return 0 on success, -1 on an invalid argument, -2 on write failure
+ */
+static int conn_set_compress(struct conn *c, const char *arg)
+{
+	static const char * const on_msg = "OK:compress:deflate\n";
+	static const char * const off_msg = "OK:compress:off\n";
+
+	if(strcmp(arg, "deflate") == 0) {
+		/* asking again just gets the reply, in the stream */
+		if(c->zs)
+			return conn_write(c, on_msg, strlen(on_msg), 0) == -1 ? -2 : 0;
+		if(xwrite(c->fd, on_msg, strlen(on_msg)) == -1)
+			return -2;
+		/* without a stream the connection just stays uncompressed */
+		conn_compress_start(c);
+		return 0;
+	} else if(strcmp(arg, "off") == 0) {
+		if(conn_compress_end(c) == -1)
+			return -2;
+		return xwrite(c->fd, off_msg, strlen(off_msg)) == -1 ? -2 : 0;
+	}
+	return -1;
+}
+#endif
+
+/**
+ * Check if a listener was passed in by our service manager.
+ * @param fd the listener descriptor
+ * @return 1 if it was, 0 otherwise
+ */
+static int is_activated(int fd)
+{
+	size_t i;
+	for(i = 0; i < activated_count; i++) {
+		if(activated[i] == fd)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Close a listener and remove it from our list of listeners. The path of a
+ * UNIX socket listener is unlinked unless our service manager created it.
+ * @param fd the listener descriptor
+ */
+static void close_listener(int fd)
+{
+	struct sockaddr_un saddr;
+	socklen_t sl = (socklen_t)sizeof(saddr);
+	size_t i;
+
+	if(is_activated(fd)) {
+		/* leave the socket for the next time we are started */
+	} else if(getsockname(fd, (struct sockaddr *)&saddr, &sl)) {
+		perror("getsockname()");
+	} else {
+		/* for unix sockets, we want to unlink the path */
+		if(saddr.sun_family == AF_UNIX) {
+			unlink(saddr.sun_path);
+		}
+	}
+	xclose(fd);
+	for(i = 0; i < listener_count; i++) {
+		if(listeners[i] == fd)
+			listeners[i] = -1;
+	}
+}
+
 /**
  * Cleanup all resources associated with our program, including memory,
  * open devices, files, sockets, etc. This function will not return.
  * The complete list of cleanup actions is the following:
+ * - worker shard threads
  * - command queue (empty it)
  * - serial device (reset and close)
  * - our listeners
  * - any open connections
  * - our internal signal pipe
+ * - the state journal and state cache
  * - our user command list
  * @param ret the eventual exit code for our program
  */
@@ -177,22 +810,69 @@ static void cleanup(int ret)
 {
 	size_t i;
 
-	while(receivers) {
-		struct receiver *rcvr = receivers;
+	service_notify("STOPPING=1");
+
+	/* stop the worker threads before we pull receivers out from under them */
+	shard_stop(workers, worker_count);
+	free(workers);
+	workers = NULL;
+	worker_count = 0;
+
+	for(i = 0; i < receiver_count; i++) {
+		struct receiver *rcvr = receivers[i];
+		timer_disarm(&main_shard.timers, &rcvr->flood_timer);
 		/* clear our command queue */
 		while(rcvr->queue) {
 			struct cmdqueue *ptr = rcvr->queue;
-			free(ptr->cmd);
 			rcvr->queue = ptr->next;
-			free(ptr);
+			cmdqueue_free(ptr);
+		}
+		while(rcvr->held) {
+			struct cmdqueue *ptr = rcvr->held;
+			rcvr->held = ptr->next;
+			cmdqueue_free(ptr);
 		}
 		/* reset/close our receiver device */
 		if(rcvr->fd > -1) {
 			xclose(rcvr->fd);
 		}
-		receivers = receivers->next;
+		if(rcvr->shard && rcvr->shard->threaded)
+			pthread_mutex_destroy(&rcvr->lock);
+		rcvr_resolve_free(rcvr);
+		free(rcvr->name);
+		free(rcvr->path);
 		free(rcvr);
 	}
+	free(receivers);
+	receivers = NULL;
+	receiver_count = 0;
+	rules_free();
+	cmdqueue_clear();
+	while(groups) {
+		struct group *g = groups;
+		groups = g->next;
+		free(g->name);
+		free(g->members);
+		free(g->waiting);
+		free(g);
+	}
+	/* loop through connection descriptors and close them; this drops
+	 * their timers, so it comes before the main shard goes */
+	while(connections) {
+		struct conn *ptr = connections;
+		end_connection(ptr, 1);
+		connections = ptr->next;
+#ifndef TINY
+		free(ptr);
+#endif
+	}
+
+	shard_stop(&main_shard, 1);
+	journal_close();
+	state_clear();
+#ifndef TINY
+	history_clear();
+#endif
 
 	/* close the log file descriptor */
 	if(logfd > -1) {
@@ -202,29 +882,32 @@ static void cleanup(int ret)
 
 	/* loop through listener descriptors and close them */
 	for(i = 0; i < listener_count; i++) {
-		if(listeners[i] > -1) {
-			struct sockaddr saddr;
-			socklen_t sl = (socklen_t)sizeof(struct sockaddr);
-			if(getsockname(listeners[i], &saddr, &sl)) {
-				perror("getsockname()");
-			} else {
-				/* for unix sockets, we want to unlink the path */
-				if(saddr.sa_family == AF_UNIX) {
-					unlink(((struct sockaddr_un *)&saddr)->sun_path);
-				}
-			}
-			xclose(listeners[i]);
-		}
+		if(listeners[i] > -1)
+			close_listener(listeners[i]);
 	}
 	free(listeners);
 	listeners = NULL;
-
-	/* loop through connection descriptors and close them */
-	while(connections) {
-		struct conn *ptr = connections;
-		end_connection(connections, 1);
-		connections = connections->next;
-		free(ptr);
+	free(activated);
+	activated = NULL;
+	activated_count = 0;
+	for(i = 0; i < config_listener_count; i++)
+		free(config_listeners[i].spec);
+	free(config_listeners);
+	config_listeners = NULL;
+	config_listener_count = 0;
+	config_free(config);
+	config = NULL;
+	free(config_path);
+	free(raw_log_path);
+#ifndef TINY
+	free(exe_path);
+	free(saved_argv);
+#endif
+
+	/* close the session record after connections have logged their close */
+	if(recordfd > -1) {
+		xclose(recordfd);
+		recordfd = -1;
 	}
 
 	/* close our signal listener */
@@ -261,23 +944,64 @@ static void pipehandler(int signo)
  */
 static void show_status(void)
 {
-	struct receiver *r;
+	struct group *g;
 	struct conn *c;
-	size_t i;
-
-	for(r = receivers; r; r = r->next) {
-		printf("receiver      : %d (%d, %ld)\n",
+	struct rule *rule;
+	struct timeval now, uptime;
+	unsigned long wakeups;
+	size_t i, watches = 0;
+#ifndef TINY
+	unsigned long changes;
+	size_t history;
+#endif
+	int zone;
+
+	for(i = 0; i < receiver_count; i++) {
+		struct receiver *r = receivers[i];
+		printf("receiver      : %s%s: %d (%d, %ld)\n",
+				r->name, r == default_rcvr ? " (default)" : "",
 				r->fd, r->type, r->last_cmd.tv_sec);
-		printf("power status  : %X; main (%s)  zone2 (%s)  zone3 (%s)\n",
-				r->power,
-				r->power & MAIN_POWER  ? "ON" : "off",
-				r->power & ZONE2_POWER ? "ON" : "off",
-				r->power & ZONE3_POWER ? "ON" : "off");
-		printf("sleep:        : zone2 (%ld)  zone3 (%ld) update (%ld)\n",
-				r->zone2_sleep.tv_sec, r->zone3_sleep.tv_sec,
-				r->next_sleep_update.tv_sec);
-		printf("cmds sent     : %lu\n", r->cmds_sent);
+		printf("power status  : %X; main (%s)", r->power,
+				r->power & MAIN_POWER ? "ON" : "off");
+		for(zone = 2; zone <= ZONE_COUNT; zone++) {
+			printf("  zone%d (%s)", zone,
+					r->power & ZONE_POWER(zone) ? "ON" : "off");
+		}
+		printf("\nsleep:        :");
+		for(zone = 2; zone <= ZONE_COUNT; zone++) {
+			printf(" zone%d (%ld) ", zone, r->zones[zone - 1].sleep.tv_sec);
+		}
+		printf("update (%ld)\n", r->next_sleep_update.tv_sec);
+		printf("cmds sent     : %lu (%lu pipelined)\n", r->cmds_sent,
+				r->cmds_pipelined);
 		printf("msgs received : %lu\n", r->msgs_received);
+		if(r->jitter_count) {
+			printf("send jitter   : avg %lldus, max %ldus\n",
+					r->jitter_total / (long long)r->jitter_count,
+					r->jitter_max);
+		}
+		printf("power floods  : %lu (%lu queries saved)\n",
+				r->floods, r->queries_saved);
+#ifndef TINY
+		history = history_bytes(r->name, &changes);
+		printf("history       : %lu changes, %lu bytes held\n", changes,
+				(unsigned long)history);
+#endif
+	}
+#ifndef TINY
+	if(compress_msgs) {
+		printf("compression   : %llu bytes in, %llu out, %lld saved, "
+				"%lluns cpu per message\n", compress_in, compress_out,
+				(long long)compress_in - (long long)compress_out,
+				compress_nsec / compress_msgs);
+	}
+#endif
+	for(g = groups; g; g = g->next) {
+		printf("group         : %s:", g->name);
+		for(i = 0; i < g->member_count; i++) {
+			printf(" %s%s", g->members[i]->name, g->waiting[i] ? "*" : "");
+		}
+		printf("\n");
 	}
 	printf("log file      : %d\n", logfd);
 
@@ -289,8 +1013,23 @@ static void show_status(void)
 	printf("\nconnections   : ");
 	for(c = connections; c; c = c->next) {
 		printf("%d ", c->fd);
+		watches += c->watch_count;
 	}
 	printf("\n");
+	wakeups = main_shard.wakeups;
+	for(i = 0; i < worker_count; i++)
+		wakeups += __atomic_load_n(&workers[i].wakeups, __ATOMIC_RELAXED);
+	gettimeofday(&now, NULL);
+	timeval_diff(&now, &started, &uptime);
+	printf("wakeups       : %lu (%lu per hour)\n", wakeups,
+			uptime.tv_sec > 0 ? wakeups * 3600 / (unsigned long)uptime.tv_sec
+			: 0);
+	printf("watches       : %lu (%lu notifications)\n",
+			(unsigned long)watches, watch_flips);
+	for(rule = rules, i = 0; rule; rule = rule->next)
+		i++;
+	printf("rules         : %lu (%lu fired)\n", (unsigned long)i,
+			rules_fired);
 }
 
 /**
@@ -309,7 +1048,14 @@ static void realhandler(int signo)
 		fprintf(stderr, "attempted IO to a closed socket/pipe\n");
 	} else if(signo == SIGUSR1) {
 		show_status();
+	} else if(signo == SIGHUP) {
+		reload_config();
 	}
+#ifndef TINY
+	else if(signo == SIGUSR2) {
+		upgrade();
+	}
+#endif
 }
 
 /**
@@ -323,39 +1069,127 @@ static void log_raw_serial(const char *path)
 		perror(path);
 		cleanup(EXIT_FAILURE);
 	}
+	free(raw_log_path);
+	raw_log_path = strdup(path);
 }
 
 /**
- * Daemonize our program, forking and setting a new session ID. This will
- * ensure we are not associated with the terminal we are called in, allowing
- * us to be started like any other daemon program.
+ * Reopen the raw output log, appending to it, e.g. after it was rotated or
+ * the config file named a new log. The new file takes over the existing
+ * descriptor so receiver threads never see it closed.
+ * @param path the log path, NULL to stop logging
+ * @return 0 on success, -1 on failure
  */
-static void daemonize(void)
+static int reopen_raw_log(const char *path)
 {
-	int pid;
-
-	/* redirect our stdout and stderr to nowhere since we are not going to
-	 * be associated with a terminal */
-	fflush(NULL);
-	freopen("/dev/null", "r", stdin);
-	freopen("/dev/null", "w", stdout);
-	freopen("/dev/null", "w", stderr);
-
-	/* pull off the amazing trickeration needed to get in the background */
-	fflush(NULL);
-	pid = fork();
-	if (pid > 0)
-		_exit(EXIT_SUCCESS);
-	else if (pid < 0) {
-		fprintf(stderr, "problems fork'ing for daemon!\n");
-	}
+	int fd;
 
-	if (chdir("/") < 0) {
-		fprintf(stderr, "problems changing to root directory\n");
+	if(!path) {
+		fd = logfd;
+		logfd = -1;
+		if(fd > -1)
+			xclose(fd);
+		free(raw_log_path);
+		raw_log_path = NULL;
+		return 0;
 	}
 
-	if (setsid() < 0) {
-		fprintf(stderr, "problems setsid'ing\n");
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND,
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if(logfd > -1) {
+		dup2(fd, logfd);
+		xclose(fd);
+	} else {
+		logfd = fd;
+	}
+	if(path != raw_log_path) {
+		free(raw_log_path);
+		raw_log_path = strdup(path);
+	}
+	return 0;
+}
+
+/**
+ * Create and open a file for recording client sessions. The recording can
+ * later be fed to the onkyo-replay tool to reproduce the client traffic.
+ * @param path the path to the session record file
+ */
+static void record_sessions(const char *path)
+{
+	recordfd = creat(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (recordfd < 0) {
+		perror(path);
+		cleanup(EXIT_FAILURE);
+	}
+	gettimeofday(&record_last, NULL);
+}
+
+/**
+ * Make sure the receiver-facing path never has to wait on the kernel for
+ * memory: set aside spare command queue entries and heap, keep the heap
+ * from being handed back, and lock everything we have and will map into
+ * RAM.
+ * @return 0 on success, -1 on failure
+ */
+static int lock_memory(void)
+{
+	char *heap;
+
+	if(cmdqueue_reserve(RT_QUEUE_RESERVE) == -1)
+		return -1;
+
+	/* one heap that never shrinks, and no separately mapped chunks */
+	mallopt(M_ARENA_MAX, 1);
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		perror("mlockall()");
+		return -1;
+	}
+	/* touch the heap we set aside so it is faulted in now */
+	heap = malloc(RT_HEAP_RESERVE);
+	if(!heap)
+		return -1;
+	memset(heap, 0, RT_HEAP_RESERVE);
+	free(heap);
+	return 0;
+}
+
+/**
+ * Daemonize our program, forking and setting a new session ID. This will
+ * ensure we are not associated with the terminal we are called in, allowing
+ * us to be started like any other daemon program.
+ */
+static void daemonize(void)
+{
+	int pid;
+
+	/* redirect our stdout and stderr to nowhere since we are not going to
+	 * be associated with a terminal */
+	fflush(NULL);
+	freopen("/dev/null", "r", stdin);
+	freopen("/dev/null", "w", stdout);
+	freopen("/dev/null", "w", stderr);
+
+	/* pull off the amazing trickeration needed to get in the background */
+	fflush(NULL);
+	pid = fork();
+	if (pid > 0)
+		_exit(EXIT_SUCCESS);
+	else if (pid < 0) {
+		fprintf(stderr, "problems fork'ing for daemon!\n");
+	}
+
+	if (chdir("/") < 0) {
+		fprintf(stderr, "problems changing to root directory\n");
+	}
+
+	if (setsid() < 0) {
+		fprintf(stderr, "problems setsid'ing\n");
 	}
 
 	fflush(NULL);
@@ -367,77 +1201,198 @@ static void daemonize(void)
 	}
 }
 
+#ifndef TINY
 /**
- * Open the serial device at the given path for use as a destination
- * receiver. Also adds it to our global list of serial devices.
- * @param path the path to the serial device, e.g. "/dev/ttyS0"
- * @return the serial device file descriptor
+ * Run as a hot standby for a primary daemon. We subscribe to the state
+ * journal of the primary and keep our state cache in sync with it until
+ * the primary goes away, at which point we return so the caller can take
+ * over the receivers and listeners. If the primary merely dropped us, we
+ * will find it still listening and subscribe again.
+ * @param path the journal socket path of the primary
  */
-static int open_serial_device(const char *path)
+static void run_standby(const char *path)
 {
-	int ret;
-	struct termios newtio;
-	struct receiver *rcvr;
+	int fd;
 
-	if (!(rcvr = calloc(1, sizeof(struct receiver))))
-		goto cleanup;
+	fd = journal_subscribe(path);
+	if(fd == -1) {
+		printf("no primary at %s, starting up\n", path);
+		return;
+	}
+	printf("standing by for primary at %s\n", path);
 
-	/* Open serial device for reading and writing, but not as controlling
-	 * TTY because we don't want to get killed if linenoise sends CTRL-C.
-	 */
-	rcvr->fd = xopen(path, O_RDWR | O_NOCTTY);
-	if (rcvr->fd < 0)
-		goto cleanup;
+	for(;;) {
+		struct pollfd pfds[2];
+
+		pfds[0].fd = signalpipe[READ];
+		pfds[0].events = POLLIN;
+		pfds[1].fd = fd;
+		pfds[1].events = POLLIN;
+		if(poll(pfds, 2, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			perror("poll()");
+			cleanup(EXIT_FAILURE);
+		}
+		if(pfds[0].revents) {
+			int signo;
+			xread(signalpipe[READ], &signo, sizeof(int));
+			realhandler(signo);
+		}
+		if(pfds[1].revents && journal_receive(fd) == -1) {
+			xclose(fd);
+			fd = journal_subscribe(path);
+			if(fd == -1)
+				break;
+		}
+	}
+	printf("primary at %s went away, taking over\n", path);
+}
+#endif
 
-	memset(&newtio, 0, sizeof(struct termios));
-	/* Set:
-	 * B9600 - 9600 baud
-	 * No flow control
-	 * CS8 - 8n1 (8 bits, no parity, 1 stop bit)
-	 * Don't hangup automatically
-	 * CLOCAL - ignore modem status
-	 * CREAD - enable receiving characters
-	 */
-	newtio.c_cflag = B9600 | CS8 | CLOCAL | CREAD;
-	/* ignore bytes with parity errors and make terminal raw and dumb */
-	newtio.c_iflag = IGNPAR;
-	/* raw output mode */
-	newtio.c_oflag = 0;
-	/* canonical input mode- end read at a line descriptor */
-	newtio.c_lflag = ICANON;
-	/* add the Onkyo-used EOF char to allow canonical read */
-	newtio.c_cc[VEOL] = (cc_t)END_RECV[strlen(END_RECV) - 1];
-
-	/* clean the line and activate the settings */
-	ret = tcflush(rcvr->fd, TCIOFLUSH);
-	if(ret < 0)
-		goto cleanup;
+/**
+ * Add a receiver to our global array and hand it to a shard. Receivers are
+ * spread round-robin over the worker shards if we have any.
+ * @param rcvr the receiver to add
+ * @return 0 on success, -1 on allocation failure
+ */
+static int add_receiver(struct receiver *rcvr)
+{
+	struct receiver **new_receivers;
+	struct shard *sh = &main_shard;
 
-	ret = tcsetattr(rcvr->fd, TCSAFLUSH, &newtio);
-	if(ret < 0)
-		goto cleanup;
+	new_receivers = realloc(receivers,
+			(receiver_count + 1) * sizeof(struct receiver *));
+	if(!new_receivers)
+		return -1;
+	receivers = new_receivers;
+
+	if(worker_count)
+		sh = &workers[receiver_count % worker_count];
+	if(shard_add(sh, rcvr) == -1)
+		return -1;
+	receivers[receiver_count++] = rcvr;
+	return 0;
+}
+
+/**
+ * Look up a receiver by the name it was configured with.
+ * @param name the receiver name
+ * @return the receiver, NULL if no receiver has the given name
+ */
+static struct receiver *find_receiver(const char *name)
+{
+	unsigned long hashval = hash_sdbm(name);
+	size_t i;
+
+	for(i = 0; i < receiver_count; i++) {
+		struct receiver *r = receivers[i];
+		if(r->name_hash == hashval && strcmp(r->name, name) == 0)
+			return r;
+	}
+	return NULL;
+}
+
+/**
+ * Allocate a new receiver with the given name. The receiver is not yet
+ * added to our global array.
+ * @param name the name used to address the receiver
+ * @param path the path to the serial device
+ * @return the receiver, NULL on a duplicate name or allocation failure
+ */
+static struct receiver *new_receiver(const char *name, const char *path)
+{
+	struct receiver *rcvr;
+
+	if(find_receiver(name)) {
+		fprintf(stderr, "duplicate receiver name: %s\n", name);
+		return NULL;
+	}
+	rcvr = calloc(1, sizeof(struct receiver));
+	if(!rcvr)
+		return NULL;
+	rcvr->fd = -1;
+	rcvr->name = strdup(name);
+	rcvr->path = strdup(path);
+	if(!rcvr->name || !rcvr->path) {
+		free(rcvr->name);
+		free(rcvr->path);
+		free(rcvr);
+		return NULL;
+	}
+	rcvr->name_hash = hash_sdbm(rcvr->name);
+	rcvr->type = strncmp(path, "eiscp:", 6) == 0 ? RCVR_EISCP : RCVR_SERIAL;
+	rcvr->depth = 1;
+	timer_init(&rcvr->flood_timer, flood_timer_fired, rcvr);
+	return rcvr;
+}
+
+/**
+ * Set up a receiver for the serial device at the given path and add it to
+ * our global list of receivers. The device is opened asynchronously by the
+ * shard the receiver is handed to, and reopened whenever the link fails, so
+ * a missing or stuck device never holds up the daemon.
+ * @param name the name used to address the receiver, NULL to use the
+ * basename of the device path
+ * @param path the path to the serial device, e.g. "/dev/ttyS0"
+ * @return 0 on success, -1 on failure
+ */
+static int open_serial_device(const char *name, const char *path)
+{
+	struct receiver *rcvr;
+
+	if(!name) {
+		name = strrchr(path, '/');
+		name = name ? name + 1 : path;
+	}
+	if (!(rcvr = new_receiver(name, path)))
+		return -1;
 
 	/* a few more pieces of info filled in */
 	rcvr->power = POWER_OFF;
-	/* queue up an initial power command */
-	process_command(rcvr, "power");
-
-	/* place the device in our global list */
-	if(!receivers) {
-		receivers = rcvr;
-	} else {
-		struct receiver *ptr = rcvr;
-		while(ptr->next)
-			ptr = ptr->next;
-		ptr->next = rcvr;
+	/* network receivers are looked up now so reconnecting never waits on
+	 * DNS; if this fails, the lookup is retried in the background */
+	rcvr_resolve(rcvr);
+	/* try to open the device right away */
+	gettimeofday(&rcvr->reopen_at, NULL);
+
+	/* place the device in our global array */
+	if(add_receiver(rcvr) == -1) {
+		perror(path);
+		rcvr_resolve_free(rcvr);
+		free(rcvr->name);
+		free(rcvr->path);
+		free(rcvr);
+		return -1;
 	}
+	rcvr_changed(rcvr);
+
+	return 0;
+}
 
-	return rcvr->fd;
+/**
+ * Open a receiver from a command line specification of the form
+ * "[name=]path", e.g. "den=/dev/ttyUSB0".
+ * @param spec the receiver specification
+ * @return 0 on success, -1 on failure
+ */
+static int open_receiver(const char *spec)
+{
+	int ret;
+	char *name, *path;
 
-cleanup:
-	perror(path);
-	free(rcvr);
-	return -1;
+	name = strdup(spec);
+	if(!name)
+		return -1;
+	path = strchr(name, '=');
+	if(path) {
+		*path++ = '\0';
+		ret = open_serial_device(name, path);
+	} else {
+		ret = open_serial_device(NULL, name);
+	}
+	free(name);
+	return ret;
 }
 
 /**
@@ -494,6 +1449,26 @@ static int listen_and_add(int fd)
 	return fd;
 }
 
+/**
+ * Add a listener passed in by our service manager, already bound and
+ * listening, to our list of listeners.
+ * @param fd the listener descriptor
+ * @return the provided listener descriptor, -1 on failure
+ */
+static int add_activated(int fd)
+{
+	int *new_activated;
+
+	new_activated = realloc(activated, (activated_count + 1) * sizeof(int));
+	if(!new_activated)
+		return -1;
+	activated = new_activated;
+	if(listen_and_add(fd) == -1)
+		return -1;
+	activated[activated_count++] = fd;
+	return fd;
+}
+
 /**
  * Open a listening socket on the given bind address and port number.
  * Also add it to our global list of listeners.
@@ -559,92 +1534,1470 @@ static int open_net_listener(const char * restrict host,
 		fd = -1;
 	}
 
-	/* make sure we free the result of our addr query */
-	freeaddrinfo(result);
+	/* make sure we free the result of our addr query */
+	freeaddrinfo(result);
+
+	return listen_and_add(fd);
+}
+
+/**
+ * Open a local socket at the given path.
+ * Also add it to our global list of listeners.
+ * @param path the path to the unix socket to create
+ * @return the new socket fd
+ */
+static int open_socket_listener(const char *path)
+{
+	int fd = -1;
+	struct sockaddr_un addr;
+
+	if(strlen(path) > sizeof(addr.sun_path) - 1) {
+		fprintf(stderr, "socket path too long\n");
+		return -1;
+	}
+
+	/* attempt to open the socket */
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1) {
+		perror("socket()");
+		return -1;
+	}
+
+	/* attempt to bind to the socket */
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) != 0) {
+		perror("bind()");
+		return -1;
+	}
+
+	return listen_and_add(fd);
+}
+
+/**
+ * Process a command for the given receiver and update its schedule to
+ * reflect anything that was queued.
+ * @param rcvr the receiver to process the command for
+ * @param cmd the full command string, e.g. "power on"
+ * @return the process_command() result
+ */
+static int queue_command(struct receiver *rcvr, const char *cmd)
+{
+	int ret;
+
+	rcvr_lock(rcvr);
+	ret = process_command(rcvr, cmd);
+	if(rcvr->flooding)
+		flood_hold(rcvr);
+	rcvr_unlock(rcvr);
+	rcvr_changed(rcvr);
+	return ret;
+}
+
+/**
+ * Look up a receiver group by name.
+ * @param name the group name
+ * @return the group, NULL if no group has the given name
+ */
+static struct group *find_group(const char *name)
+{
+	unsigned long hashval = hash_sdbm(name);
+	struct group *g;
+
+	for(g = groups; g; g = g->next) {
+		if(g->name_hash == hashval && strcmp(g->name, name) == 0)
+			return g;
+	}
+	return NULL;
+}
+
+/**
+ * Report a timeout for any group member that has not yet confirmed the
+ * last command dispatched to the group.
+ * @param g the group to check
+ */
+static void group_flush(struct group *g)
+{
+	size_t i;
+	char msg[BUF_SIZE * 2];
+
+	for(i = 0; i < g->member_count; i++) {
+		if(!g->waiting[i])
+			continue;
+		g->waiting[i] = 0;
+		rcvr_lock(g->members[i]);
+		if(g->members[i]->sync_group == g)
+			g->members[i]->sync_group = NULL;
+		rcvr_unlock(g->members[i]);
+		snprintf(msg, sizeof(msg), "OK:group:%s:%s:timeout\n",
+				g->name, g->members[i]->name);
+		write_to_connections(msg);
+	}
+}
+
+static void group_timer_fired(struct timer *t, UNUSED struct timeval *now)
+{
+	group_flush(t->data);
+}
+
+/**
+ * Report that a group member confirmed the last command dispatched to the
+ * group. This must run on the main thread.
+ * @param rcvr the receiver that confirmed the command
+ * @param g the group the command was dispatched to
+ * @param latency the time from sending to confirmation in milliseconds
+ */
+static void group_confirmed(struct receiver *rcvr, struct group *g,
+		long latency)
+{
+	char msg[BUF_SIZE * 2];
+	size_t i;
+	int waiting = 0;
+
+	for(i = 0; i < g->member_count; i++) {
+		if(g->members[i] == rcvr)
+			g->waiting[i] = 0;
+		waiting |= g->waiting[i];
+	}
+	snprintf(msg, sizeof(msg), "OK:group:%s:%s:%ld\n", g->name, rcvr->name,
+			latency);
+	write_to_connections(msg);
+	if(!waiting)
+		timer_disarm(&main_shard.timers, &g->timer);
+}
+
+/**
+ * Note a status message from a receiver that is waiting for a group command
+ * to be confirmed. If the status answers the group command, the time from
+ * sending the command to its confirmation is reported.
+ * @param rcvr the receiver the status message came from
+ * @param status the status message with the start characters stripped
+ */
+void group_confirm(struct receiver *rcvr, const char *status)
+{
+	struct group *g = rcvr->sync_group;
+	struct timeval now, diff;
+	long latency;
+
+	if(strncmp(status, rcvr->sync_prefix, 3) != 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	timeval_diff(&now, &rcvr->sync_sent, &diff);
+	rcvr->sync_group = NULL;
+	latency = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+	if(!shard_offload(rcvr, g, latency, NULL))
+		group_confirmed(rcvr, g, latency);
+}
+
+/**
+ * Send a command to every member of a group. The command is parsed once and
+ * placed at the front of each member queue, ahead of anything already
+ * queued there. All copies are held until the same release time, chosen so
+ * the wait between commands has passed for every member, so they go out in
+ * the same pass of the main loop.
+ * @param g the group to send the command to
+ * @param line the command string, e.g. "mute on"
+ * @return 0 on success, -1 on an invalid command
+ */
+static int group_dispatch(struct group *g, const char *line)
+{
+	struct cmdqueue *parsed, *p;
+	struct timeval now, release, wait;
+	size_t i;
+
+	parsed = parse_command(line);
+	if(!parsed)
+		return -1;
+
+	/* anything still unconfirmed from the last dispatch is a timeout now */
+	group_flush(g);
+
+	gettimeofday(&now, NULL);
+	wait.tv_sec = shard_pacing() / 1000;
+	wait.tv_usec = (shard_pacing() % 1000) * 1000;
+	timeval_add(&now, &wait, &release);
+
+	for(i = 0; i < g->member_count; i++) {
+		struct receiver *r = g->members[i];
+		struct cmdqueue **pos;
+
+		rcvr_lock(r);
+		pos = &r->queue;
+		/* go after any group commands already waiting at the front */
+		while(*pos && (*pos)->sync)
+			pos = &(*pos)->next;
+		for(p = parsed; p; p = p->next) {
+			struct cmdqueue *q = cmdqueue_alloc();
+			if(!q)
+				break;
+			memcpy(q, p, sizeof(struct cmdqueue));
+			q->not_before = release;
+			q->sync = g;
+			q->next = *pos;
+			*pos = q;
+			pos = &q->next;
+		}
+		rcvr_unlock(r);
+		g->waiting[i] = 1;
+		rcvr_changed(r);
+	}
+
+	while(parsed) {
+		p = parsed;
+		parsed = p->next;
+		cmdqueue_free(p);
+	}
+
+	wait.tv_sec = GROUP_CONFIRM_WAIT / 1000;
+	wait.tv_usec = (GROUP_CONFIRM_WAIT % 1000) * 1000;
+	timeval_add(&now, &wait, &release);
+	timer_arm(&main_shard.timers, &g->timer, release);
+	return 0;
+}
+
+/**
+ * Create a receiver group from a command line specification of the form
+ * "name=member,member,...", where each member is a receiver name.
+ * @param spec the group specification
+ * @return 0 on success, -1 on failure
+ */
+static int open_group(const char *spec)
+{
+	char *members, *name, *member, *saveptr;
+	struct group *g;
+
+	name = strdup(spec);
+	if(!name)
+		return -1;
+	members = strchr(name, '=');
+	if(!members || members == name) {
+		fprintf(stderr, "invalid group: %s\n", spec);
+		free(name);
+		return -1;
+	}
+	*members++ = '\0';
+	if(find_receiver(name) || find_group(name)) {
+		fprintf(stderr, "duplicate receiver or group name: %s\n", name);
+		free(name);
+		return -1;
+	}
+
+	g = calloc(1, sizeof(struct group));
+	if(!g) {
+		free(name);
+		return -1;
+	}
+	g->members = calloc(receiver_count, sizeof(struct receiver *));
+	g->waiting = calloc(receiver_count, sizeof(int));
+	if(!g->members || !g->waiting)
+		goto cleanup;
+
+	for(member = strtok_r(members, ",", &saveptr); member;
+			member = strtok_r(NULL, ",", &saveptr)) {
+		struct receiver *r = find_receiver(member);
+		size_t i;
+		if(!r) {
+			fprintf(stderr, "unknown receiver in group %s: %s\n", name, member);
+			goto cleanup;
+		}
+		for(i = 0; i < g->member_count; i++) {
+			if(g->members[i] == r)
+				break;
+		}
+		if(i == g->member_count)
+			g->members[g->member_count++] = r;
+	}
+	if(g->member_count == 0) {
+		fprintf(stderr, "group has no members: %s\n", name);
+		goto cleanup;
+	}
+
+	g->name = name;
+	g->name_hash = hash_sdbm(name);
+	timer_init(&g->timer, group_timer_fired, g);
+	g->next = groups;
+	groups = g;
+	return 0;
+
+cleanup:
+	free(g->members);
+	free(g->waiting);
+	free(g);
+	free(name);
+	return -1;
+}
+
+/**
+ * Remove a group, making sure nothing still refers to it once it is freed.
+ * @param g the group to remove
+ */
+static void remove_group(struct group *g)
+{
+	struct group **pos;
+	size_t i;
+
+	for(pos = &groups; *pos; pos = &(*pos)->next) {
+		if(*pos == g) {
+			*pos = g->next;
+			break;
+		}
+	}
+	/* anyone waiting on the group gets their answer now */
+	group_flush(g);
+
+	/* queued commands and pending confirmations may point at the group */
+	for(i = 0; i < g->member_count; i++) {
+		struct receiver *r = g->members[i];
+		struct cmdqueue *q;
+		rcvr_lock(r);
+		for(q = r->queue; q; q = q->next) {
+			if(q->sync == g)
+				q->sync = NULL;
+		}
+		if(r->sync_group == g)
+			r->sync_group = NULL;
+		rcvr_unlock(r);
+	}
+	/* deliver confirmations worker shards queued before we got the locks */
+	if(worker_count)
+		shard_drain(workers, worker_count);
+
+	timer_disarm(&main_shard.timers, &g->timer);
+	free(g->name);
+	free(g->members);
+	free(g->waiting);
+	free(g);
+}
+
+/**
+ * Open a network listener from a "host:service" specification, where
+ * either part is optional. An empty specification listens on all
+ * interfaces on the default port.
+ * @param spec the listener specification
+ * @return the listener descriptor, -1 on failure
+ */
+static int open_bind(const char *spec)
+{
+	char *host, *service;
+	int fd;
+
+	if(*spec == '\0')
+		return open_net_listener(NULL, NULL);
+
+	host = strdup(spec);
+	if(!host)
+		return -1;
+	/* attempt to split our bind address into host:port */
+	service = strrchr(host, ':');
+	if(service) {
+		*service = '\0';
+		service++;
+	}
+	fd = open_net_listener(host, service);
+	free(host);
+	return fd;
+}
+
+/**
+ * Note a listener as opened from the config file.
+ * @param spec the listener specification as given in the config file
+ * @param is_socket whether the listener is a UNIX socket
+ * @param fd the listener descriptor
+ * @return 0 on success, -1 on allocation failure
+ */
+static int add_config_listener(const char *spec, int is_socket, int fd)
+{
+	struct config_listener *new_listeners;
+
+	new_listeners = realloc(config_listeners,
+			(config_listener_count + 1) * sizeof(struct config_listener));
+	if(!new_listeners)
+		return -1;
+	config_listeners = new_listeners;
+	config_listeners[config_listener_count].spec = strdup(spec);
+	config_listeners[config_listener_count].is_socket = is_socket;
+	config_listeners[config_listener_count].fd = fd;
+	config_listener_count++;
+	return 0;
+}
+
+/**
+ * Bring the listeners opened from the config file in line with a new
+ * configuration, closing those no longer listed and opening new ones.
+ * Listeners listed in both are left alone, as are their connections.
+ * @param cfg the new configuration
+ */
+static void apply_config_listeners(struct config *cfg)
+{
+	size_t i = 0, j;
+
+	while(i < config_listener_count) {
+		struct config_listener *l = &config_listeners[i];
+		int keep = l->is_socket ?
+			config_has(cfg->sockets, cfg->socket_count, l->spec) :
+			config_has(cfg->binds, cfg->bind_count, l->spec);
+		if(keep) {
+			i++;
+			continue;
+		}
+		printf("closing listener %s\n", l->spec);
+		close_listener(l->fd);
+		free(l->spec);
+		config_listeners[i] = config_listeners[--config_listener_count];
+	}
+
+	for(j = 0; j < cfg->bind_count + cfg->socket_count; j++) {
+		int is_socket = j >= cfg->bind_count;
+		const char *spec = is_socket ?
+			cfg->sockets[j - cfg->bind_count] : cfg->binds[j];
+		int fd;
+
+		for(i = 0; i < config_listener_count; i++) {
+			if(config_listeners[i].is_socket == is_socket &&
+					strcmp(config_listeners[i].spec, spec) == 0)
+				break;
+		}
+		if(i < config_listener_count)
+			continue;
+
+		fd = is_socket ? open_socket_listener(spec) : open_bind(spec);
+		if(fd == -1) {
+			fprintf(stderr, "could not open listener %s\n", spec);
+			continue;
+		}
+		if(add_config_listener(spec, is_socket, fd) == -1)
+			close_listener(fd);
+	}
+}
+
+/**
+ * Free a rule and the commands it would queue.
+ * @param rule the rule
+ */
+static void rule_free(struct rule *rule)
+{
+	predicate_free(rule->pred);
+	while(rule->cmds) {
+		struct cmdqueue *q = rule->cmds;
+		rule->cmds = q->next;
+		cmdqueue_free(q);
+	}
+	free(rule);
+}
+
+static void rules_free(void)
+{
+	while(rules) {
+		struct rule *rule = rules;
+		rules = rule->next;
+		rule_free(rule);
+	}
+}
+
+/**
+ * Compile the rules of a configuration, replacing the current ones. Each
+ * starts out with its predicate evaluated against the current state, so a
+ * rule whose condition already holds does not fire until it becomes true
+ * again. Rules for receivers we don't have are skipped.
+ * @param cfg the configuration
+ */
+static void rules_load(struct config *cfg)
+{
+	struct rule **tail = &rules;
+	size_t i;
+
+	rules_free();
+	for(i = 0; i < cfg->rule_count; i++) {
+		char *spec = strdup(cfg->rules[i]), *name, *pred, *action;
+		struct receiver *r = NULL;
+		struct rule *rule = NULL;
+
+		if(spec && config_split_rule(spec, &name, &pred, &action) == 0)
+			r = name ? find_receiver(name) : default_rcvr;
+		if(r)
+			rule = calloc(1, sizeof(struct rule));
+		if(rule) {
+			rule->rcvr = r;
+			rule->pred = predicate_compile(pred);
+			rule->cmds = parse_command(action);
+			if(rule->pred && rule->cmds) {
+				rule->state = predicate_eval(rule->pred, r->name);
+				*tail = rule;
+				tail = &rule->next;
+			} else {
+				rule_free(rule);
+				rule = NULL;
+			}
+		}
+		if(!rule)
+			fprintf(stderr, "skipping rule: %s\n", cfg->rules[i]);
+		free(spec);
+	}
+}
+
+/**
+ * Queue the action of a rule that just became true. This takes the receiver
+ * lock, so it must not be called with any receiver lock held.
+ * @param rule the rule
+ */
+static void rule_fire(struct rule *rule)
+{
+	struct cmdqueue *cmds = NULL, **tail = &cmds, *q;
+	struct receiver *r = rule->rcvr;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	rcvr_lock(r);
+	for(q = rule->cmds; q; q = q->next) {
+		struct cmdqueue *copy = cmdqueue_alloc();
+		if(!copy)
+			break;
+		memcpy(copy, q, sizeof(struct cmdqueue));
+		copy->queued = now;
+		copy->next = NULL;
+		*tail = copy;
+		tail = &copy->next;
+	}
+	cmdqueue_supersede(r, cmds);
+	if(r->flooding)
+		flood_hold(r);
+	rcvr_unlock(r);
+	rcvr_changed(r);
+	rules_fired++;
+}
+
+/**
+ * Evaluate again the rules looking at a receiver field that just changed,
+ * marking those that became true to fire. We are called from write_status(),
+ * which may run with a receiver lock held, e.g. for the sleep status a
+ * command writes; the actions are queued later by rules_run().
+ * @param rcvr the receiver
+ * @param field the field that changed
+ */
+static void rules_changed(struct receiver *rcvr, const char *field)
+{
+	struct rule *rule;
+
+	for(rule = rules; rule; rule = rule->next) {
+		int state;
+		if(rule->rcvr != rcvr || !predicate_uses(rule->pred, field))
+			continue;
+		state = predicate_eval(rule->pred, rcvr->name);
+		if(state && !rule->state) {
+			printf("rule fired on %s\n", rcvr->name);
+			rule->due = 1;
+			rules_due = 1;
+		}
+		rule->state = state;
+	}
+}
+
+/**
+ * Queue the actions of the rules that fired since we last looked. This is
+ * called from the main loop, where no receiver lock is held.
+ */
+static void rules_run(void)
+{
+	struct rule *rule;
+
+	if(!rules_due)
+		return;
+	rules_due = 0;
+	for(rule = rules; rule; rule = rule->next) {
+		if(rule->due) {
+			rule->due = 0;
+			rule_fire(rule);
+		}
+	}
+}
+
+/**
+ * Apply a configuration, changing only what differs from the configuration
+ * currently applied. Connections, receiver queues, and cached state are
+ * left alone.
+ * @param cfg the new configuration
+ */
+static void apply_config(struct config *cfg)
+{
+	struct group *g, *next;
+	size_t i;
+	int pacing, slack;
+
+	apply_config_listeners(cfg);
+
+	/* reopen the log even if unchanged so it can be rotated */
+	if(cfg->log_path)
+		reopen_raw_log(cfg->log_path);
+	else if(config && config->log_path)
+		reopen_raw_log(NULL);
+	else if(raw_log_path)
+		reopen_raw_log(raw_log_path);
+
+	/* rebuild the alias lookups; a broken file leaves the old ones */
+	if(load_aliases(cfg->aliases_path) == -1)
+		fprintf(stderr, "keeping the current aliases\n");
+
+	/* swap in the new group definitions */
+	for(g = groups; g; g = next) {
+		next = g->next;
+		if(g->configured)
+			remove_group(g);
+	}
+	for(i = 0; i < cfg->group_count; i++) {
+		if(open_group(cfg->groups[i]) == 0)
+			groups->configured = 1;
+	}
+
+	rules_load(cfg);
+
+	/* set the pipeline depth of every receiver, 1 unless configured */
+	for(i = 0; i < receiver_count; i++) {
+		struct receiver *r = receivers[i];
+		size_t len = strlen(r->name);
+		int depth = 1;
+		size_t j;
+
+		for(j = 0; j < cfg->pipeline_count; j++) {
+			const char *p = cfg->pipelines[j];
+			if(strncmp(p, r->name, len) == 0 && p[len] == '=')
+				depth = atoi(p + len + 1);
+		}
+		rcvr_lock(r);
+		r->depth = depth;
+		rcvr_unlock(r);
+	}
+
+	/* a kernel timer slack no longer configured goes back to the default */
+	if(cfg->timerslack >= 0)
+		shard_set_timerslack(cfg->timerslack);
+	else if(config && config->timerslack >= 0)
+		shard_set_timerslack(0);
+
+	/* retune the scheduler; receivers pick up the change when rescheduled */
+	shard_set_expire(cfg->expire >= 0 ? cfg->expire : QUEUE_EXPIRE);
+	pacing = cfg->pacing >= 0 ? cfg->pacing : COMMAND_WAIT;
+	slack = cfg->slack >= 0 ? cfg->slack : TIMER_SLACK;
+	if(pacing != shard_pacing() || slack != shard_slack()) {
+		shard_set_pacing(pacing);
+		shard_set_slack(slack);
+		for(i = 0; i < receiver_count; i++)
+			rcvr_changed(receivers[i]);
+	}
+}
+
+/**
+ * Read the config file again and apply any changes. If the file cannot be
+ * read or has errors, the current configuration is kept.
+ */
+static void reload_config(void)
+{
+	struct config *cfg;
+
+	/* nothing to reload until we have applied the config once */
+	if(!config_path || !config)
+		return;
+
+	printf("reloading configuration from %s\n", config_path);
+	service_notify("RELOADING=1");
+	cfg = config_load(config_path);
+	if(!cfg) {
+		fprintf(stderr, "keeping current configuration\n");
+		service_notify("READY=1");
+		return;
+	}
+	apply_config(cfg);
+	config_free(config);
+	config = cfg;
+	service_notify("READY=1");
+}
+
+#ifndef TINY
+/**
+ * Parse a list of space separated numbers from a handoff record.
+ * @param str the string to parse
+ * @param vals location to store the numbers
+ * @param count the number of numbers to parse
+ * @return a pointer past the numbers and the space following them, NULL if
+ * the string did not start with enough numbers
+ */
+static char *handoff_longs(char *str, long *vals, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++) {
+		char *end;
+		vals[i] = strtol(str, &end, 10);
+		if(end == str || (*end != ' ' && *end != '\0'))
+			return NULL;
+		str = *end ? end + 1 : end;
+	}
+	return str;
+}
+
+/**
+ * Send everything a new instance needs to take over from us in a live
+ * upgrade: listeners, receivers with their queued commands, the unsent rest
+ * of a short write and any partial eISCP packet, connections with
+ * any partial command line, rate limit, compression and watches, the state
+ * cache and journal, and our log files. Each record names its type with its
+ * first character. The receivers must be paused so nothing changes under us.
+ * @param sock the handoff socket
+ * @return 0 on success, -1 on failure
+ */
+static int handoff_state(int sock)
+{
+	struct conn *c;
+	struct watch *w;
+	struct timeval now;
+	size_t i, j;
+	int compressed;
+
+	for(i = 0; i < listener_count; i++) {
+		int ret;
+		if(listeners[i] < 0)
+			continue;
+		for(j = 0; j < config_listener_count; j++) {
+			if(config_listeners[j].fd == listeners[i])
+				break;
+		}
+		if(j < config_listener_count)
+			ret = upgrade_send(sock, listeners[i], "L %d %s",
+					config_listeners[j].is_socket, config_listeners[j].spec);
+		else if(is_activated(listeners[i]))
+			ret = upgrade_send(sock, listeners[i], "L !");
+		else
+			ret = upgrade_send(sock, listeners[i], "L");
+		if(ret == -1)
+			return -1;
+	}
+	for(i = 0; i < receiver_count; i++) {
+		struct receiver *r = receivers[i];
+		struct cmdqueue *q;
+		char zones[ZONE_COUNT * 48];
+		size_t len = 0;
+		int zone;
+
+		for(zone = 1; zone <= ZONE_COUNT; zone++) {
+			len += (size_t)snprintf(zones + len, sizeof(zones) - len,
+					"%ld %ld ", (long)r->zones[zone - 1].sleep.tv_sec,
+					(long)r->zones[zone - 1].sleep.tv_usec);
+		}
+		if(upgrade_send(sock, r->fd, "R %d %lu %lu %ld %ld %ld %ld %s%s=%s",
+					(int)r->power, r->cmds_sent, r->msgs_received,
+					(long)r->last_cmd.tv_sec, (long)r->last_cmd.tv_usec,
+					(long)r->next_sleep_update.tv_sec,
+					(long)r->next_sleep_update.tv_usec, zones, r->name,
+					r->path) == -1)
+			return -1;
+		/* group commands are sent on as plain commands */
+		for(q = r->queue; q; q = q->next) {
+			if(upgrade_send(sock, -1, "Q %ld %ld %s",
+						(long)q->not_before.tv_sec,
+						(long)q->not_before.tv_usec, q->cmd) == -1)
+				return -1;
+		}
+		/* the rest of a short write must go out before anything else, and
+		 * half of an eISCP packet must be finished by the next read */
+		if(r->out_len && upgrade_send_bytes(sock, "O",
+					r->out_buf, r->out_len) == -1)
+			return -1;
+		if(r->net_len || r->net_skip) {
+			char prefix[32];
+			snprintf(prefix, sizeof(prefix), "I %zu", r->net_skip);
+			if(upgrade_send_bytes(sock, prefix, r->net_buf, r->net_len) == -1)
+				return -1;
+		}
+	}
+	gettimeofday(&now, NULL);
+	for(c = connections; c; c = c->next) {
+		/* held back messages are written now rather than carried over */
+		if(c->fd > -1 && c->rate > 0)
+			conn_flush(c, &now, 1);
+		/* a deflate stream can't be carried over; it is finished here and
+		 * the new instance starts a fresh one */
+		compressed = c->zs != NULL;
+		if(c->fd > -1 && conn_compress_end(c) == -1)
+			end_connection(c, 0);
+		if(c->fd < 0)
+			continue;
+		if(upgrade_send(sock, c->fd, "C %u %.*s", c->id,
+					(int)(c->recv_buf_pos - c->recv_buf), c->recv_buf) == -1)
+			return -1;
+		if(c->rate > 0 && upgrade_send(sock, -1, "W %ld", c->rate) == -1)
+			return -1;
+		if(compressed && upgrade_send(sock, -1, "Z") == -1)
+			return -1;
+		if(c->quiet && upgrade_send(sock, -1, "M") == -1)
+			return -1;
+		for(w = c->watches; w; w = w->next) {
+			if(upgrade_send(sock, -1, "X %u %d %s %s", w->id, w->state,
+						w->rcvr->name, w->expr) == -1)
+				return -1;
+		}
+	}
+	if(state_handoff(sock) == -1)
+		return -1;
+	if(logfd > -1 && upgrade_send(sock, logfd, "G %s",
+				raw_log_path ? raw_log_path : "") == -1)
+		return -1;
+	if(recordfd > -1 && upgrade_send(sock, recordfd, "P %ld %ld",
+				(long)record_last.tv_sec, (long)record_last.tv_usec) == -1)
+		return -1;
+	if(upgrade_send(sock, -1, "N %u", next_conn_id) == -1)
+		return -1;
+	return upgrade_send(sock, -1, "E");
+}
+
+/**
+ * Take over from the instance that started us for a live upgrade, reading
+ * the records written by handoff_state() until the end record, which we
+ * acknowledge. Receivers are added to our shards just as they were, without
+ * the initial power query a newly opened receiver gets.
+ * @param sock the handoff socket
+ * @return 0 on success, -1 on failure
+ */
+static int adopt_state(int sock)
+{
+	char buf[UPGRADE_RECORD_SIZE];
+	struct receiver *rcvr = NULL;
+	struct conn *conn = NULL;
+
+	for(;;) {
+		long vals[7 + 2 * ZONE_COUNT];
+		char *rest, *path;
+		ssize_t size;
+		int fd, zone;
+
+		if(upgrade_recv(sock, buf, sizeof(buf), &fd) <= 0)
+			return -1;
+
+		switch(buf[0]) {
+			case 'L':
+				if(fd > -1 && buf[1] == ' ' && buf[2] == '!') {
+					if(add_activated(fd) == -1)
+						return -1;
+					break;
+				}
+				if(fd < 0 || listen_and_add(fd) == -1)
+					return -1;
+				if(buf[1] == ' ' && buf[2] && buf[3] == ' ' &&
+						add_config_listener(buf + 4, buf[2] == '1', fd) == -1)
+					return -1;
+				break;
+			case 'R':
+				rest = handoff_longs(buf + 2, vals, 7 + 2 * ZONE_COUNT);
+				if(!rest || !(path = strchr(rest, '=')))
+					return -1;
+				*path++ = '\0';
+				if(!(rcvr = new_receiver(rest, path)))
+					return -1;
+				/* a receiver whose link was down is reopened right away */
+				rcvr->fd = fd;
+				if(fd < 0)
+					gettimeofday(&rcvr->reopen_at, NULL);
+				rcvr->power = (enum power)vals[0];
+				rcvr->cmds_sent = (unsigned long)vals[1];
+				rcvr->msgs_received = (unsigned long)vals[2];
+				rcvr->last_cmd.tv_sec = vals[3];
+				rcvr->last_cmd.tv_usec = vals[4];
+				rcvr->next_sleep_update.tv_sec = vals[5];
+				rcvr->next_sleep_update.tv_usec = vals[6];
+				for(zone = 1; zone <= ZONE_COUNT; zone++) {
+					rcvr->zones[zone - 1].sleep.tv_sec = vals[5 + 2 * zone];
+					rcvr->zones[zone - 1].sleep.tv_usec = vals[6 + 2 * zone];
+				}
+				if(add_receiver(rcvr) == -1)
+					return -1;
+				rcvr_changed(rcvr);
+				break;
+			case 'Q':
+				rest = handoff_longs(buf + 2, vals, 2);
+				if(!rcvr || !rest || strlen(rest) >= BUF_SIZE)
+					return -1;
+				{
+					struct cmdqueue *q = cmdqueue_alloc(), **tail;
+					if(!q)
+						return -1;
+					memset(q, 0, sizeof(struct cmdqueue));
+					strcpy(q->cmd, rest);
+					q->hash = hash_sdbm(q->cmd);
+					q->not_before.tv_sec = vals[0];
+					q->not_before.tv_usec = vals[1];
+					gettimeofday(&q->queued, NULL);
+					for(tail = &rcvr->queue; *tail; tail = &(*tail)->next)
+						;
+					*tail = q;
+				}
+				rcvr_changed(rcvr);
+				break;
+			case 'O':
+				/* the unsent rest of a command, more of it each record */
+				if(!rcvr || buf[1] != ' ' || (size = upgrade_recv_bytes(buf + 2,
+								rcvr->out_buf + rcvr->out_len,
+								sizeof(rcvr->out_buf) - rcvr->out_len)) < 0)
+					return -1;
+				rcvr->out_len += (size_t)size;
+				rcvr_changed(rcvr);
+				break;
+			case 'I':
+				/* part of an eISCP packet already read from the receiver */
+				rest = handoff_longs(buf + 2, vals, 1);
+				if(!rcvr || !rest || (size = upgrade_recv_bytes(rest,
+								rcvr->net_buf + rcvr->net_len,
+								sizeof(rcvr->net_buf) - rcvr->net_len)) < 0)
+					return -1;
+				rcvr->net_skip = (size_t)vals[0];
+				rcvr->net_len += (size_t)size;
+				break;
+			case 'C':
+				rest = handoff_longs(buf + 2, vals, 1);
+				if(fd < 0 || !rest)
+					return -1;
+				{
+					struct conn *c = add_connection(fd);
+					size_t len = strlen(rest);
+					conn = c;
+					if(!c)
+						break;
+					c->id = (unsigned int)vals[0];
+					if(len >= BUF_SIZE)
+						len = BUF_SIZE - 1;
+					memcpy(c->recv_buf, rest, len);
+					c->recv_buf_pos = c->recv_buf + len;
+				}
+				break;
+			case 'W':
+				/* the rate limit of the connection just adopted */
+				if(!handoff_longs(buf + 2, vals, 1))
+					return -1;
+				if(conn)
+					conn->rate = vals[0];
+				break;
+			case 'Z':
+				/* the connection just adopted had compression on */
+				if(conn && conn_compress_start(conn) == -1)
+					end_connection(conn, 0);
+				break;
+			case 'M':
+				/* the connection just adopted turned broadcasts off */
+				if(conn)
+					conn->quiet = 1;
+				break;
+			case 'X':
+				/* a watch of the connection just adopted */
+				rest = handoff_longs(buf + 2, vals, 2);
+				if(!rest || !(path = strchr(rest, ' ')))
+					return -1;
+				*path++ = '\0';
+				if(conn && conn->fd > -1) {
+					struct receiver *r = find_receiver(rest);
+					struct watch *w = r ? watch_add(conn, r,
+							(unsigned int)vals[0], path) : NULL;
+					if(w)
+						w->state = (int)vals[1];
+				}
+				break;
+			case 'G':
+				logfd = fd;
+				if(buf[1] == ' ' && buf[2])
+					raw_log_path = strdup(buf + 2);
+				break;
+			case 'P':
+				if(fd < 0 || !handoff_longs(buf + 2, vals, 2))
+					return -1;
+				recordfd = fd;
+				record_last.tv_sec = vals[0];
+				record_last.tv_usec = vals[1];
+				break;
+			case 'N':
+				if(!handoff_longs(buf + 2, vals, 1))
+					return -1;
+				next_conn_id = (unsigned int)vals[0];
+				break;
+			case 'E':
+				return upgrade_send(sock, -1, "OK");
+			default:
+				if(state_adopt(buf, fd) == -1)
+					return -1;
+		}
+	}
+}
+
+/**
+ * Replace ourselves with a new instance of our binary without dropping any
+ * connections or receiver messages. The new instance is started with our
+ * original arguments, and everything we have open is handed to it. Once it
+ * confirms it has taken over, we exit without closing or unlinking
+ * anything. If anything goes wrong, we carry on as before.
+ */
+static void upgrade(void)
+{
+	char buf[UPGRADE_RECORD_SIZE];
+	struct pollfd pfd;
+	size_t i;
+	int sock, fd = -1;
+
+	if(!exe_path || !saved_argv) {
+		fprintf(stderr, "cannot upgrade: binary path unknown\n");
+		return;
+	}
+	printf("upgrading to %s\n", exe_path);
+	sock = upgrade_spawn(exe_path, saved_argv);
+	if(sock == -1)
+		return;
+
+	/* nothing may be read from the receivers once their state is sent */
+	shard_pause(workers, worker_count);
+	/* a flood in progress, perhaps started by what the pause delivered,
+	 * goes out now and its held queries are released */
+	for(i = 0; i < receiver_count; i++)
+		flood_end(receivers[i]);
+	/* rules that fired meanwhile get their actions queued to hand over */
+	rules_run();
+	if(handoff_state(sock) == 0) {
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, UPGRADE_WAIT) == 1 &&
+				upgrade_recv(sock, buf, sizeof(buf), &fd) > 0 &&
+				strcmp(buf, "OK") == 0) {
+			printf("new instance took over, exiting\n");
+			fflush(NULL);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	if(fd > -1)
+		xclose(fd);
+	/* closing the socket tells the new instance to give up */
+	xclose(sock);
+	shard_resume(workers, worker_count);
+	fprintf(stderr, "upgrade failed, carrying on\n");
+}
+#endif
+
+/**
+ * Route a client command line to the receiver it is addressed to. Lines
+ * starting with "@name " go to the receiver or group with that name; all
+ * other lines go to the default receiver.
+ * @param line the full command line, e.g. "@den volume 30"
+ * @return the process_command() result, -1 if the addressed receiver is
+ * not known
+ */
+static int dispatch_command(char *line)
+{
+	struct receiver *r = default_rcvr;
+
+	if(*line == '@') {
+		struct group *g = NULL;
+		char *cmd = strchr(line, ' ');
+		if(!cmd)
+			return -1;
+		*cmd = '\0';
+		r = find_receiver(line + 1);
+		if(!r)
+			g = find_group(line + 1);
+		*cmd = ' ';
+		if(g)
+			return group_dispatch(g, cmd + 1);
+		if(!r)
+			return -1;
+		line = cmd + 1;
+	}
+	/* with no receivers at all, silently accept commands like we always have */
+	if(!r)
+		return 0;
+	return queue_command(r, line);
+}
+
+/**
+ * Write the cached state of every receiver to a connection, in the same form
+ * the status messages were originally sent in, followed by a count of the
+ * messages written.
+ * @param c the connection to write to
+ * @return 0 on success, -2 if the connection should be closed
+ */
+static int write_snapshot(struct conn *c)
+{
+	struct state_entry *e;
+	char buf[BUF_SIZE * 2];
+	unsigned int count = 0;
+
+	for(e = state_entries(); e; e = e->next) {
+		if(default_rcvr && strcmp(e->rcvr, default_rcvr->name) == 0)
+			snprintf(buf, sizeof(buf), "%s", e->msg);
+		else
+			snprintf(buf, sizeof(buf), "@%s %s", e->rcvr, e->msg);
+		if(conn_write(c, buf, strlen(buf), 1) == -1)
+			return -2;
+		count++;
+	}
+	snprintf(buf, sizeof(buf), "OK:snapshot:%u\n", count);
+	if(conn_write(c, buf, strlen(buf), 0) == -1)
+		return -2;
+	return 0;
+}
+
+/**
+ * Find the command in a client command line, skipping any "@name " address.
+ * @param line the full command line, e.g. "@den get volume"
+ * @return the command, e.g. "get volume"
+ */
+static const char *line_command(const char *line)
+{
+	const char *cmd;
+
+	if(*line != '@')
+		return line;
+	cmd = strchr(line, ' ');
+	return cmd ? cmd + 1 : line;
+}
+
+/**
+ * Answer a "get <field>[,<field>...]" command from the state cache, writing
+ * only to the client that asked. Each field gets a line of the form
+ * "OK:get:<field>:<updated>:<changed>:<value>", where updated and changed
+ * are how many milliseconds ago the receiver last reported the field and
+ * last changed its value; fields we know nothing about get
+ * "ERROR:get:<field>:N/A". The receiver is never asked.
+ * @param c the connection to write to
+ * @param line the full command line, e.g. "@den get volume,mute"
+ * @return 0 on success, -1 on an invalid command, -2 if the connection
+ * should be closed
+ */
+static int write_fields(struct conn *c, char *line)
+{
+	struct receiver *r = default_rcvr;
+	char prefix[BUF_SIZE + 2] = "";
+	char *field = line + 4;
+	struct timeval now;
+
+	if(*line == '@') {
+		char *cmd = strchr(line, ' ');
+		*cmd = '\0';
+		r = find_receiver(line + 1);
+		*cmd = ' ';
+		if(!r)
+			return -1;
+		field = cmd + 5;
+	}
+	if(*field == '\0')
+		return -1;
+	if(r && r != default_rcvr)
+		snprintf(prefix, sizeof(prefix), "@%s ", r->name);
+
+	gettimeofday(&now, NULL);
+	while(*field) {
+		char buf[BUF_SIZE * 4];
+		char *next = strchr(field, ',');
+		struct state_entry *e;
+
+		if(next)
+			*next++ = '\0';
+		else
+			next = field + strlen(field);
+		if(*field == '\0')
+			return -1;
+		e = r ? state_lookup(r->name, field) : NULL;
+		if(e) {
+			struct timeval updated, changed;
+			timeval_diff(&now, &e->updated, &updated);
+			timeval_diff(&now, &e->changed, &changed);
+			snprintf(buf, sizeof(buf), "%sOK:get:%s:%ld:%ld:%s", prefix, field,
+					(long)updated.tv_sec * 1000 + updated.tv_usec / 1000,
+					(long)changed.tv_sec * 1000 + changed.tv_usec / 1000,
+					e->msg + strlen(e->field) + 4);
+		} else {
+			snprintf(buf, sizeof(buf), "%sERROR:get:%s:N/A\n",
+					prefix, field);
+		}
+		if(conn_write(c, buf, strlen(buf), *next != '\0') == -1)
+			return -2;
+		field = next;
+	}
+	return 0;
+}
+
+#ifndef TINY
+/** Where history_write() sends the changes of a history query */
+struct history_out {
+	struct conn *c;
+	/** the start of each line, e.g. "@den OK:history:" */
+	const char *prefix;
+};
+
+static int history_write(void *data, const char *field, struct timeval *when,
+		const char *value)
+{
+	struct history_out *out = data;
+	char buf[BUF_SIZE * 4];
 
-	return listen_and_add(fd);
+	snprintf(buf, sizeof(buf), "%s%s:%lld:%s\n", out->prefix, field,
+			(long long)when->tv_sec * 1000 + when->tv_usec / 1000, value);
+	return conn_write(out->c, buf, strlen(buf), 1);
 }
 
 /**
- * Open a local socket at the given path.
- * Also add it to our global list of listeners.
- * @param path the path to the unix socket to create
- * @return the new socket fd
+ * Parse the time a history query starts from.
+ * @param arg a Unix time in seconds, or a negative number of seconds ago
+ * @param since location to store the time
+ * @return 0 on success, -1 on an invalid time
  */
-static int open_socket_listener(const char *path)
+static int history_since(const char *arg, struct timeval *since)
 {
-	int fd = -1;
-	struct sockaddr_un addr;
+	char *test;
+	double secs = strtod(arg, &test);
 
-	if(strlen(path) > sizeof(addr.sun_path) - 1) {
-		fprintf(stderr, "socket path too long\n");
+	if(*arg == '\0' || *test != '\0')
 		return -1;
+	if(secs < 0) {
+		gettimeofday(since, NULL);
+		secs += (double)since->tv_sec + since->tv_usec / 1e6;
+		if(secs < 0)
+			secs = 0;
 	}
+	since->tv_sec = (time_t)secs;
+	since->tv_usec = (suseconds_t)((secs - (double)since->tv_sec) * 1e6);
+	return 0;
+}
 
-	/* attempt to open the socket */
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if(fd == -1) {
-		perror("socket()");
-		return -1;
+/**
+ * Answer a "history <field> <since>" command from the state change history,
+ * writing only to the client that asked. Each change since the given time
+ * gets a line "OK:history:<field>:<time>:<value>", the time in milliseconds
+ * since the epoch, oldest first, followed by "OK:history:<count>". A field
+ * of "*" gets the changes of every field. The receiver is never asked.
+ * @param c the connection to write to
+ * @param line the full command line, e.g. "@den history volume -3600"
+ * @return 0 on success, -1 on an invalid command, -2 if the connection
+ * should be closed
+ */
+static int write_history(struct conn *c, const char *line)
+{
+	struct receiver *r = default_rcvr;
+	const char *field = line_command(line) + 8;
+	char name[BUF_SIZE], prefix[BUF_SIZE * 2], buf[BUF_SIZE * 2];
+	const char *arg = strchr(field, ' ');
+	struct history_out out;
+	struct timeval since;
+	long count;
+
+	if(*line == '@') {
+		size_t len = strcspn(line + 1, " ");
+		if(len >= sizeof(name))
+			return -1;
+		memcpy(name, line + 1, len);
+		name[len] = '\0';
+		r = find_receiver(name);
 	}
+	if(!r || !arg || arg == field || (size_t)(arg - field) >= sizeof(name)
+			|| history_since(arg + 1, &since) == -1)
+		return -1;
+	memcpy(name, field, (size_t)(arg - field));
+	name[arg - field] = '\0';
+
+	if(r != default_rcvr)
+		snprintf(prefix, sizeof(prefix), "@%s OK:history:", r->name);
+	else
+		strcpy(prefix, "OK:history:");
+	out.c = c;
+	out.prefix = prefix;
+	count = history_query(r->name, strcmp(name, "*") ? name : NULL, &since,
+			history_write, &out);
+	if(count == -1)
+		return -2;
+	snprintf(buf, sizeof(buf), "%s%ld\n", prefix, count);
+	return conn_write(c, buf, strlen(buf), 0) == -1 ? -2 : 0;
+}
 
-	/* attempt to bind to the socket */
-	memset(&addr, 0, sizeof(struct sockaddr_un));
-	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
-	if(bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) != 0) {
-		perror("bind()");
+/**
+ * Answer an "export <since>" command with the changes of every field of
+ * every receiver since the given time, for feeding a time series database.
+ * Each change gets a line "OK:export:<receiver>:<field>:<time>:<value>",
+ * followed by "OK:export:<count>".
+ * @param c the connection to write to
+ * @param arg the command argument, as for write_history()
+ * @return 0 on success, -1 on an invalid command, -2 if the connection
+ * should be closed
+ */
+static int write_export(struct conn *c, const char *arg)
+{
+	struct timeval since;
+	struct history_out out;
+	char prefix[BUF_SIZE * 2];
+	long total = 0;
+	size_t i;
+
+	if(history_since(arg, &since) == -1)
 		return -1;
+	out.c = c;
+	out.prefix = prefix;
+	for(i = 0; i < receiver_count; i++) {
+		long count;
+		snprintf(prefix, sizeof(prefix), "OK:export:%s:", receivers[i]->name);
+		count = history_query(receivers[i]->name, NULL, &since,
+				history_write, &out);
+		if(count == -1)
+			return -2;
+		total += count;
 	}
-
-	return listen_and_add(fd);
+	snprintf(prefix, sizeof(prefix), "OK:export:%ld\n", total);
+	return conn_write(c, prefix, strlen(prefix), 0) == -1 ? -2 : 0;
 }
+#endif
 
 /**
- * Determine if we can send a command to the receiver by ensuring it has been
- * a certain time since the previous sent command. If we can send a command,
- * 1 is returned and timeoutval is left undefined. If we cannot send, then 0
- * is returned and the timeoutval is set accordingly.
- * @param receiver the receiver to check for last time sent
- * @param now time value to use as 'now'
- * @param timeoutval location to store timeout before next permitted send
- * @return 1 if we can send a command, 0 if we cannot (and timeoutval is set)
+ * Add a watch to a connection.
+ * @param c the connection
+ * @param rcvr the receiver whose state is watched
+ * @param id the watch id
+ * @param expr the predicate expression
+ * @return the new watch, NULL if the expression is invalid or the
+ * connection has too many watches
  */
-static int can_send_command(struct receiver *receiver,
-		struct timeval * restrict now,
-		struct timeval * restrict timeoutval)
+static struct watch *watch_add(struct conn *c, struct receiver *rcvr,
+		unsigned int id, const char *expr)
 {
-	struct timeval diff, wait;
+	struct watch *w, **tail;
+
+	if(c->watch_count >= MAX_WATCHES)
+		return NULL;
+	w = calloc(1, sizeof(struct watch));
+	if(!w)
+		return NULL;
+	w->pred = predicate_compile(expr);
+	w->expr = strdup(expr);
+	if(!w->pred || !w->expr) {
+		predicate_free(w->pred);
+		free(w->expr);
+		free(w);
+		return NULL;
+	}
+	w->id = id;
+	w->rcvr = rcvr;
+	for(tail = &c->watches; *tail; tail = &(*tail)->next)
+		;
+	*tail = w;
+	c->watch_count++;
+	if(id > c->next_watch)
+		c->next_watch = id;
+	return w;
+}
 
-	/* ensure it has been long enough since the last sent command */
-	timeval_diff(now, &receiver->last_cmd, &diff);
+/**
+ * Start watching a predicate over the state of a receiver from a
+ * "watch <expression>" command, e.g. "@den watch zone2volume > 70". The
+ * connection gets "OK:watch:<id>:<true|false>" right away with the current
+ * result, and again each time the result flips. The predicate is only
+ * evaluated again when a field it looks at changes.
+ * @param c the connection
+ * @param line the full command line
+ * @return 0 on success, -1 on an invalid command, -2 if the connection
+ * should be closed
+ */
+static int conn_watch(struct conn *c, const char *line)
+{
+	struct receiver *r = default_rcvr;
+	const char *expr = line_command(line) + 6;
+	struct watch *w;
+	char buf[32];
+
+	if(*line == '@') {
+		char name[BUF_SIZE];
+		size_t len = strcspn(line + 1, " ");
+		if(len >= sizeof(name))
+			return -1;
+		memcpy(name, line + 1, len);
+		name[len] = '\0';
+		r = find_receiver(name);
+	}
+	if(!r || !(w = watch_add(c, r, c->next_watch + 1, expr)))
+		return -1;
+	w->state = predicate_eval(w->pred, r->name);
+	snprintf(buf, sizeof(buf), "OK:watch:%u:%s\n", w->id,
+			w->state ? "true" : "false");
+	return conn_write(c, buf, strlen(buf), 0) == -1 ? -2 : 0;
+}
 
-	wait.tv_usec = 1000 * COMMAND_WAIT;
-	wait.tv_sec = wait.tv_usec / 1000000;
-	wait.tv_usec -= wait.tv_sec * 1000000;
+/**
+ * Stop watching a predicate from an "unwatch <id>" command.
+ * @param c the connection
+ * @param arg the command argument, the watch id
+ * @return 0 on success, -1 on an unknown watch, -2 on write failure
+ */
+static int conn_unwatch(struct conn *c, const char *arg)
+{
+	struct watch **w;
+	char buf[32];
+	char *test;
+	unsigned long id = strtoul(arg, &test, 10);
 
-	/* first, sanity check that now > last_cmd; if not, we had a clock rollback
-	 * scenario and we should just forget the prior last sent command time */
-	if(diff.tv_sec < 0) {
-		/* clock went backwards; reset the last_cmd time and wait another
-		 * COMMAND_WAIT milliseconds */
-		receiver->last_cmd.tv_sec = now->tv_sec;
-		receiver->last_cmd.tv_usec = now->tv_usec;
-		timeoutval->tv_sec = wait.tv_sec;
-		timeoutval->tv_usec = wait.tv_usec;
-		return 0;
+	if(*arg == '\0' || *test != '\0')
+		return -1;
+	for(w = &c->watches; *w; w = &(*w)->next) {
+		if((*w)->id == id) {
+			struct watch *dead = *w;
+			*w = dead->next;
+			predicate_free(dead->pred);
+			free(dead->expr);
+			free(dead);
+			c->watch_count--;
+			snprintf(buf, sizeof(buf), "OK:unwatch:%lu\n", id);
+			return conn_write(c, buf, strlen(buf), 0) == -1 ? -2 : 0;
+		}
 	}
+	return -1;
+}
 
-	/* check if both of our difference values are > wait values */
-	if(diff.tv_sec > wait.tv_sec ||
-			(diff.tv_sec == wait.tv_sec && diff.tv_usec >= wait.tv_usec)) {
-		/* it has been long enough, note that timeoutval is untouched */
-		return 1;
-	}
+/**
+ * Turn status broadcasts to a connection on or off from a
+ * "broadcast <on|off>" command. A monitor that only cares about its watches
+ * can turn them off.
+ * @param c the connection
+ * @param arg the command argument, "on" or "off"
+ * @return 0 on success, -1 on an invalid argument, -2 on write failure
+ */
+static int conn_set_broadcast(struct conn *c, const char *arg)
+{
+	char buf[32];
 
-	/* it hasn't been long enough, set the timeout as necessary */
-	timeval_diff(&wait, &diff, timeoutval);
-	return 0;
+	if(strcmp(arg, "on") == 0)
+		c->quiet = 0;
+	else if(strcmp(arg, "off") == 0)
+		c->quiet = 1;
+	else
+		return -1;
+	snprintf(buf, sizeof(buf), "OK:broadcast:%s\n", arg);
+	return conn_write(c, buf, strlen(buf), 0) == -1 ? -2 : 0;
+}
+
+/**
+ * Evaluate again the watches looking at a receiver field that just changed,
+ * telling each connection about those whose result flipped.
+ * @param rcvr the receiver
+ * @param field the field that changed
+ */
+static void watches_changed(struct receiver *rcvr, const char *field)
+{
+	struct conn *c;
+
+	for(c = connections; c; c = c->next) {
+		struct watch *w;
+		for(w = c->watches; w && c->fd > -1; w = w->next) {
+			char buf[32];
+			int state;
+			if(w->rcvr != rcvr || !predicate_uses(w->pred, field))
+				continue;
+			state = predicate_eval(w->pred, rcvr->name);
+			if(state == w->state)
+				continue;
+			w->state = state;
+			watch_flips++;
+			snprintf(buf, sizeof(buf), "OK:watch:%u:%s\n", w->id,
+					state ? "true" : "false");
+			conn_send(c, buf, strlen(buf));
+		}
+	}
 }
 
 /**
@@ -688,18 +3041,37 @@ static int process_input(struct conn *c)
 		if(*c->recv_buf_pos == '\n') {
 			int processret = 0;
 			size_t remaining;
-			struct receiver *r;
 			/* We have a newline. This means we should have a full command
 			 * and can attempt to interpret it. */
 			*c->recv_buf_pos = '\0';
-			r = receivers;
-			while(r) {
-				processret = process_command(r, c->recv_buf);
-				r = r->next;
-			}
+			record_event(c, '>', c->recv_buf);
+			if(strcmp(c->recv_buf, "snapshot") == 0)
+				processret = write_snapshot(c);
+			else if(strncmp(line_command(c->recv_buf), "get ", 4) == 0)
+				processret = write_fields(c, c->recv_buf);
+			else if(strncmp(line_command(c->recv_buf), "watch ", 6) == 0)
+				processret = conn_watch(c, c->recv_buf);
+			else if(strncmp(c->recv_buf, "unwatch ", 8) == 0)
+				processret = conn_unwatch(c, c->recv_buf + 8);
+			else if(strncmp(c->recv_buf, "broadcast ", 10) == 0)
+				processret = conn_set_broadcast(c, c->recv_buf + 10);
+#ifndef TINY
+			else if(strncmp(line_command(c->recv_buf), "history ", 8) == 0)
+				processret = write_history(c, c->recv_buf);
+			else if(strncmp(c->recv_buf, "export ", 7) == 0)
+				processret = write_export(c, c->recv_buf + 7);
+#endif
+			else if(strncmp(c->recv_buf, "ratelimit ", 10) == 0)
+				processret = conn_set_rate(c, c->recv_buf + 10);
+#ifndef TINY
+			else if(strncmp(c->recv_buf, "compress ", 9) == 0)
+				processret = conn_set_compress(c, c->recv_buf + 9);
+#endif
+			else
+				processret = dispatch_command(c->recv_buf);
 			if(processret == -1) {
 				/* watch our write for a failure */
-				if(xwrite(c->fd, invalid_cmd, strlen(invalid_cmd)) == -1)
+				if(conn_write(c, invalid_cmd, strlen(invalid_cmd), 0) == -1)
 					ret = -2;
 			} else if(processret == -2) {
 				end_connection(c, 0);
@@ -742,40 +3114,381 @@ static int process_input(struct conn *c)
 int write_to_connections(const char *msg)
 {
 	struct conn *c;
+	struct timeval now = { 0, 0 };
 	size_t len = strlen(msg);
 	/* print to stdout and all current open connections */
 	printf("response: %s", msg);
 	c = connections;
 	while(c) {
-		if(c->fd > -1) {
-			ssize_t ret = xwrite(c->fd, msg, len);
-			if(ret == -1)
-				end_connection(c, 0);
+		if(c->quiet) {
+			/* replies and watch notifications only */
+		} else if(c->fd > -1 && c->rate > 0) {
+			if(now.tv_sec == 0)
+				gettimeofday(&now, NULL);
+			conn_write_limited(c, msg, len, &now);
+		} else if(c->fd > -1) {
+			conn_send(c, msg, len);
 		}
 		c = c->next;
 	}
 	return 0;
 }
 
+/**
+ * Write a batch of messages to the currently connected clients in a single
+ * write per connection. Rate limited connections still get each message
+ * through their limit.
+ * @param batch the messages to write, each including trailing newline
+ */
+static void write_batch(const char *batch)
+{
+	struct conn *c;
+	struct timeval now;
+	size_t len = strlen(batch);
+
+	printf("response: %s", batch);
+	gettimeofday(&now, NULL);
+	for(c = connections; c; c = c->next) {
+		const char *line, *end;
+
+		if(c->fd < 0 || c->quiet)
+			continue;
+		if(c->rate == 0) {
+			conn_send(c, batch, len);
+			continue;
+		}
+		for(line = batch; c->fd > -1 && *line; line = end + 1) {
+			char msg[BUF_SIZE * 2];
+			end = strchr(line, '\n');
+			if(!end || (size_t)(end - line) + 1 >= sizeof(msg))
+				break;
+			memcpy(msg, line, (size_t)(end - line) + 1);
+			msg[end - line + 1] = '\0';
+			conn_write_limited(c, msg, (size_t)(end - line) + 1, &now);
+		}
+	}
+}
+
+/**
+ * Check if a status message is a zone of a receiver powering on, going by
+ * the cached state. A zone we knew nothing about yet is not counted, as we
+ * may just be learning it was already on.
+ * @param rcvr the receiver the message is from
+ * @param msg the status message, e.g. "OK:zone2power:on\n"
+ * @return the cache entry of the power field if the message turns a zone
+ * on, NULL otherwise
+ */
+static struct state_entry *is_power_on(struct receiver *rcvr,
+		const char *msg)
+{
+	char field[16];
+	const char *sep;
+	struct state_entry *e;
+	size_t len;
+
+	if(strncmp(msg, "OK:", 3) != 0 || !(sep = strchr(msg + 3, ':')))
+		return NULL;
+	len = (size_t)(sep - (msg + 3));
+	if(len < 5 || len >= sizeof(field) || strcmp(sep + 1, "on\n") != 0
+			|| strncmp(sep - 5, "power", 5) != 0)
+		return NULL;
+	memcpy(field, msg + 3, len);
+	field[len] = '\0';
+	e = state_lookup(rcvr->name, field);
+	if(e && strcmp(e->msg + (sep + 1 - msg), "off\n") == 0)
+		return e;
+	return NULL;
+}
+
+/**
+ * Arm the flood timer of a receiver for when its flood should go out: once
+ * the receiver has been quiet for a bit, but no later than the longest we
+ * hold a flood back.
+ * @param rcvr the receiver
+ */
+static void flood_arm(struct receiver *rcvr)
+{
+	struct timeval quiet = { 0, FLOOD_QUIET * 1000 };
+	struct timeval most = { FLOOD_MAX / 1000, (FLOOD_MAX % 1000) * 1000 };
+	struct timeval due, last;
+
+	timeval_add(&rcvr->flood_last, &quiet, &due);
+	timeval_add(&rcvr->flood_start, &most, &last);
+	timer_arm(&main_shard.timers, &rcvr->flood_timer,
+			timeval_min(&due, &last));
+}
+
+/**
+ * Start batching the burst of status messages a receiver sends when a zone
+ * powers on. Clients that see the power on tend to ask for the full status,
+ * which the receiver is already sending us; while the flood lasts their
+ * status queries are held, and those it answers are dropped at the end.
+ * @param rcvr the receiver that powered on
+ * @param power the cache entry of the power field that turned on; the
+ * flood starts with it
+ */
+static void flood_begin(struct receiver *rcvr, struct state_entry *power)
+{
+	rcvr->flood_start = power->updated;
+	gettimeofday(&rcvr->flood_last, NULL);
+	rcvr->flood_len = 0;
+	rcvr->flood_count = 0;
+	rcvr->flooding = 1;
+	rcvr->floods++;
+	flood_arm(rcvr);
+	/* queries may have been queued already by a client faster than us */
+	rcvr_lock(rcvr);
+	flood_hold(rcvr);
+	rcvr_unlock(rcvr);
+	rcvr_changed(rcvr);
+}
+
+/**
+ * Write out the messages batched so far from a receiver's flood, ended by
+ * a snapshot line with their count.
+ * @param rcvr the receiver
+ */
+static void flood_write(struct receiver *rcvr)
+{
+	char *end = rcvr->flood_buf + rcvr->flood_len;
+	size_t left = sizeof(rcvr->flood_buf) - rcvr->flood_len;
+
+	if(rcvr->flood_count == 0)
+		return;
+	if(rcvr == default_rcvr)
+		snprintf(end, left, "OK:snapshot:%u\n", rcvr->flood_count);
+	else
+		snprintf(end, left, "@%s OK:snapshot:%u\n",
+				rcvr->name, rcvr->flood_count);
+	write_batch(rcvr->flood_buf);
+	rcvr->flood_len = 0;
+	rcvr->flood_count = 0;
+}
+
+/**
+ * Add a message to a receiver's flood batch.
+ * @param rcvr the receiver
+ * @param msg the message, already prefixed with the receiver name if needed
+ */
+static void flood_add(struct receiver *rcvr, const char *msg)
+{
+	size_t len = strlen(msg);
+	/* leave room for the snapshot line */
+	size_t room = sizeof(rcvr->flood_buf) - BUF_SIZE * 2;
+
+	/* a flood too big for one batch goes out in several */
+	if(rcvr->flood_len + len >= room)
+		flood_write(rcvr);
+	if(len >= room) {
+		write_to_connections(msg);
+		return;
+	}
+	memcpy(rcvr->flood_buf + rcvr->flood_len, msg, len + 1);
+	rcvr->flood_len += len;
+	rcvr->flood_count++;
+	gettimeofday(&rcvr->flood_last, NULL);
+	flood_arm(rcvr);
+}
+
+/**
+ * Hold the status queries in a receiver's queue until its flood ends. They
+ * are moved aside so anything queued behind them goes out as usual. The
+ * receiver must be locked.
+ * @param rcvr the receiver
+ */
+static void flood_hold(struct receiver *rcvr)
+{
+	struct cmdqueue **qp = &rcvr->queue, **tail;
+	size_t len;
+
+	for(tail = &rcvr->held; *tail; tail = &(*tail)->next)
+		;
+	while(*qp) {
+		struct cmdqueue *q = *qp;
+		len = strlen(q->cmd);
+		if(!q->sync && q->not_before.tv_sec == 0 && len > 4
+				&& strcmp(q->cmd + len - 4, "QSTN") == 0) {
+			*qp = q->next;
+			q->next = NULL;
+			*tail = q;
+			tail = &q->next;
+			continue;
+		}
+		qp = &q->next;
+	}
+}
+
+/**
+ * End a receiver's flood: send the batch, then drop the held status queries
+ * the flood answered and queue the rest again.
+ * @param rcvr the receiver
+ */
+static void flood_end(struct receiver *rcvr)
+{
+	struct cmdqueue **tail;
+
+	if(!rcvr->flooding)
+		return;
+	flood_write(rcvr);
+	rcvr->flooding = 0;
+	timer_disarm(&main_shard.timers, &rcvr->flood_timer);
+
+	rcvr_lock(rcvr);
+	for(tail = &rcvr->queue; *tail; tail = &(*tail)->next)
+		;
+	while(rcvr->held) {
+		struct cmdqueue *q = rcvr->held;
+		const char *field = command_field(q->cmd);
+		struct state_entry *e = field ?
+			state_lookup(rcvr->name, field) : NULL;
+		struct timeval age;
+
+		rcvr->held = q->next;
+		q->next = NULL;
+		if(e) {
+			timeval_diff(&e->updated, &rcvr->flood_start, &age);
+			if(age.tv_sec >= 0) {
+				cmdqueue_free(q);
+				rcvr->queries_saved++;
+				continue;
+			}
+		}
+		*tail = q;
+		tail = &q->next;
+	}
+	rcvr_unlock(rcvr);
+	rcvr_changed(rcvr);
+}
+
+static void flood_timer_fired(struct timer *t, UNUSED struct timeval *now)
+{
+	flood_end(t->data);
+}
+
+/**
+ * Write a status message from a receiver to the currently connected clients.
+ * Messages from receivers other than the default are prefixed with the
+ * receiver name, matching the "@name " form used to address commands.
+ * @param rcvr the receiver the message belongs to
+ * @param msg the message to write, including trailing newline
+ * @return 0 on success, -1 on failure
+ */
+int write_status(struct receiver *rcvr, const char *msg)
+{
+	char buf[BUF_SIZE * 2], field[64];
+	struct state_entry *powered_on = NULL;
+
+	/* worker shard threads hand their messages to the main thread */
+	if(shard_offload(rcvr, NULL, 0, msg))
+		return 0;
+	if(rcvr) {
+		powered_on = is_power_on(rcvr, msg);
+		if(state_update(rcvr->name, msg) == 1
+				&& state_field(msg, field, sizeof(field)) == 0) {
+#ifndef TINY
+			struct state_entry *e = state_lookup(rcvr->name, field);
+			char value[BUF_SIZE * 2];
+			snprintf(value, sizeof(value), "%s", msg + strlen(field) + 4);
+			value[strcspn(value, "\n")] = '\0';
+			history_add(rcvr->name, field, value, &e->changed);
+#endif
+			watches_changed(rcvr, field);
+			rules_changed(rcvr, field);
+		}
+	}
+	if(rcvr && rcvr != default_rcvr) {
+		snprintf(buf, sizeof(buf), "@%s %s", rcvr->name, msg);
+		msg = buf;
+	}
+	if(rcvr && rcvr->flooding) {
+		flood_add(rcvr, msg);
+		return 0;
+	}
+	/* the power message itself goes out right away, the flood after it is
+	 * batched */
+	write_to_connections(msg);
+	if(powered_on)
+		flood_begin(rcvr, powered_on);
+	return 0;
+}
+
+/**
+ * Deliver a message handed over by a worker shard. This runs on the main
+ * thread when draining the worker shard rings.
+ * @param rcvr the receiver the message came from
+ * @param g the group confirmed, NULL for a status message
+ * @param latency the group confirmation latency in milliseconds
+ * @param msg the status message
+ */
+void shard_deliver(struct receiver *rcvr, struct group *g, long latency,
+		const char *msg)
+{
+	if(g)
+		group_confirmed(rcvr, g, latency);
+	else
+		write_status(rcvr, msg);
+}
+
 static const struct option opts[] = {
 	{"bind",      optional_argument, 0, 'b'},
+	{"config",    required_argument, 0, 'c'},
+	{"cpu",       required_argument, 0, 'C'},
 	{"daemon",    no_argument,       0, 'd'},
+	{"default",   required_argument, 0, 'D'},
+	{"group",     required_argument, 0, 'g'},
 	{"help",      no_argument,       0, 'h'},
+#ifndef TINY
+	{"journal",   required_argument, 0, 'J'},
+#endif
 	{"log",       required_argument, 0, 'l'},
+	{"realtime",  required_argument, 0, 'R'},
+	{"record",    required_argument, 0, 'r'},
 	{"serial",    required_argument, 0, 's'},
 	{"socket",    required_argument, 0, 'u'},
+#ifndef TINY
+	{"standby",   required_argument, 0, 'S'},
+#endif
+	{"threads",   required_argument, 0, 't'},
+#ifndef TINY
+	{"upgrade-fd", required_argument, 0, 'U'},
+#endif
 	{0,           0,                 0, 0  },
 };
 
+#ifdef TINY
+#define OPTSTRING "b::c:C:dD:g:hl:r:R:s:t:u:"
+#else
+#define OPTSTRING "b::c:C:dD:g:hJ:l:r:R:s:S:t:u:"
+#endif
+
 static void usage(char *argv[])
 {
+#ifdef TINY
+	/* the tiny build leaves the full help out */
+	fputs("Usage: ", stdout);
+	fputs(argv[0], stdout);
+	fputs(" [-b [addr]] [-c file] [-s [name=]dev] [-u file] ...\n", stdout);
+	return;
+#endif
 	printf("Usage: %s [options]\n\n", argv[0]);
 	printf("Daemon to monitor and control an Onkyo A/V receiver. Options are:\n\n");
 	printf("  -b, --bind [addr]      Bind and listen for incoming connections\n");
+	printf("  -c, --config <file>    Read settings from file, again on SIGHUP\n");
+	printf("  -C, --cpu <n>          Pin receiver threads to CPU n\n");
 	printf("  -d, --daemon           Fork and run in background\n");
+	printf("  -D, --default <name>   Receiver for commands without an @name\n");
+	printf("  -g, --group <name>=<receiver>,...\n");
+	printf("                         Define a group of receivers\n");
 	printf("  -h, --help             Show this help\n");
+	printf("  -J, --journal <file>   Serve state journal on UNIX socket\n");
 	printf("  -l, --log <file>       Log raw I/O to specified file\n");
-	printf("  -s, --serial <dev>     Serial device receiver is connected to\n");
+	printf("  -R, --realtime <prio>  Run receiver threads with real-time priority\n");
+	printf("  -r, --record <file>    Record client sessions to specified file\n");
+	printf("  -s, --serial [name=]<dev>\n");
+	printf("                         Serial device receiver is connected to\n");
+	printf("  -S, --standby <file>   Stand by for the primary serving the "
+			"journal <file>\n");
+	printf("  -t, --threads <n>      Run receivers on n worker threads\n");
 	printf("  -u, --socket <file>    Listen for connections on UNIX socket\n");
 	printf("\n");
 	printf("By default, the daemon is dumb- it will not connect to a receiver "
@@ -786,6 +3499,43 @@ static void usage(char *argv[])
 			"\"localhost:8701\", \"1.2.3.4\", and\n\":12300\" are all "
 			"acceptable. The default is to bind to all interfaces and use\n"
 			"port 8701.\n\n");
+	printf("The -s/--serial option may be given multiple times to control several "
+			"receivers.\nCommands prefixed with \"@name \", e.g. \"@den volume 30\", "
+			"go to the named\nreceiver; all others go to the default receiver, "
+			"which is the first one unless\n-D/--default is given. Receivers are "
+			"named after their device unless a\nname is given. A device "
+			"that cannot be opened or goes away, e.g. an unplugged\nUSB "
+			"adapter, is retried with growing delays of up to a minute.\n\n");
+	printf("Network receivers are given as \"eiscp:host[:port]\" in place of "
+			"a device, e.g.\n\"-s den=eiscp:192.168.1.20\"; the port defaults "
+			"to 60128. The pipeline setting\nin the configuration file lets "
+			"them take several commands in one write.\n\n");
+	printf("Groups defined with -g/--group are addressed the same way; a "
+			"command sent to\na group is sent to all members at the same "
+			"time, and the time each member\ntakes to confirm it is "
+			"reported.\n\n");
+	printf("With -t/--threads, receivers are spread over the given number of "
+			"worker\nthreads so a slow receiver never holds up the others or "
+			"the clients. The\ndefault of 0 handles everything in the main "
+			"loop.\n\n");
+	printf("A standby started with -S/--standby and the same options as the "
+			"primary keeps\na copy of the primary state from its -J/--journal "
+			"socket. When the primary\ngoes away, the standby opens the "
+			"receivers and listeners itself; clients can\nsend \"snapshot\" "
+			"to get the last known state right away.\n\n");
+	printf("With -R/--realtime, memory is set aside up front and locked, and "
+			"the threads\nrunning receivers (the main thread without "
+			"-t/--threads) are scheduled\nSCHED_FIFO at the given priority. "
+			"How late commands go out compared to\nwhen they were due is "
+			"shown with the status on SIGUSR1.\n\n");
+	printf("When started by a service manager such as systemd, listening "
+			"sockets it passes\nin (LISTEN_FDS) are used along with any "
+			"given here, and it is notified\n(NOTIFY_SOCKET) once the daemon "
+			"is ready.\n\n");
+	printf("On SIGUSR2, the daemon starts its binary again with the same "
+			"options and hands\nover its receivers, listeners, connections, "
+			"and state, then exits. Clients\nstay connected and no receiver "
+			"messages are lost.\n\n");
 
 	printf("Example:\n");
 	printf("  %s -d -b -s /dev/ttyS0\n\n", argv[0]);
@@ -807,15 +3557,38 @@ static void usage(char *argv[])
  */
 int main(int argc, char *argv[])
 {
-	int retval, opt;
+	int retval, opt, upgrade_fd = -1;
 	struct sigaction sa;
 	/* options storage */
 	int daemon = 0, bind_all = 0;
 	char *bind_addr = NULL, *socket_path = NULL;
-	char *log_path = NULL, *serialdev_path = NULL;
+	char *log_path = NULL, *record_path = NULL, *default_name = NULL;
+#ifndef TINY
+	char *journal_path = NULL, *standby_path = NULL;
+#endif
+	char **serial_specs = NULL, **group_specs = NULL;
+	size_t i, serial_count = 0, group_count = 0, threads = 0;
+	int rt_priority = 0, rt_cpu = -1;
+#ifndef TINY
+	char exe[PATH_MAX];
+	ssize_t exe_len;
+#endif
+
+#ifndef TINY
+	/* keep what we need to start ourselves again for a live upgrade;
+	 * option parsing may reorder argv */
+	exe_len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if(exe_len > 0) {
+		exe[exe_len] = '\0';
+		exe_path = strdup(exe);
+	}
+	saved_argv = calloc((size_t)argc + 1, sizeof(char *));
+	if(saved_argv)
+		memcpy(saved_argv, argv, (size_t)argc * sizeof(char *));
+#endif
 
 	/* options parsing */
-	while((opt = getopt_long(argc, argv, "b::dhl:s:u:", opts, NULL))) {
+	while((opt = getopt_long(argc, argv, OPTSTRING, opts, NULL))) {
 		if(opt < 0)
 			break;
 		switch(opt) {
@@ -825,22 +3598,76 @@ int main(int argc, char *argv[])
 				else
 					bind_all = 1;
 				break;
+			case 'c':
+				config_path = strdup(optarg);
+				break;
+			case 'C':
+				rt_cpu = atoi(optarg);
+				break;
 			case 'd':
 				daemon = 1;
 				break;
+			case 'D':
+				default_name = strdup(optarg);
+				break;
+			case 'g':
+				{
+					char **new_specs = realloc(group_specs,
+							(group_count + 1) * sizeof(char *));
+					if(!new_specs) {
+						perror("realloc()");
+						cleanup(EXIT_FAILURE);
+					}
+					group_specs = new_specs;
+					group_specs[group_count++] = strdup(optarg);
+				}
+				break;
 			case 'h':
 				usage(argv);
 				cleanup(EXIT_SUCCESS);
 				break;
+#ifndef TINY
+			case 'J':
+				journal_path = strdup(optarg);
+				break;
+#endif
 			case 'l':
 				log_path = strdup(optarg);
 				break;
+			case 'r':
+				record_path = strdup(optarg);
+				break;
+			case 'R':
+				rt_priority = atoi(optarg);
+				break;
 			case 's':
-				serialdev_path = strdup(optarg);
+				{
+					char **new_specs = realloc(serial_specs,
+							(serial_count + 1) * sizeof(char *));
+					if(!new_specs) {
+						perror("realloc()");
+						cleanup(EXIT_FAILURE);
+					}
+					serial_specs = new_specs;
+					serial_specs[serial_count++] = strdup(optarg);
+				}
+				break;
+#ifndef TINY
+			case 'S':
+				standby_path = strdup(optarg);
+				break;
+#endif
+			case 't':
+				threads = (size_t)strtoul(optarg, NULL, 10);
 				break;
 			case 'u':
 				socket_path = strdup(optarg);
 				break;
+#ifndef TINY
+			case 'U':
+				upgrade_fd = atoi(optarg);
+				break;
+#endif
 			case '?':
 				usage(argv);
 				cleanup(EXIT_FAILURE);
@@ -858,19 +3685,115 @@ int main(int argc, char *argv[])
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGPIPE, &sa, NULL);
 	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	/* init our command list and status processing */
+	if(init_commands() == -1 || init_statuses() == -1) {
+		fprintf(stderr, "could not set up command and status lists\n");
+		cleanup(EXIT_FAILURE);
+	}
+
+#ifndef TINY
+	/* wait for the primary to go away before we touch anything it uses */
+	if(standby_path && upgrade_fd == -1) {
+		if(daemon) {
+			daemonize();
+			daemon = 0;
+		}
+		run_standby(standby_path);
+		/* the primary may not have had a chance to remove its socket */
+		if(socket_path)
+			unlink(socket_path);
+	}
+	free(standby_path);
+#endif
+
+	/* the inline shard runs any receivers not on worker threads */
+	if(shard_init_inline(&main_shard) == -1)
+		cleanup(EXIT_FAILURE);
+
+	/* set up worker shards so receivers can be spread over them */
+	if(threads) {
+		workers = calloc(threads, sizeof(struct shard));
+		if(!workers) {
+			perror("calloc()");
+			cleanup(EXIT_FAILURE);
+		}
+		worker_count = threads;
+		if(shard_init(workers, worker_count) == -1)
+			cleanup(EXIT_FAILURE);
+	}
+
+	/* open the serial connections to the receivers */
+	retval = 0;
+	for(i = 0; i < serial_count; i++) {
+		if(retval != -1 && upgrade_fd == -1)
+			retval = open_receiver(serial_specs[i]);
+		free(serial_specs[i]);
+	}
+	free(serial_specs);
+	if(retval == -1)
+		cleanup(EXIT_FAILURE);
+
+#ifndef TINY
+	/* or take them and everything else over from the instance we replace */
+	if(upgrade_fd > -1) {
+		if(adopt_state(upgrade_fd) == -1) {
+			/* the old instance carries on; leave its sockets alone */
+			fprintf(stderr, "could not take over from old instance\n");
+			_exit(EXIT_FAILURE);
+		}
+		xclose(upgrade_fd);
+		printf("took over from old instance\n");
+		/* everything these name was handed to us already open */
+		bind_all = 0;
+		free(bind_addr);
+		free(socket_path);
+		free(journal_path);
+		free(log_path);
+		free(record_path);
+		bind_addr = socket_path = journal_path = log_path = record_path = NULL;
+		daemon = 0;
+	}
+#endif
+	default_rcvr = receiver_count ? receivers[0] : NULL;
+	if(default_name) {
+		default_rcvr = find_receiver(default_name);
+		if(!default_rcvr) {
+			fprintf(stderr, "unknown default receiver: %s\n", default_name);
+			free(default_name);
+			cleanup(EXIT_FAILURE);
+		}
+		free(default_name);
+	}
+	/* set up receiver groups now that we know our receivers */
+	retval = 0;
+	for(i = 0; i < group_count; i++) {
+		if(retval != -1)
+			retval = open_group(group_specs[i]);
+		free(group_specs[i]);
+	}
+	free(group_specs);
+	if(retval == -1)
+		cleanup(EXIT_FAILURE);
 
-	/* open the serial connection to the receiver */
-	if(serialdev_path) {
-		retval = open_serial_device(serialdev_path);
-		free(serialdev_path);
+#ifndef TINY
+	/* serve our state journal for any standby */
+	if(journal_path) {
+		retval = journal_listen(journal_path);
+		free(journal_path);
 		if(retval == -1)
 			cleanup(EXIT_FAILURE);
 	}
+#endif
 
-	/* init our command list */
-	init_commands();
-	/* init our status processing */
-	init_statuses();
+	/* take the listeners our service manager opened for us, if any */
+	retval = service_listen_fds();
+	for(i = 0; i < (size_t)retval; i++) {
+		if(add_activated(LISTEN_FDS_START + (int)i) == -1)
+			cleanup(EXIT_FAILURE);
+	}
 
 	/* open our listener connections */
 	if(bind_all) {
@@ -879,13 +3802,7 @@ int main(int argc, char *argv[])
 			cleanup(EXIT_FAILURE);
 	}
 	if(bind_addr) {
-		/* attempt to split our bind address into host:port */
-		char *pos = strrchr(bind_addr, ':');
-		if(pos) {
-			*pos = '\0';
-			pos++;
-		}
-		retval = open_net_listener(bind_addr, pos);
+		retval = open_bind(bind_addr);
 		free(bind_addr);
 		if(retval == -1)
 			cleanup(EXIT_FAILURE);
@@ -903,181 +3820,183 @@ int main(int argc, char *argv[])
 		free(log_path);
 		log_path = NULL;
 	}
+	/* record client sessions if we have a path from options parsing */
+	if(record_path) {
+		record_sessions(record_path);
+		free(record_path);
+		record_path = NULL;
+	}
+
+	/* apply the config file on top of the command line options */
+	if(config_path) {
+		config = config_load(config_path);
+		if(!config)
+			cleanup(EXIT_FAILURE);
+		apply_config(config);
+	}
 
 	/* background if everything was successful */
 	if(daemon) {
 		daemonize();
 	}
 
+	/* set up real-time mode once we are in our final process */
+	if(rt_priority > 0 || rt_cpu >= 0) {
+		if(rt_priority > 0 && lock_memory() == -1)
+			cleanup(EXIT_FAILURE);
+		shard_set_realtime(rt_priority, rt_cpu);
+		/* without worker threads, the main thread runs the receivers */
+		if(!worker_count && shard_apply_realtime() == -1)
+			cleanup(EXIT_FAILURE);
+	}
+
+	/* threads are started last so they survive daemonizing */
+	if(shard_start(workers, worker_count) == -1)
+		cleanup(EXIT_FAILURE);
+
+	/* let our service manager know we are serving; after a live upgrade,
+	 * also that we are the process to watch now */
+	if(upgrade_fd > -1) {
+		char state[64];
+		snprintf(state, sizeof(state), "MAINPID=%ld\nREADY=1", (long)getpid());
+		service_notify(state);
+	} else {
+		service_notify("READY=1");
+	}
+	gettimeofday(&started, NULL);
+
 	/* Terminal settings are all done. Now it is time to watch for input
 	 * on our socket and handle it as necessary. We also handle incoming
 	 * status messages from the receiver.
 	 *
 	 * Attempt to keep the crazyness in order:
-	 * signalpipe, receivers, listeners, connections
+	 * signalpipe, receiver epoll set, worker notify pipe, state journal,
+	 * listeners, connections
+	 *
+	 * Receivers sit in an epoll set and a timer heap that are kept up to
+	 * date as they change state, so each pass only touches receivers that
+	 * have a timer due or a ready descriptor; poll() itself only sees the
+	 * one epoll descriptor, however many receivers there are.
 	 */
 	for(;;) {
-		int maxfd = -1;
-		fd_set readfds, writefds;
-		struct timeval now, timeoutval = { 0, 0 };
-		struct timeval *timeout = NULL;
-
-		size_t i;
-		struct receiver *r;
+		int timeout = -1;
+		size_t nfds;
+		struct timeval now, timeoutval;
+		struct pollfd *pollfds;
 		struct conn *c;
-
-		/* get our file descriptor sets set up */
-		FD_ZERO(&readfds);
-		FD_ZERO(&writefds);
-		/* add our signal pipe file descriptor */
-		FD_SET(signalpipe[READ], &readfds);
-		maxfd = signalpipe[READ] > maxfd ? signalpipe[READ] : maxfd;
+#ifndef TINY
+		size_t journal_slots = 0;
+#endif
 
 		/* used for all timeout, etc. calculations */
 		gettimeofday(&now, NULL);
+		/* do any receiver and group work that is due */
+		timer_run(&main_shard.timers, &now);
+		/* queue the actions of rules that fired since the last pass */
+		rules_run();
 
-		/* add our receiver list */
-		r = receivers;
-		while(r) {
-			struct timeval diff;
-
-			if(r->fd < 0) {
-				r = r->next;
-				continue;
-			}
-			FD_SET(r->fd, &readfds);
-			maxfd = r->fd > maxfd ? r->fd : maxfd;
-
-			/* do we need to queue a power off command for sleep? */
-			if(r->zone2_sleep.tv_sec) {
-				timeval_diff(&r->zone2_sleep, &now, &diff);
-				if(timeval_positive(&diff)) {
-					timeoutval = timeval_min(&timeoutval, &diff);
-				} else {
-					process_command(r, "zone2power off");
-					write_fakesleep_status(r, now, '2');
-					timeval_clear(r->zone2_sleep);
-				}
-			}
-			if(r->zone3_sleep.tv_sec) {
-				timeval_diff(&r->zone3_sleep, &now, &diff);
-				if(timeval_positive(&diff)) {
-					timeoutval = timeval_min(&timeoutval, &diff);
-				} else {
-					process_command(r, "zone3power off");
-					write_fakesleep_status(r, now, '3');
-					timeval_clear(r->zone3_sleep);
-				}
-			}
-			/* if we still have sleep timers, we'll wake up at 60-second
-			 * intervals to give an update on the virtual sleep timers */
-			if(r->zone2_sleep.tv_sec || r->zone3_sleep.tv_sec) {
-				/* set the next sleep update the first time or if the time
-				 * is > 60 seconds in the future (clock changes) */
-				if(!r->next_sleep_update.tv_sec ||
-						(r->next_sleep_update.tv_sec >= now.tv_sec + 60 &&
-						 r->next_sleep_update.tv_usec > 0)) {
-					r->next_sleep_update = now;
-					r->next_sleep_update.tv_sec += 60;
-				}
-				timeval_diff(&r->next_sleep_update, &now, &diff);
-				if(timeval_positive(&diff)) {
-					timeoutval = timeval_min(&timeoutval, &diff);
-				}
-			} else {
-				/* clear any sleep update if we have no timers running */
-				timeval_clear(r->next_sleep_update);
-			}
-
-			/* check for write possibility if we have commands in queue */
-			if(r->queue) {
-				if(can_send_command(r, &now, &diff)) {
-					FD_SET(r->fd, &writefds);
-				} else {
-					/* We want the smallest timeout, so replace the
-					 * existing if new is smaller. */
-					timeoutval = timeval_min(&timeoutval, &diff);
-				}
-			}
-
-			r = r->next;
+		/* add our signal pipe file descriptor */
+		main_shard.pollfds[0].fd = signalpipe[READ];
+		main_shard.pollfds[0].events = POLLIN;
+		nfds = 2;
+		/* add the worker notify pipe, all of our listeners and active
+		 * connections after the receivers; these are few enough to rebuild
+		 * each time */
+		if(worker_count) {
+			if(shard_reserve(&main_shard, nfds + 1) == -1)
+				cleanup(EXIT_FAILURE);
+			main_shard.pollfds[nfds].fd = shard_notify_fd();
+			main_shard.pollfds[nfds].events = POLLIN;
+			nfds++;
+		}
+#ifndef TINY
+		if(journal_fd() > -1) {
+			if(shard_reserve(&main_shard, nfds + 1) == -1)
+				cleanup(EXIT_FAILURE);
+			main_shard.pollfds[nfds].fd = journal_fd();
+			main_shard.pollfds[nfds].events = POLLIN;
+			nfds++;
+			/* standbys we have output waiting for */
+			if(shard_reserve(&main_shard, nfds + journal_pending()) == -1)
+				cleanup(EXIT_FAILURE);
+			journal_slots = journal_poll(main_shard.pollfds + nfds);
+			nfds += journal_slots;
 		}
-		/* add all of our listeners */
+#endif
 		for(i = 0; i < listener_count; i++) {
 			if(listeners[i] > -1) {
-				FD_SET(listeners[i], &readfds);
-				maxfd = listeners[i] > maxfd ? listeners[i] : maxfd;
+				if(shard_reserve(&main_shard, nfds + 1) == -1)
+					cleanup(EXIT_FAILURE);
+				main_shard.pollfds[nfds].fd = listeners[i];
+				main_shard.pollfds[nfds].events = POLLIN;
+				nfds++;
 			}
 		}
-		/* add all of our active connections */
-		c = connections;
-		while(c) {
+		for(c = connections; c; c = c->next) {
 			if(c->fd > -1) {
-				FD_SET(c->fd, &readfds);
-				maxfd = c->fd > maxfd ? c->fd : maxfd;
+				if(shard_reserve(&main_shard, nfds + 1) == -1)
+					cleanup(EXIT_FAILURE);
+				main_shard.pollfds[nfds].fd = c->fd;
+				main_shard.pollfds[nfds].events = POLLIN;
+				c->pollidx = nfds++;
 			}
-			c = c->next;
 		}
+		pollfds = main_shard.pollfds;
 
-		if(timeoutval.tv_sec != 0 || timeoutval.tv_usec != 0) {
-			timeout = &timeoutval;
+		if(timer_next(&main_shard.timers, &now, &timeoutval)) {
+			/* round up so we don't wake just before a timer is due */
+			timeout = (int)(timeoutval.tv_sec * 1000 +
+					(timeoutval.tv_usec + 999) / 1000);
 		}
 		/* our main waiting point */
-		retval = select(maxfd + 1, &readfds, &writefds, NULL, timeout);
+		retval = poll(pollfds, (nfds_t)nfds, timeout);
+		main_shard.wakeups++;
 		if(retval == -1 && errno == EINTR)
 			continue;
 		if(retval == -1) {
-			perror("select()");
+			perror("poll()");
 			cleanup(EXIT_FAILURE);
 		}
 		/* check to see if we have signals waiting */
-		if(FD_ISSET(signalpipe[READ], &readfds)) {
+		if(pollfds[0].revents) {
 			int signo;
 			/* We don't want to read more than one signal out of the pipe.
 			 * Anything else in there will be handled the next go-around. */
 			xread(signalpipe[READ], &signo, sizeof(int));
 			realhandler(signo);
-		}
-		r = receivers;
-		while(r) {
-			if(r->fd < 0) {
-				r = r->next;
+			/* a reload may have changed our listeners, so the rest of the
+			 * poll set is stale; anything ready will still be next time */
+			if(signo == SIGHUP)
 				continue;
-			}
-			/* check if we have a status message from the receivers */
-			if(FD_ISSET(r->fd, &readfds)) {
-				process_incoming_message(r, logfd);
-			}
-			/* check if we have outgoing messages to send to receiver */
-			if(r->queue != NULL && FD_ISSET(r->fd, &writefds)) {
-				rcvr_send_command(r);
-			}
-			/* do we need to send a sleep status update? */
-			if(r->next_sleep_update.tv_sec) {
-				struct timeval diff, *next;
-				gettimeofday(&now, NULL);
-				next = &r->next_sleep_update;
-
-				timeval_diff(&now, next, &diff);
-				if(timeval_positive(&diff)) {
-					if(r->zone2_sleep.tv_sec)
-						write_fakesleep_status(r, now, '2');
-					if(r->zone3_sleep.tv_sec)
-						write_fakesleep_status(r, now, '3');
-					/* now that we've notified, schedule it again not 60
-					 * seconds from now, but at 60 second intervals from when
-					 * we should have notified */
-					do {
-						next->tv_sec += 60;
-						diff.tv_sec -= 60;
-					} while(timeval_positive(&diff));
+		}
+		/* handle our inline receivers */
+		if(pollfds[1].revents)
+			shard_process(&main_shard);
+		nfds = 2;
+		/* deliver anything our worker shards have for us */
+		if(worker_count && pollfds[nfds++].revents) {
+			shard_drain(workers, worker_count);
+		}
+#ifndef TINY
+		/* check for a standby subscribing to our state journal, and for
+		 * standbys ready to take more of it */
+		if(journal_fd() > -1) {
+			if(pollfds[nfds++].revents)
+				journal_accept();
+			for(i = 0; i < journal_slots; i++) {
+				if(pollfds[nfds + i].revents) {
+					journal_flush();
+					break;
 				}
 			}
-			r = r->next;
+			nfds += journal_slots;
 		}
+#endif
 		/* check to see if we have listeners ready to accept */
 		for(i = 0; i < listener_count; i++) {
-			if(listeners[i] > -1 && FD_ISSET(listeners[i], &readfds)) {
+			if(listeners[i] < 0)
+				continue;
+			if(pollfds[nfds++].revents) {
 				/* accept the incoming connection on the socket */
 				struct sockaddr saddr;
 				socklen_t sl = (socklen_t)sizeof(struct sockaddr);
@@ -1109,7 +4028,9 @@ int main(int argc, char *argv[])
 		/* check if we have connections with data ready to read */
 		c = connections;
 		while(c) {
-			if(c->fd > -1 && FD_ISSET(c->fd, &readfds)) {
+			/* connections opened or closed during this pass are skipped */
+			if(c->fd > -1 && c->pollidx && pollfds[c->pollidx].fd == c->fd
+					&& pollfds[c->pollidx].revents) {
 				int ret = process_input(c);
 				/* ret == 0: success */
 				/* ret == -1: connection hit EOF
@@ -9,19 +9,87 @@
 
 #include <sys/time.h>  /* struct timeval */
 #include <sys/types.h> /* ssize_t, size_t */
+#include <poll.h>      /* struct pollfd */
+#include <pthread.h>   /* pthread_t, pthread_mutex_t */
 
 /** The default port number to listen on (note: it is a string, not a num) */
 #define LISTENPORT "8701"
 
-/** Max size for our connection pool */
+/** Max size for our connection pool; the tiny build for small routers
+ * keeps all connections in a fixed pool, so it is kept small there */
+#ifdef TINY
+#define MAX_CONNECTIONS 16
+#else
 #define MAX_CONNECTIONS 200
+#endif
 
 /** Size to use for all static buffers */
 #define BUF_SIZE 64
 
-/** Time (in milliseconds) to wait between receiver commands */
+/** Default time (in milliseconds) to wait between receiver commands */
 #define COMMAND_WAIT 80
 
+/** Time (in milliseconds) to wait for group members to confirm a command */
+#define GROUP_CONFIRM_WAIT 2000
+
+/** Time (in milliseconds) a receiver that just powered on must be quiet
+ * before its status flood goes out to clients, and the longest the flood is
+ * held back */
+#define FLOOD_QUIET 250
+#define FLOOD_MAX 2000
+
+/** Size of one block of the state change history, and the most blocks kept
+ * for a receiver */
+#define HISTORY_BLOCK 4096
+#define HISTORY_BLOCKS 256
+
+/** Most nodes (comparisons and boolean operators) in a state predicate */
+#define PREDICATE_MAX 16
+
+/** Most watches a single connection may have */
+#define MAX_WATCHES 16
+
+/** Default slack (in milliseconds) for deadlines that need not be exact,
+ * such as virtual sleep timers and their minute updates; they are aligned
+ * to multiples of it so the daemon wakes only a few times a minute when
+ * idle, however many receivers it has */
+#define TIMER_SLACK 10000
+
+/** Time (in milliseconds) to wait before the first attempt to reopen a
+ * receiver link; each failed attempt doubles it up to RECONNECT_MAX_WAIT */
+#define RECONNECT_MIN_WAIT 500
+#define RECONNECT_MAX_WAIT 60000
+
+/** Default time (in milliseconds) a command may wait for a receiver that is
+ * not connected before it is dropped */
+#define QUEUE_EXPIRE 30000
+
+/** Command queue entries and heap (in bytes) set aside in real-time mode */
+#define RT_QUEUE_RESERVE 512
+#define RT_HEAP_RESERVE (1024 * 1024)
+
+/** Command queue entries in the fixed pool of the tiny build */
+#define QUEUE_POOL_SIZE 64
+
+/** Number of messages a worker shard can queue for the main thread */
+#define RING_SIZE 256
+
+/** Journal output (in bytes) a standby may fall behind by before it is
+ * dropped and has to subscribe again */
+#define JOURNAL_BACKLOG (256 * 1024)
+
+/** First descriptor a service manager passes listening sockets in */
+#define LISTEN_FDS_START 3
+
+/** Max size of a single live upgrade handoff record */
+#define UPGRADE_RECORD_SIZE (BUF_SIZE * 4)
+/** Raw bytes carried by one handoff record; they are sent in hex after a
+ * short prefix */
+#define UPGRADE_CHUNK ((UPGRADE_RECORD_SIZE - 32) / 2)
+
+/** Time (in milliseconds) to wait for a new instance to take over */
+#define UPGRADE_WAIT 5000
+
 /* allow marking of unused function parameters */
 #if defined(__GNUC__)
 #define UNUSED __attribute__((unused))
@@ -29,61 +97,403 @@
 #define UNUSED
 #endif
 
+/* the tiny build has no one to read our messages, so they are compiled out;
+ * the arguments are still evaluated so nothing becomes unused */
+#ifdef TINY
+static inline int tiny_discard(UNUSED const char *fmt, ...)
+{
+	return 0;
+}
+#define printf(...) tiny_discard(__VA_ARGS__)
+#define fprintf(fp, ...) tiny_discard(__VA_ARGS__)
+#define perror(str) tiny_discard(str)
+#endif
+
 /* characters standard to the start and end of our communication messages */
 #define START_SEND "!1"
 #define END_SEND "\r\n"
 #define START_RECV "!1"
 #define END_RECV ""
 
+/** Port eISCP network receivers listen on unless told otherwise */
+#define EISCP_PORT "60128"
+
+/** Most commands ever sent back to back to an eISCP receiver in one write */
+#define PIPELINE_MAX 16
+
+/** Number of zones we can control, including the main zone */
+#define ZONE_COUNT 4
+
 /** Power status bit values */
 enum power {
 	POWER_OFF   = 0,
 	MAIN_POWER  = (1 << 0),
 	ZONE2_POWER = (1 << 1),
 	ZONE3_POWER = (1 << 2),
+	ZONE4_POWER = (1 << 3),
 	POWER_ON    = -1,
 };
 
+/** How a receiver is connected to us */
+enum rcvr_type {
+	/** a serial device, e.g. "/dev/ttyUSB0" */
+	RCVR_SERIAL = 0,
+	/** eISCP over TCP, e.g. "eiscp:192.168.1.20" */
+	RCVR_EISCP  = 1,
+};
+
+/** Power status bit for a zone number, where zone 1 is the main zone */
+#define ZONE_POWER(zone) (1 << ((zone) - 1))
+
+/** Receiver command prefixes that exist once per zone */
+enum zone_code {
+	CODE_POWER = 0,
+	CODE_VOLUME,
+	CODE_MUTE,
+	CODE_INPUT,
+	CODE_TUNE,
+	CODE_PRESET,
+	CODE_COUNT,
+};
+
+/** Per-zone receiver state */
+struct zone {
+	/** virtual sleep timer expiry, zero if not running */
+	struct timeval sleep;
+};
+
 /** Keep track of two paired file descriptors */
 enum pipehalfs { READ = 0, WRITE = 1 };
 
+/** Slot value of a timer that is not armed in any heap */
+#define TIMER_IDLE ((size_t)-1)
+
+struct timer;
+
+typedef void (timer_cb) (struct timer *, struct timeval *);
+
+/** A timer that can be armed in a timer heap, embedded in its owner */
+struct timer {
+	struct timeval when;
+	size_t slot;
+	timer_cb *fire;
+	void *data;
+};
+
+/** A min-heap of armed timers ordered by expiry time */
+struct timer_heap {
+	struct timer **timers;
+	size_t count;
+	size_t size;
+};
+
+struct addrinfo;
+struct eiscp_lookup;
+struct group;
+struct predicate;
+struct shard;
+
 /** Represents a command waiting to be sent to the receiver */
 struct cmdqueue {
 	unsigned long hash;
 	char cmd[BUF_SIZE];
+	/** earliest time the command may be sent, zero if any time */
+	struct timeval not_before;
+	/** when the command was queued */
+	struct timeval queued;
+	/** group this command was dispatched to, NULL for normal commands */
+	struct group *sync;
 	struct cmdqueue *next;
 };
 
+/** Strings packed end to end in one buffer, found by their offset */
+struct strpool {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
 /** Our Receiver device and associated dealings */
 struct receiver {
+	/** serial device or socket descriptor, -1 while the link is down */
 	int fd;
-	int type;
+	enum rcvr_type type;
+	char *name;
+	/** serial device path or eISCP address, kept so the link can be
+	 * reopened */
+	char *path;
+	unsigned long name_hash;
+	/** events the shard epoll set is watching for, 0 if not in the set */
+	unsigned int events;
 	enum power power;
 	unsigned long cmds_sent;
+	/** commands that went out in the same write as the one before */
+	unsigned long cmds_pipelined;
 	unsigned long msgs_received;
 	struct timeval last_cmd;
-	struct timeval zone2_sleep;
-	struct timeval zone3_sleep;
+	/** how late commands went out compared to when they were due, in
+	 * microseconds */
+	unsigned long jitter_count;
+	long long jitter_total;
+	long jitter_max;
+	/** zone state indexed by zone number - 1; zones[0] is the main zone */
+	struct zone zones[ZONE_COUNT];
 	struct timeval next_sleep_update;
+	/** when to next try to reopen the link, and the wait after that */
+	struct timeval reopen_at;
+	long backoff;
 	struct cmdqueue *queue;
-	struct receiver *next;
+	struct timer timer;
+	/** shard running this receiver */
+	struct shard *shard;
+	/** protects state shared with the main thread when sharded */
+	pthread_mutex_t lock;
+	/** set when the main thread changed our queue or timers */
+	int dirty;
+	/** group command we are waiting to see confirmed, if any */
+	struct group *sync_group;
+	char sync_prefix[4];
+	struct timeval sync_sent;
+	/** status flood after a power on, batched for clients by the main
+	 * thread; status queries queued meanwhile are held until it ends */
+	int flooding;
+	struct timeval flood_start;
+	struct timeval flood_last;
+	struct timer flood_timer;
+	char flood_buf[BUF_SIZE * 16];
+	size_t flood_len;
+	unsigned int flood_count;
+	/** status queries held back from the queue until the flood ends */
+	struct cmdqueue *held;
+	unsigned long floods;
+	unsigned long queries_saved;
+	/** commands sent back to back in one write; only eISCP receivers
+	 * take more than one */
+	int depth;
+	/** eISCP packets read so far but not complete, and what is left of
+	 * a packet too big for us that is being skipped */
+	char net_buf[BUF_SIZE * 8];
+	size_t net_len;
+	size_t net_skip;
+	/** eISCP addresses looked up when the receiver was set up, and a
+	 * lookup refreshing them off the event loop, if one is running */
+	struct addrinfo *addrs;
+	struct eiscp_lookup *lookup;
+	/** what a short write left of the last commands sent; it goes out
+	 * before any other command once the link can take it */
+	char out_buf[BUF_SIZE * 2 * PIPELINE_MAX];
+	size_t out_len;
 };
 
 
+/** A status message or group confirmation passed to the main thread */
+struct status_msg {
+	struct receiver *rcvr;
+	struct group *group;
+	long latency;
+	char msg[BUF_SIZE * 2];
+};
+
+/** Single-producer, single-consumer ring of status messages */
+struct status_ring {
+	struct status_msg *msgs;
+	unsigned int head;
+	unsigned int tail;
+};
+
+/** A set of receivers sharing one epoll set and timer heap */
+struct shard {
+	struct receiver **receivers;
+	size_t receiver_count;
+	/** epoll set of the receivers; it polls readable when any is ready */
+	int epfd;
+	/** slot 0 is the wakeup (or signal) pipe, slot 1 the epoll set */
+	struct pollfd *pollfds;
+	size_t pollfd_size;
+	struct timer_heap timers;
+	int threaded;
+	int running;
+	pthread_t thread;
+	int wakeup[2];
+	int woken;
+	int notified;
+	int quit;
+	/** times the shard loop came out of poll(), shown with the status */
+	unsigned long wakeups;
+	struct status_ring outbox;
+	/** messages that found the outbox full, in order; only touched by the
+	 * shard thread, which moves them to the outbox once it holds no
+	 * receiver lock */
+	struct status_msg *overflow;
+	size_t overflow_count;
+	size_t overflow_size;
+};
+
+
+/** The last known state of one field of a receiver */
+struct state_entry {
+	unsigned long hash;
+	char *rcvr;
+	char *field;
+	/** the full status message, e.g. "OK:volume:30\n" */
+	char msg[BUF_SIZE];
+	/** when the receiver last reported the field */
+	struct timeval updated;
+	/** when the reported value last changed */
+	struct timeval changed;
+	struct state_entry *bucket_next;
+	struct state_entry *next;
+};
+
+
+/** Settings read from the configuration file */
+struct config {
+	char **binds;
+	size_t bind_count;
+	char **sockets;
+	size_t socket_count;
+	char **groups;
+	size_t group_count;
+	char *log_path;
+	/** input and mode aliases file, NULL if not set */
+	char *aliases_path;
+	/** time to wait between commands in milliseconds, -1 if not set */
+	int pacing;
+	/** time commands wait for a disconnected receiver, -1 if not set */
+	int expire;
+	/** deadline slack in milliseconds, -1 if not set */
+	int slack;
+	/** kernel timer slack in microseconds, -1 if not set */
+	long timerslack;
+	/** eISCP pipeline depths, each "<receiver>=<depth>" */
+	char **pipelines;
+	size_t pipeline_count;
+	/** reactive rules, each "[@<receiver> ]<predicate> => <command>" */
+	char **rules;
+	size_t rule_count;
+};
+
+
+/* config.c - configuration file */
+struct config *config_load(const char *path);
+void config_free(struct config *cfg);
+int config_has(char **list, size_t count, const char *str);
+int config_split_rule(char *rule, char **rcvr, char **pred, char **action);
+
 /* onkyo.c - general functions */
 int write_to_connections(const char *msg);
+int write_status(struct receiver *rcvr, const char *msg);
+void group_confirm(struct receiver *rcvr, const char *status);
+void shard_deliver(struct receiver *rcvr, struct group *g, long latency,
+		const char *msg);
+
+/* history.c - state change history */
+typedef int (history_fn) (void *data, const char *field,
+		struct timeval *when, const char *value);
+int history_add(const char *rcvr, const char *field, const char *value,
+		struct timeval *when);
+long history_query(const char *rcvr, const char *field,
+		struct timeval *since, history_fn *fn, void *data);
+size_t history_bytes(const char *rcvr, unsigned long *changes);
+void history_clear(void);
+
+/* predicate.c - state predicates */
+struct predicate *predicate_compile(const char *expr);
+void predicate_free(struct predicate *pred);
+int predicate_uses(const struct predicate *pred, const char *field);
+int predicate_eval(const struct predicate *pred, const char *rcvr);
 
 /* receiver.c - receiver interaction functions, status processing */
-void init_statuses(void);
+int init_statuses(void);
+int rcvr_resolve(struct receiver *rcvr);
+void rcvr_resolve_free(struct receiver *rcvr);
+int rcvr_open(struct receiver *rcvr);
 int rcvr_send_command(struct receiver *rcvr);
 int process_incoming_message(struct receiver *rcvr, int logfd);
 
 /* command.c - user command processing */
-void init_commands(void);
+int init_commands(void);
+int load_aliases(const char *path);
+struct cmdqueue *cmdqueue_alloc(void);
+void cmdqueue_free(struct cmdqueue *q);
+int cmdqueue_reserve(size_t count);
+void cmdqueue_clear(void);
 int process_command(struct receiver *rcvr, const char *str);
+struct cmdqueue *parse_command(const char *str);
+void cmdqueue_supersede(struct receiver *rcvr, struct cmdqueue *cmds);
 int is_power_command(const char *cmd);
+const char *command_field(const char *cmd);
 int write_fakesleep_status(struct receiver *rcvr,
-		struct timeval now, char zone);
+		struct timeval now, int zone);
+
+/* service.c - service manager integration */
+int service_listen_fds(void);
+int service_notify(const char *state);
+
+/* shard.c - receiver event loops and threading */
+void rcvr_lock(struct receiver *r);
+void rcvr_unlock(struct receiver *r);
+void rcvr_reschedule(struct receiver *r, struct timeval *now);
+void rcvr_changed(struct receiver *r);
+int shard_reserve(struct shard *sh, size_t count);
+int shard_add(struct shard *sh, struct receiver *r);
+void shard_process(struct shard *sh);
+int shard_offload(struct receiver *r, struct group *g, long latency,
+		const char *msg);
+void shard_drain(struct shard *shards, size_t count);
+int shard_notify_fd(void);
+int shard_init(struct shard *shards, size_t count);
+int shard_init_inline(struct shard *sh);
+int shard_pacing(void);
+void shard_set_pacing(int ms);
+int shard_expire(void);
+void shard_set_expire(int ms);
+int shard_slack(void);
+void shard_set_slack(int ms);
+void shard_set_timerslack(long us);
+void shard_apply_timerslack(long *applied);
+void shard_set_realtime(int priority, int cpu);
+int shard_apply_realtime(void);
+int shard_start(struct shard *shards, size_t count);
+void shard_pause(struct shard *shards, size_t count);
+void shard_resume(struct shard *shards, size_t count);
+void shard_stop(struct shard *shards, size_t count);
+
+/* state.c - receiver state cache and replication journal */
+struct state_entry *state_lookup(const char *rcvr, const char *field);
+struct state_entry *state_entries(void);
+int state_update(const char *rcvr, const char *msg);
+int state_field(const char *msg, char *field, size_t len);
+void state_clear(void);
+int journal_listen(const char *path);
+int journal_fd(void);
+void journal_accept(void);
+size_t journal_pending(void);
+size_t journal_poll(struct pollfd *pollfds);
+void journal_flush(void);
+int journal_subscribe(const char *path);
+int journal_receive(int fd);
+void journal_close(void);
+int state_handoff(int sock);
+int state_adopt(char *record, int fd);
+
+/* timer.c - timer heap handling */
+void timer_init(struct timer *t, timer_cb *fire, void *data);
+int timer_arm(struct timer_heap *heap, struct timer *t, struct timeval when);
+void timer_disarm(struct timer_heap *heap, struct timer *t);
+struct timeval timer_align(struct timeval when, long slack);
+unsigned int timer_run(struct timer_heap *heap, struct timeval *now);
+int timer_next(struct timer_heap *heap, struct timeval * restrict now,
+		struct timeval * restrict timeout);
+
+/* upgrade.c - live binary upgrade */
+int upgrade_spawn(const char *exe, char * const argv[]);
+int upgrade_send(int sock, int fd, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+ssize_t upgrade_recv(int sock, char *buf, size_t len, int *fd);
+int upgrade_send_bytes(int sock, const char *prefix, const char *data,
+		size_t len);
+ssize_t upgrade_recv_bytes(const char *hex, char *out, size_t room);
 
 /* util.c - trivial utility functions */
 int xopen(const char *path, int oflag);
@@ -91,9 +501,14 @@ int xclose(int fd);
 ssize_t xread(int fd, void *buf, size_t len);
 ssize_t xwrite(int fd, const void *buf, size_t len);
 unsigned long hash_sdbm(const char *str);
+long strpool_add(struct strpool *pool, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+void strpool_trim(struct strpool *pool);
 
 void timeval_diff(struct timeval * restrict a,
 		struct timeval * restrict b, struct timeval * restrict result);
+void timeval_add(struct timeval * restrict a,
+		struct timeval * restrict b, struct timeval * restrict result);
 struct timeval timeval_min(struct timeval *restrict a,
 		struct timeval * restrict b);
 int timeval_positive(struct timeval *tv);
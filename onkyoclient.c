@@ -0,0 +1,631 @@
+/*
+ *  onkyoclient.c - Asynchronous client library for the onkyocontrol daemon
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The daemon speaks a line protocol: we send "[@receiver ]<command> [arg]"
+ * lines and it sends back "[@receiver ]OK:<field>:<value>" status lines and
+ * "ERROR:..." lines. Status lines go to every client, so there is nothing
+ * that answers a particular command. A command is therefore completed by
+ * the first status or error for the field it names, e.g. "OK:volume:30" for
+ * "volume 30". An error without a field ("ERROR:Invalid Command") does not
+ * say which command it is for, so it only completes a command if that is
+ * the only one waiting. Commands that never get a status, such as "status"
+ * itself, are completed when ONKYO_COMMAND_TIMEOUT runs out.
+ *
+ * Any number of commands may be waiting at once; they are all written as
+ * soon as the socket takes them, without waiting for one another.
+ */
+
+#define _XOPEN_SOURCE 600 /* getaddrinfo */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "onkyoclient.h"
+
+/** Longest line the daemon takes from us, including the newline */
+#define CLIENT_CMD_SIZE 64
+/** Size of our buffer for lines from the daemon */
+#define CLIENT_BUF_SIZE 256
+
+/** A command waiting for its status */
+struct onkyo_pending {
+	/** receiver the command was addressed to, NULL for the default one */
+	char *receiver;
+	char field[CLIENT_CMD_SIZE];
+	struct timeval deadline;
+	onkyo_event_cb *done;
+	void *data;
+	struct onkyo_pending *next;
+};
+
+/** A connection to the daemon */
+struct onkyo_client {
+	/** socket descriptor, -1 if not connected */
+	int fd;
+	/** set while a non-blocking connect is in progress */
+	int connecting;
+	onkyo_event_cb *cb;
+	void *data;
+	/** partial line read from the daemon */
+	char in[CLIENT_BUF_SIZE];
+	size_t in_len;
+	/** commands not yet taken by the socket */
+	char *out;
+	size_t out_len;
+	size_t out_size;
+	/** commands waiting for their status, oldest first */
+	struct onkyo_pending *pending;
+	struct onkyo_pending *pending_tail;
+};
+
+/**
+ * Create a client. Nothing is connected until onkyo_client_connect() or
+ * onkyo_client_connect_unix() is called.
+ * @param cb callback for every event, may be NULL
+ * @param data passed to the callback
+ * @return the client, NULL on allocation failure
+ */
+struct onkyo_client *onkyo_client_new(onkyo_event_cb *cb, void *data)
+{
+	struct onkyo_client *client = calloc(1, sizeof(struct onkyo_client));
+	if(!client)
+		return NULL;
+	client->fd = -1;
+	client->cb = cb;
+	client->data = data;
+	return client;
+}
+
+/**
+ * Take the oldest waiting command off the list, or the oldest one for a
+ * receiver and field.
+ * @param client the client
+ * @param receiver the receiver name, NULL for the default receiver
+ * @param field the field name, NULL to take the oldest command
+ * @return the command, NULL if none was waiting
+ */
+static struct onkyo_pending *take_pending(struct onkyo_client *client,
+		const char *receiver, const char *field)
+{
+	struct onkyo_pending *p, *prev = NULL;
+
+	for(p = client->pending; p; prev = p, p = p->next) {
+		if(!field)
+			break;
+		if(strcmp(p->field, field) != 0)
+			continue;
+		if(!receiver && !p->receiver)
+			break;
+		if(receiver && p->receiver && strcmp(receiver, p->receiver) == 0)
+			break;
+	}
+	if(!p)
+		return NULL;
+	if(prev)
+		prev->next = p->next;
+	else
+		client->pending = p->next;
+	if(client->pending_tail == p)
+		client->pending_tail = prev;
+	return p;
+}
+
+/**
+ * Complete a waiting command, calling its completion callback.
+ * @param client the client
+ * @param p the command, already taken off the list
+ * @param event the event completing it
+ */
+static void complete(struct onkyo_client *client, struct onkyo_pending *p,
+		const struct onkyo_event *event)
+{
+	if(p->done)
+		p->done(client, event, p->data);
+	free(p->receiver);
+	free(p);
+}
+
+/**
+ * Close the connection, completing every waiting command and telling the
+ * event callback.
+ * @param client the client
+ */
+static void client_close(struct onkyo_client *client)
+{
+	struct onkyo_event event;
+	struct onkyo_pending *p;
+
+	if(client->fd > -1)
+		close(client->fd);
+	client->fd = -1;
+	client->connecting = 0;
+	client->in_len = 0;
+	client->out_len = 0;
+
+	memset(&event, 0, sizeof(struct onkyo_event));
+	event.type = ONKYO_EVENT_CLOSED;
+	while((p = take_pending(client, NULL, NULL)))
+		complete(client, p, &event);
+	if(client->cb)
+		client->cb(client, &event, client->data);
+}
+
+/**
+ * Close the connection, if any, and free a client. Waiting commands are
+ * completed with an #ONKYO_EVENT_CLOSED event. This must not be called from
+ * a callback.
+ * @param client the client
+ */
+void onkyo_client_free(struct onkyo_client *client)
+{
+	if(!client)
+		return;
+	if(client->fd > -1 || client->pending)
+		client_close(client);
+	free(client->out);
+	free(client);
+}
+
+/**
+ * Start connecting a socket without waiting for it.
+ * @param client the client
+ * @param family the socket address family
+ * @param addr the address to connect to
+ * @param len the length of addr
+ * @return 0 if connected or connecting, -1 on failure
+ */
+static int start_connect(struct onkyo_client *client, int family,
+		const struct sockaddr *addr, socklen_t len)
+{
+	int fd, flags;
+
+	fd = socket(family, SOCK_STREAM, 0);
+	if(fd == -1)
+		return -1;
+	flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if(connect(fd, addr, len) == 0) {
+		client->connecting = 0;
+	} else if(errno == EINPROGRESS) {
+		client->connecting = 1;
+	} else {
+		close(fd);
+		return -1;
+	}
+	client->fd = fd;
+	client->in_len = 0;
+	return 0;
+}
+
+/**
+ * Connect to the daemon over TCP. The name lookup may block; the connect
+ * itself does not. The connection is ready once the #ONKYO_EVENT_HELLO
+ * event arrives, but commands may be sent right away.
+ * @param client the client, which must not be connected
+ * @param host the host name or address
+ * @param port the service name or port number
+ * @return 0 if connected or connecting, -1 on failure
+ */
+int onkyo_client_connect(struct onkyo_client *client,
+		const char *host, const char *port)
+{
+	struct addrinfo hints, *result, *rp;
+	int ret = -1;
+
+	if(client->fd > -1)
+		return -1;
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	if(getaddrinfo(host, port, &hints, &result) != 0)
+		return -1;
+	/* only the first address we can start connecting to is tried */
+	for(rp = result; rp && ret == -1; rp = rp->ai_next)
+		ret = start_connect(client, rp->ai_family, rp->ai_addr,
+				rp->ai_addrlen);
+	freeaddrinfo(result);
+	return ret;
+}
+
+/**
+ * Connect to the daemon over a UNIX socket.
+ * @param client the client, which must not be connected
+ * @param path the socket path
+ * @return 0 if connected or connecting, -1 on failure
+ */
+int onkyo_client_connect_unix(struct onkyo_client *client, const char *path)
+{
+	struct sockaddr_un addr;
+
+	if(client->fd > -1 || strlen(path) > sizeof(addr.sun_path) - 1)
+		return -1;
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	return start_connect(client, AF_UNIX, (struct sockaddr *)&addr,
+			sizeof(struct sockaddr_un));
+}
+
+/**
+ * Get the descriptor to watch in an event loop.
+ * @param client the client
+ * @return the descriptor, -1 if not connected
+ */
+int onkyo_client_fd(struct onkyo_client *client)
+{
+	return client->fd;
+}
+
+/**
+ * Get the poll events to watch the descriptor for. These change as
+ * commands are sent, so ask again before every wait.
+ * @param client the client
+ * @return POLLIN, with POLLOUT while there is something to write
+ */
+short onkyo_client_events(struct onkyo_client *client)
+{
+	if(client->fd == -1)
+		return 0;
+	if(client->connecting || client->out_len)
+		return POLLIN | POLLOUT;
+	return POLLIN;
+}
+
+/**
+ * Get how long the event loop may wait before onkyo_client_process() has
+ * to be called to time out a waiting command.
+ * @param client the client
+ * @return the time in milliseconds, -1 if nothing is waiting
+ */
+int onkyo_client_timeout(struct onkyo_client *client)
+{
+	struct timeval now;
+	long ms;
+
+	/* commands all wait the same time, so the oldest runs out first */
+	if(!client->pending)
+		return -1;
+	gettimeofday(&now, NULL);
+	ms = (client->pending->deadline.tv_sec - now.tv_sec) * 1000 +
+		(client->pending->deadline.tv_usec - now.tv_usec) / 1000;
+	return ms < 0 ? 0 : (int)ms;
+}
+
+/**
+ * Complete every waiting command whose time has run out.
+ * @param client the client
+ */
+static void expire_pending(struct onkyo_client *client)
+{
+	struct onkyo_event event;
+	struct timeval now;
+
+	memset(&event, 0, sizeof(struct onkyo_event));
+	event.type = ONKYO_EVENT_TIMEOUT;
+	gettimeofday(&now, NULL);
+	while(client->pending) {
+		struct onkyo_pending *p = client->pending;
+		if(p->deadline.tv_sec > now.tv_sec ||
+				(p->deadline.tv_sec == now.tv_sec &&
+				 p->deadline.tv_usec > now.tv_usec))
+			break;
+		p = take_pending(client, NULL, NULL);
+		event.receiver = p->receiver;
+		event.field = p->field;
+		complete(client, p, &event);
+	}
+}
+
+/**
+ * Work out how a status value can be read.
+ * @param event the event holding the value
+ */
+static void type_value(struct onkyo_event *event)
+{
+	char *end;
+
+	event->value_type = ONKYO_VALUE_TEXT;
+	event->number = 0;
+	if(strcmp(event->value, "on") == 0) {
+		event->value_type = ONKYO_VALUE_BOOL;
+		event->number = 1;
+	} else if(strcmp(event->value, "off") == 0) {
+		event->value_type = ONKYO_VALUE_BOOL;
+	} else if(*event->value) {
+		long val = strtol(event->value, &end, 10);
+		if(*end == '\0') {
+			event->value_type = ONKYO_VALUE_NUMBER;
+			event->number = val;
+		}
+	}
+}
+
+/**
+ * Split up a line from the daemon and pass it on as an event, completing
+ * the command it answers, if any.
+ * @param client the client
+ * @param line the line, without its newline; it is modified
+ */
+static void handle_line(struct onkyo_client *client, char *line)
+{
+	struct onkyo_event event;
+	struct onkyo_pending *p;
+	char *sep;
+
+	memset(&event, 0, sizeof(struct onkyo_event));
+	/* messages from receivers other than the default one are prefixed */
+	if(line[0] == '@') {
+		sep = strchr(line, ' ');
+		if(!sep)
+			return;
+		*sep = '\0';
+		event.receiver = line + 1;
+		line = sep + 1;
+	}
+
+	if(strncmp(line, "OK:", 3) == 0) {
+		event.type = ONKYO_EVENT_STATUS;
+		line += 3;
+	} else if(strncmp(line, "ERROR:", 6) == 0) {
+		event.type = ONKYO_EVENT_ERROR;
+		line += 6;
+	} else {
+		return;
+	}
+
+	sep = strchr(line, ':');
+	if(sep) {
+		*sep = '\0';
+		event.field = line;
+		event.value = sep + 1;
+	} else {
+		event.value = line;
+	}
+
+	if(event.type == ONKYO_EVENT_STATUS) {
+		if(!event.field) {
+			/* only the greeting has no field, e.g. "OK:onkyocontrol v1.1" */
+			if(strncmp(event.value, "onkyocontrol", 12) != 0)
+				return;
+			event.type = ONKYO_EVENT_HELLO;
+		} else if(strcmp(event.field, "snapshot") == 0) {
+			event.type = ONKYO_EVENT_SNAPSHOT;
+		}
+		type_value(&event);
+	}
+
+	if(client->cb)
+		client->cb(client, &event, client->data);
+	if(event.type == ONKYO_EVENT_HELLO)
+		return;
+	if(!event.field && client->pending && client->pending->next)
+		return;
+	p = take_pending(client, event.receiver, event.field);
+	if(p)
+		complete(client, p, &event);
+}
+
+/**
+ * Read whatever the daemon has sent and handle every complete line.
+ * @param client the client
+ * @return 0 on success, -1 if the connection was closed
+ */
+static int read_lines(struct onkyo_client *client)
+{
+	for(;;) {
+		ssize_t count;
+		char *start, *nl;
+
+		count = read(client->fd, client->in + client->in_len,
+				sizeof(client->in) - client->in_len - 1);
+		if(count == -1 && errno == EINTR)
+			continue;
+		if(count == -1 && errno == EAGAIN)
+			return 0;
+		if(count <= 0)
+			return -1;
+		client->in_len += (size_t)count;
+		client->in[client->in_len] = '\0';
+
+		start = client->in;
+		while((nl = strchr(start, '\n'))) {
+			*nl = '\0';
+			handle_line(client, start);
+			/* a callback may have closed us */
+			if(client->fd == -1)
+				return -1;
+			start = nl + 1;
+		}
+		client->in_len -= (size_t)(start - client->in);
+		memmove(client->in, start, client->in_len);
+		/* a line longer than our buffer is garbage; drop it */
+		if(client->in_len == sizeof(client->in) - 1)
+			client->in_len = 0;
+	}
+}
+
+/**
+ * Write as many of the commands not yet sent as the socket will take.
+ * @param client the client
+ * @return 0 on success, -1 if the connection failed
+ */
+static int write_commands(struct onkyo_client *client)
+{
+	while(client->out_len) {
+		ssize_t count = write(client->fd, client->out, client->out_len);
+		if(count == -1 && errno == EINTR)
+			continue;
+		if(count == -1 && errno == EAGAIN)
+			return 0;
+		if(count <= 0)
+			return -1;
+		client->out_len -= (size_t)count;
+		memmove(client->out, client->out + count, client->out_len);
+	}
+	return 0;
+}
+
+/**
+ * Do whatever work is waiting: finish connecting, read and handle messages,
+ * write commands, and time out commands that got no status. Call this when
+ * the descriptor is ready or the timeout from onkyo_client_timeout() runs
+ * out.
+ * @param client the client
+ * @param revents the poll events that are ready, 0 if none
+ * @return 0 on success, -1 if the connection was closed
+ */
+int onkyo_client_process(struct onkyo_client *client, short revents)
+{
+	if(client->fd == -1) {
+		expire_pending(client);
+		return -1;
+	}
+
+	if(client->connecting && revents & (POLLOUT | POLLERR | POLLHUP)) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+				err != 0) {
+			client_close(client);
+			return -1;
+		}
+		client->connecting = 0;
+	}
+	if(client->connecting)
+		return 0;
+
+	if(revents & (POLLIN | POLLERR | POLLHUP) && read_lines(client) == -1) {
+		client_close(client);
+		return -1;
+	}
+	if(write_commands(client) == -1) {
+		client_close(client);
+		return -1;
+	}
+	expire_pending(client);
+	return 0;
+}
+
+/**
+ * Send a command without waiting for it to be answered. Commands are
+ * written in the order they are sent, as soon as the socket takes them.
+ * @param client the client
+ * @param cmd the command, e.g. "volume 30" or "@den power on"
+ * @param done callback for the event that completes the command, may be NULL
+ * @param data passed to the completion callback
+ * @return 0 on success, -1 if the command is invalid, we are not connected,
+ * or on allocation failure; a command with a callback that is lost because
+ * the connection fails while sending is reported only by its
+ * #ONKYO_EVENT_CLOSED completion
+ */
+int onkyo_client_send(struct onkyo_client *client, const char *cmd,
+		onkyo_event_cb *done, void *data)
+{
+	struct onkyo_pending *p = NULL;
+	size_t len = strlen(cmd);
+
+	if(client->fd == -1 || len == 0 || len >= CLIENT_CMD_SIZE ||
+			strchr(cmd, '\n'))
+		return -1;
+
+	if(done) {
+		const char *field = cmd;
+		size_t field_len;
+
+		p = calloc(1, sizeof(struct onkyo_pending));
+		if(!p)
+			return -1;
+		if(cmd[0] == '@') {
+			const char *sep = strchr(cmd, ' ');
+			if(!sep) {
+				free(p);
+				return -1;
+			}
+			p->receiver = malloc((size_t)(sep - cmd));
+			if(!p->receiver) {
+				free(p);
+				return -1;
+			}
+			memcpy(p->receiver, cmd + 1, (size_t)(sep - cmd - 1));
+			p->receiver[sep - cmd - 1] = '\0';
+			field = sep + 1;
+		}
+		field_len = strcspn(field, " ");
+		memcpy(p->field, field, field_len);
+		p->field[field_len] = '\0';
+		p->done = done;
+		p->data = data;
+		gettimeofday(&p->deadline, NULL);
+		p->deadline.tv_sec += ONKYO_COMMAND_TIMEOUT / 1000;
+		p->deadline.tv_usec += (ONKYO_COMMAND_TIMEOUT % 1000) * 1000;
+		if(p->deadline.tv_usec >= 1000000) {
+			p->deadline.tv_usec -= 1000000;
+			p->deadline.tv_sec += 1;
+		}
+	}
+
+	if(client->out_len + len + 1 > client->out_size) {
+		size_t size = client->out_size ? client->out_size : CLIENT_BUF_SIZE;
+		char *out;
+		while(client->out_len + len + 1 > size)
+			size *= 2;
+		out = realloc(client->out, size);
+		if(!out) {
+			if(p)
+				free(p->receiver);
+			free(p);
+			return -1;
+		}
+		client->out = out;
+		client->out_size = size;
+	}
+	memcpy(client->out + client->out_len, cmd, len);
+	client->out[client->out_len + len] = '\n';
+	client->out_len += len + 1;
+
+	if(p) {
+		if(client->pending_tail)
+			client->pending_tail->next = p;
+		else
+			client->pending = p;
+		client->pending_tail = p;
+	}
+
+	/* get it going now if we can; whatever is left waits for POLLOUT */
+	if(!client->connecting && write_commands(client) == -1) {
+		/* the close already completed a queued command with CLOSED */
+		client_close(client);
+		return p ? 0 : -1;
+	}
+	return 0;
+}
+
+/* vim: set ts=4 sw=4 noet: */
@@ -0,0 +1,76 @@
+/**
+ * @file onkyoclient.h
+ * Asynchronous client library for the onkyocontrol daemon. The library
+ * never blocks once connected: it hands out a descriptor and the poll events
+ * it is waiting for, so it can be embedded in any event loop, and does its
+ * work when told the descriptor is ready.
+ */
+
+#ifndef ONKYOCLIENT_H
+#define ONKYOCLIENT_H
+
+/** Time (in milliseconds) a command waits for its status before it is
+ * completed with an #ONKYO_EVENT_TIMEOUT event */
+#define ONKYO_COMMAND_TIMEOUT 5000
+
+/** Kinds of events passed to callbacks */
+enum onkyo_event_type {
+	/** the daemon greeted us; the connection is ready */
+	ONKYO_EVENT_HELLO = 0,
+	/** a status message, e.g. "OK:volume:30" */
+	ONKYO_EVENT_STATUS,
+	/** an error message, e.g. "ERROR:Invalid Command" or "ERROR:mode:N/A" */
+	ONKYO_EVENT_ERROR,
+	/** the end of a snapshot, with the number of messages in it */
+	ONKYO_EVENT_SNAPSHOT,
+	/** a command got no status in time (completion callbacks only) */
+	ONKYO_EVENT_TIMEOUT,
+	/** the connection was lost or could not be made */
+	ONKYO_EVENT_CLOSED,
+};
+
+/** How the value of a status event can be read */
+enum onkyo_value_type {
+	/** only the text is meaningful, e.g. "DVD" for an input */
+	ONKYO_VALUE_TEXT = 0,
+	/** a whole number, e.g. a volume or sleep time */
+	ONKYO_VALUE_NUMBER,
+	/** "on" (1) or "off" (0) */
+	ONKYO_VALUE_BOOL,
+};
+
+/** A message from the daemon, split up. Strings are only valid during the
+ * callback the event is passed to. */
+struct onkyo_event {
+	enum onkyo_event_type type;
+	/** receiver the message is from, NULL for the default receiver */
+	const char *receiver;
+	/** field name, e.g. "zone2volume"; NULL if the message has none */
+	const char *field;
+	/** value text, e.g. "30"; the whole message for errors without a field */
+	const char *value;
+	enum onkyo_value_type value_type;
+	/** the value for number and bool values */
+	long number;
+};
+
+struct onkyo_client;
+
+typedef void (onkyo_event_cb) (struct onkyo_client *,
+		const struct onkyo_event *, void *);
+
+struct onkyo_client *onkyo_client_new(onkyo_event_cb *cb, void *data);
+void onkyo_client_free(struct onkyo_client *client);
+int onkyo_client_connect(struct onkyo_client *client,
+		const char *host, const char *port);
+int onkyo_client_connect_unix(struct onkyo_client *client, const char *path);
+int onkyo_client_fd(struct onkyo_client *client);
+short onkyo_client_events(struct onkyo_client *client);
+int onkyo_client_timeout(struct onkyo_client *client);
+int onkyo_client_process(struct onkyo_client *client, short revents);
+int onkyo_client_send(struct onkyo_client *client, const char *cmd,
+		onkyo_event_cb *done, void *data);
+
+#endif /* ONKYOCLIENT_H */
+
+/* vim: set ts=4 sw=4 noet: */
@@ -0,0 +1,368 @@
+/*
+ *  predicate.c - Onkyo receiver state predicates
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A predicate is a small boolean expression over the cached state of one
+ * receiver, e.g. "zone2volume > 70 and zone2power = on". Comparisons take a
+ * field name, one of = != < <= > >=, and a value; values containing spaces
+ * are quoted, e.g. input = "FM Tuner". Comparisons are joined with and, or,
+ * not, and parentheses. Both sides are compared as numbers when both are
+ * numbers, otherwise as case-insensitive strings. A comparison against a
+ * field we know nothing about is false.
+ *
+ * Predicates are compiled once into postfix order, so evaluating one is a
+ * single pass over its nodes with a small stack and no parsing.
+ */
+
+#define _XOPEN_SOURCE 700 /* strndup */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h> /* strcasecmp */
+#include <ctype.h>
+
+#include "onkyo.h"
+
+enum pred_op {
+	PRED_EQ,
+	PRED_NE,
+	PRED_LT,
+	PRED_LE,
+	PRED_GT,
+	PRED_GE,
+	PRED_AND,
+	PRED_OR,
+	PRED_NOT,
+};
+
+/** One node of a compiled predicate, a comparison or a boolean operator */
+struct pred_node {
+	enum pred_op op;
+	/** the field and value compared, NULL for boolean operators */
+	char *field;
+	char *value;
+	/** the value as a number, if numeric is set */
+	double number;
+	int numeric;
+};
+
+/** A compiled predicate, its nodes in postfix order */
+struct predicate {
+	size_t count;
+	struct pred_node nodes[PREDICATE_MAX];
+};
+
+/** Parser state while compiling a predicate */
+struct pred_parser {
+	const char *pos;
+	struct predicate *pred;
+	int error;
+};
+
+static void parse_or(struct pred_parser *p);
+
+/**
+ * Parse a number taking up a whole string.
+ * @param str the string to parse
+ * @param number location to store the number
+ * @return 1 if the string is a number, 0 otherwise
+ */
+static int parse_number(const char *str, double *number)
+{
+	char *end;
+
+	if(*str == '\0')
+		return 0;
+	*number = strtod(str, &end);
+	return *end == '\0';
+}
+
+static void skip_space(struct pred_parser *p)
+{
+	while(*p->pos == ' ' || *p->pos == '\t')
+		p->pos++;
+}
+
+/**
+ * Consume a keyword if it comes next, standing on its own.
+ * @param p the parser
+ * @param word the keyword, e.g. "and"
+ * @return 1 if the keyword was consumed, 0 otherwise
+ */
+static int parse_keyword(struct pred_parser *p, const char *word)
+{
+	size_t len = strlen(word);
+
+	skip_space(p);
+	if(strncmp(p->pos, word, len) != 0 || isalnum((unsigned char)p->pos[len]))
+		return 0;
+	p->pos += len;
+	return 1;
+}
+
+static struct pred_node *add_node(struct pred_parser *p, enum pred_op op)
+{
+	struct pred_node *n;
+
+	if(p->pred->count >= PREDICATE_MAX) {
+		p->error = 1;
+		return NULL;
+	}
+	n = &p->pred->nodes[p->pred->count++];
+	n->op = op;
+	return n;
+}
+
+/**
+ * Parse a comparison, e.g. "volume > 70".
+ * @param p the parser
+ */
+static void parse_compare(struct pred_parser *p)
+{
+	static const struct {
+		const char *str;
+		enum pred_op op;
+	} ops[] = {
+		{ "==", PRED_EQ }, { "!=", PRED_NE }, { "<=", PRED_LE },
+		{ ">=", PRED_GE }, { "=", PRED_EQ }, { "<", PRED_LT },
+		{ ">", PRED_GT },
+	};
+	const char *field, *value;
+	size_t field_len, value_len, i;
+	struct pred_node *n;
+
+	skip_space(p);
+	field = p->pos;
+	while(isalnum((unsigned char)*p->pos))
+		p->pos++;
+	field_len = (size_t)(p->pos - field);
+
+	skip_space(p);
+	for(i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if(strncmp(p->pos, ops[i].str, strlen(ops[i].str)) == 0)
+			break;
+	}
+	if(field_len == 0 || i == sizeof(ops) / sizeof(ops[0])) {
+		p->error = 1;
+		return;
+	}
+	p->pos += strlen(ops[i].str);
+
+	skip_space(p);
+	if(*p->pos == '"') {
+		value = ++p->pos;
+		while(*p->pos && *p->pos != '"')
+			p->pos++;
+		if(*p->pos != '"') {
+			p->error = 1;
+			return;
+		}
+		value_len = (size_t)(p->pos++ - value);
+	} else {
+		value = p->pos;
+		while(*p->pos && *p->pos != ' ' && *p->pos != '\t'
+				&& *p->pos != ')')
+			p->pos++;
+		value_len = (size_t)(p->pos - value);
+		if(value_len == 0) {
+			p->error = 1;
+			return;
+		}
+	}
+
+	n = add_node(p, ops[i].op);
+	if(!n)
+		return;
+	n->field = strndup(field, field_len);
+	n->value = strndup(value, value_len);
+	if(!n->field || !n->value) {
+		p->error = 1;
+		return;
+	}
+	n->numeric = parse_number(n->value, &n->number);
+}
+
+static void parse_not(struct pred_parser *p)
+{
+	if(parse_keyword(p, "not")) {
+		parse_not(p);
+		add_node(p, PRED_NOT);
+		return;
+	}
+	skip_space(p);
+	if(*p->pos == '(') {
+		p->pos++;
+		parse_or(p);
+		skip_space(p);
+		if(*p->pos != ')') {
+			p->error = 1;
+			return;
+		}
+		p->pos++;
+		return;
+	}
+	parse_compare(p);
+}
+
+static void parse_and(struct pred_parser *p)
+{
+	parse_not(p);
+	while(!p->error && parse_keyword(p, "and")) {
+		parse_not(p);
+		add_node(p, PRED_AND);
+	}
+}
+
+static void parse_or(struct pred_parser *p)
+{
+	parse_and(p);
+	while(!p->error && parse_keyword(p, "or")) {
+		parse_and(p);
+		add_node(p, PRED_OR);
+	}
+}
+
+/**
+ * Compile a predicate expression.
+ * @param expr the expression, e.g. "zone2volume > 70"
+ * @return the compiled predicate, NULL if the expression is invalid or too
+ * long
+ */
+struct predicate *predicate_compile(const char *expr)
+{
+	struct pred_parser p;
+
+	p.pos = expr;
+	p.error = 0;
+	p.pred = calloc(1, sizeof(struct predicate));
+	if(!p.pred)
+		return NULL;
+	parse_or(&p);
+	skip_space(&p);
+	if(p.error || *p.pos != '\0') {
+		predicate_free(p.pred);
+		return NULL;
+	}
+	return p.pred;
+}
+
+/**
+ * Free a compiled predicate.
+ * @param pred the predicate, may be NULL
+ */
+void predicate_free(struct predicate *pred)
+{
+	size_t i;
+
+	if(!pred)
+		return;
+	for(i = 0; i < pred->count; i++) {
+		free(pred->nodes[i].field);
+		free(pred->nodes[i].value);
+	}
+	free(pred);
+}
+
+/**
+ * Check whether a predicate looks at a field, so it only needs evaluating
+ * again when that field changes.
+ * @param pred the predicate
+ * @param field the field name, e.g. "volume"
+ * @return 1 if the field is referenced, 0 otherwise
+ */
+int predicate_uses(const struct predicate *pred, const char *field)
+{
+	size_t i;
+
+	for(i = 0; i < pred->count; i++) {
+		if(pred->nodes[i].field && strcmp(pred->nodes[i].field, field) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Evaluate one comparison against the state cache.
+ * @param n the comparison node
+ * @param rcvr the receiver name
+ * @return 1 if the comparison holds, 0 otherwise
+ */
+static int compare(const struct pred_node *n, const char *rcvr)
+{
+	struct state_entry *e = state_lookup(rcvr, n->field);
+	char value[BUF_SIZE * 2];
+	double number;
+	int cmp;
+
+	if(!e)
+		return 0;
+	/* the value follows "OK:<field>:" and runs up to the newline */
+	snprintf(value, sizeof(value), "%s", e->msg + strlen(e->field) + 4);
+	value[strcspn(value, "\n")] = '\0';
+
+	if(n->numeric && parse_number(value, &number))
+		cmp = (number > n->number) - (number < n->number);
+	else
+		cmp = strcasecmp(value, n->value);
+
+	switch(n->op) {
+		case PRED_EQ: return cmp == 0;
+		case PRED_NE: return cmp != 0;
+		case PRED_LT: return cmp < 0;
+		case PRED_LE: return cmp <= 0;
+		case PRED_GT: return cmp > 0;
+		case PRED_GE: return cmp >= 0;
+		default: return 0;
+	}
+}
+
+/**
+ * Evaluate a predicate against the cached state of a receiver.
+ * @param pred the predicate
+ * @param rcvr the receiver name
+ * @return 1 if the predicate holds, 0 otherwise
+ */
+int predicate_eval(const struct predicate *pred, const char *rcvr)
+{
+	int stack[PREDICATE_MAX];
+	size_t i, depth = 0;
+
+	for(i = 0; i < pred->count; i++) {
+		const struct pred_node *n = &pred->nodes[i];
+		switch(n->op) {
+			case PRED_AND:
+				depth--;
+				stack[depth - 1] = stack[depth - 1] && stack[depth];
+				break;
+			case PRED_OR:
+				depth--;
+				stack[depth - 1] = stack[depth - 1] || stack[depth];
+				break;
+			case PRED_NOT:
+				stack[depth - 1] = !stack[depth - 1];
+				break;
+			default:
+				stack[depth++] = compare(n, rcvr);
+		}
+	}
+	return depth ? stack[0] : 0;
+}
+
+/* vim: set ts=4 sw=4 noet: */
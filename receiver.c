@@ -22,10 +22,39 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h> /* getaddrinfo */
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h> /* writev */
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "onkyo.h"
 
 extern const char * const rcvr_err;
+extern const char * const zone_codes[ZONE_COUNT][CODE_COUNT];
+
+/** An eISCP address lookup running on its own thread, as getaddrinfo()
+ * may block on DNS for as long as it likes */
+struct eiscp_lookup {
+	char host[BUF_SIZE * 2];
+	char port[16];
+	struct addrinfo *result;
+	/** LOOKUP_RUNNING until the thread is done with it; whichever of the
+	 * thread and the receiver lets go of it last frees it */
+	int state;
+};
+
+enum {
+	LOOKUP_RUNNING = 0,
+	LOOKUP_DONE,
+	LOOKUP_ABANDONED,
+};
 
 /** A mapping of receiver status value to returned message */
 struct status {
@@ -44,6 +73,15 @@ struct power_status {
 	int power;
 };
 
+/** A status that exists for every zone other than the main zone. The key is
+ * the zone command prefix followed by the suffix, and the value is a format
+ * taking the zone number. These are expanded by init_statuses(). */
+struct zone_status {
+	int code;
+	const char *suffix;
+	const char *value;
+};
+
 /**
  * Get the next receiver command that should be sent. This implementation has
  * logic to discard non-power commands if the receiver is not powered up.
@@ -66,55 +104,468 @@ static struct cmdqueue *next_rcvr_command(struct receiver *rcvr)
 			return ptr;
 		} else {
 			printf("skipping command as receiver power appears to be off\n");
-			free(ptr);
+			cmdqueue_free(ptr);
 		}
 	}
 	return NULL;
 }
 
+/**
+ * Split the path of an eISCP receiver, "eiscp:host[:port]", into its host
+ * and port.
+ * @param rcvr the receiver
+ * @param host location to store the host
+ * @param hostlen the size of host
+ * @param port location to store the port
+ * @param portlen the size of port
+ */
+static void eiscp_split(struct receiver *rcvr, char *host, size_t hostlen,
+		char *port, size_t portlen)
+{
+	char *sep;
+
+	snprintf(host, hostlen, "%s", rcvr->path + strlen("eiscp:"));
+	sep = strrchr(host, ':');
+	if(sep) {
+		*sep = '\0';
+		snprintf(port, portlen, "%s", sep + 1);
+	} else {
+		snprintf(port, portlen, "%s", EISCP_PORT);
+	}
+}
+
+/**
+ * Look up the addresses of an eISCP receiver.
+ * @param host the host name or address
+ * @param port the port name or number
+ * @param path the receiver path, for error messages
+ * @return the addresses, NULL on failure
+ */
+static struct addrinfo *eiscp_lookup_addrs(const char *host,
+		const char *port, const char *path)
+{
+	struct addrinfo hints, *result;
+	int ret;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, port, &hints, &result);
+	if(ret != 0) {
+		fprintf(stderr, "%s: %s\n", path, gai_strerror(ret));
+		return NULL;
+	}
+	return result;
+}
+
+static void *eiscp_lookup_main(void *arg)
+{
+	struct eiscp_lookup *l = arg;
+
+	l->result = eiscp_lookup_addrs(l->host, l->port, l->host);
+	if(__atomic_exchange_n(&l->state, LOOKUP_DONE, __ATOMIC_ACQ_REL)
+			== LOOKUP_ABANDONED) {
+		if(l->result)
+			freeaddrinfo(l->result);
+		free(l);
+	}
+	return NULL;
+}
+
+/**
+ * Pick up the addresses a finished background lookup found, and start a
+ * new lookup if asked to and none is running.
+ * @param rcvr the eISCP receiver
+ * @param refresh start a new lookup
+ */
+static void eiscp_lookup_update(struct receiver *rcvr, int refresh)
+{
+	struct eiscp_lookup *l = rcvr->lookup;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t all, old;
+	int err;
+
+	if(l && __atomic_load_n(&l->state, __ATOMIC_ACQUIRE) == LOOKUP_DONE) {
+		/* keep what we had if the name does not resolve right now */
+		if(l->result) {
+			if(rcvr->addrs)
+				freeaddrinfo(rcvr->addrs);
+			rcvr->addrs = l->result;
+		}
+		free(l);
+		rcvr->lookup = l = NULL;
+	}
+	if(!refresh || l)
+		return;
+
+	l = calloc(1, sizeof(struct eiscp_lookup));
+	if(!l)
+		return;
+	eiscp_split(rcvr, l->host, sizeof(l->host), l->port, sizeof(l->port));
+	l->state = LOOKUP_RUNNING;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	/* signals are only ever handled by the main loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&thread, &attr, eiscp_lookup_main, l);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+	if(err) {
+		fprintf(stderr, "%s: could not start lookup: %s\n", rcvr->path,
+				strerror(err));
+		free(l);
+		return;
+	}
+	rcvr->lookup = l;
+}
+
+/**
+ * Look up the addresses of an eISCP receiver when it is set up, so opening
+ * the link later never waits on DNS. If the lookup fails, the receiver stays
+ * down and the lookup is retried off the event loop.
+ * @param rcvr the receiver
+ * @return 0 on success or for a serial receiver, -1 if the lookup failed
+ */
+int rcvr_resolve(struct receiver *rcvr)
+{
+	char host[BUF_SIZE * 2], port[16];
+
+	if(rcvr->type != RCVR_EISCP)
+		return 0;
+	eiscp_split(rcvr, host, sizeof(host), port, sizeof(port));
+	rcvr->addrs = eiscp_lookup_addrs(host, port, rcvr->path);
+	return rcvr->addrs ? 0 : -1;
+}
+
+/**
+ * Free the addresses of an eISCP receiver. A background lookup still
+ * running cleans up after itself when it is done.
+ * @param rcvr the receiver
+ */
+void rcvr_resolve_free(struct receiver *rcvr)
+{
+	struct eiscp_lookup *l = rcvr->lookup;
+
+	if(l && __atomic_exchange_n(&l->state, LOOKUP_ABANDONED,
+				__ATOMIC_ACQ_REL) == LOOKUP_DONE) {
+		if(l->result)
+			freeaddrinfo(l->result);
+		free(l);
+	}
+	rcvr->lookup = NULL;
+	if(rcvr->addrs)
+		freeaddrinfo(rcvr->addrs);
+	rcvr->addrs = NULL;
+}
+
+/**
+ * Open the TCP connection to an eISCP receiver, whose path is of the form
+ * "eiscp:host[:port]". The connection is made non-blocking; the receiver
+ * shows up as writable once it is established, and a failure to connect
+ * turns up as a failed read. The addresses looked up when the receiver was
+ * set up are used; a reconnect also refreshes them in the background, in
+ * case the receiver has moved, for the next attempt.
+ * @param rcvr the receiver to connect to
+ * @return the socket file descriptor, -1 on failure
+ */
+static int eiscp_open(struct receiver *rcvr)
+{
+	struct addrinfo *rp;
+	int fd = -1, on = 1;
+
+	eiscp_lookup_update(rcvr, rcvr->backoff || !rcvr->addrs);
+	if(!rcvr->addrs) {
+		fprintf(stderr, "%s: no address yet\n", rcvr->path);
+		return -1;
+	}
+	for(rp = rcvr->addrs; rp != NULL; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if(fd == -1)
+			continue;
+		if(fcntl(fd, F_SETFL, O_NONBLOCK) == 0 &&
+				(connect(fd, rp->ai_addr, rp->ai_addrlen) == 0 ||
+				 errno == EINPROGRESS))
+			break;
+		xclose(fd);
+		fd = -1;
+	}
+	if(fd == -1) {
+		perror(rcvr->path);
+		return -1;
+	}
+	/* commands are packed into one write already; don't hold them back */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, (socklen_t)sizeof(on));
+	rcvr->net_len = 0;
+	rcvr->net_skip = 0;
+	return fd;
+}
+
+/**
+ * Open the link to a receiver. A serial device has its line set up; it is
+ * opened non-blocking so a missing modem carrier or a wedged adapter cannot
+ * hold us up.
+ * @param rcvr the receiver to open the device for
+ * @return the serial device or socket file descriptor, -1 on failure
+ */
+int rcvr_open(struct receiver *rcvr)
+{
+	int fd;
+	struct termios newtio;
+
+	if(rcvr->type == RCVR_EISCP)
+		return eiscp_open(rcvr);
+
+	/* Open serial device for reading and writing, but not as controlling
+	 * TTY because we don't want to get killed if linenoise sends CTRL-C.
+	 */
+	fd = xopen(rcvr->path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		goto cleanup;
+
+	memset(&newtio, 0, sizeof(struct termios));
+	/* Set:
+	 * B9600 - 9600 baud
+	 * No flow control
+	 * CS8 - 8n1 (8 bits, no parity, 1 stop bit)
+	 * Don't hangup automatically
+	 * CLOCAL - ignore modem status
+	 * CREAD - enable receiving characters
+	 */
+	newtio.c_cflag = B9600 | CS8 | CLOCAL | CREAD;
+	/* ignore bytes with parity errors and make terminal raw and dumb */
+	newtio.c_iflag = IGNPAR;
+	/* raw output mode */
+	newtio.c_oflag = 0;
+	/* canonical input mode- end read at a line descriptor */
+	newtio.c_lflag = ICANON;
+	/* add the Onkyo-used EOF char to allow canonical read */
+	newtio.c_cc[VEOL] = (cc_t)END_RECV[strlen(END_RECV) - 1];
+
+	/* clean the line and activate the settings */
+	if(tcflush(fd, TCIOFLUSH) < 0)
+		goto cleanup;
+	if(tcsetattr(fd, TCSAFLUSH, &newtio) < 0)
+		goto cleanup;
+
+	return fd;
+
+cleanup:
+	perror(rcvr->path);
+	if(fd > -1)
+		xclose(fd);
+	return -1;
+}
+
+/**
+ * Note how late a command went out compared to when it was meant to: the
+ * latest of when it was queued, the release time of a group command, and
+ * the end of the wait after the previous command.
+ * @param rcvr the receiver the command was sent to
+ * @param q the command that was sent
+ * @param intended the end of the wait after the previous command
+ */
+static void note_send_jitter(struct receiver *rcvr, struct cmdqueue *q,
+		struct timeval *intended)
+{
+	struct timeval when, diff;
+	long usecs;
+
+	when = *intended;
+	timeval_diff(&q->queued, &when, &diff);
+	if(timeval_positive(&diff))
+		when = q->queued;
+	timeval_diff(&q->not_before, &when, &diff);
+	if(timeval_positive(&diff))
+		when = q->not_before;
+
+	timeval_diff(&rcvr->last_cmd, &when, &diff);
+	usecs = diff.tv_sec * 1000000 + diff.tv_usec;
+	/* a clock rollback shouldn't count as a huge delay */
+	if(usecs < 0)
+		usecs = 0;
+	rcvr->jitter_count++;
+	rcvr->jitter_total += usecs;
+	if(usecs > rcvr->jitter_max)
+		rcvr->jitter_max = usecs;
+}
+
+/**
+ * Format a receiver command the way it goes out on the link: wrapped in
+ * the start and end characters, and for eISCP receivers also in a packet
+ * header.
+ * @param rcvr the receiver the command is for
+ * @param cmd the command, e.g. "PWRQSTN"
+ * @param buf location to store the formatted command
+ * @param len the size of buf
+ * @return the length of the formatted command, 0 if it does not fit
+ */
+static size_t format_command(struct receiver *rcvr, const char *cmd,
+		char *buf, size_t len)
+{
+	size_t hdrsize = rcvr->type == RCVR_EISCP ? 16 : 0;
+	size_t datasize = strlen(START_SEND) + strlen(cmd) + strlen(END_SEND);
+
+	if(hdrsize + datasize >= len) {
+		fprintf(stderr, "send_command, command too large: %zd\n", datasize);
+		return 0;
+	}
+	if(hdrsize) {
+		/* "ISCP", header size and data size (big-endian), version 1 */
+		memcpy(buf, "ISCP", 4);
+		buf[4] = buf[5] = buf[6] = 0;
+		buf[7] = (char)hdrsize;
+		buf[8] = buf[9] = 0;
+		buf[10] = (char)(datasize >> 8);
+		buf[11] = (char)datasize;
+		buf[12] = 1;
+		buf[13] = buf[14] = buf[15] = 0;
+	}
+	sprintf(buf + hdrsize, START_SEND "%s" END_SEND, cmd);
+	return hdrsize + datasize;
+}
+
+/**
+ * Check if the command at the head of a receiver queue can go out in the
+ * same write as the one before it. Commands held back, group commands, and
+ * power commands always go out on their own.
+ * @param rcvr the receiver
+ * @param prev the command before it
+ * @param now time value to use as 'now'
+ * @return 1 if the command can go along, 0 otherwise
+ */
+static int can_pipeline(struct receiver *rcvr, struct cmdqueue *prev,
+		struct timeval *now)
+{
+	struct cmdqueue *q = rcvr->queue;
+	struct timeval diff;
+
+	if(!q || q->sync || prev->sync || is_power_command(prev->cmd)
+			|| is_power_command(q->cmd))
+		return 0;
+	if(q->not_before.tv_sec) {
+		timeval_diff(&q->not_before, now, &diff);
+		if(timeval_positive(&diff))
+			return 0;
+	}
+	return 1;
+}
+
 /** 
- * Send a command to the receiver. This should be used when a write() to the
- * given file descriptor is known to be non-blocking; e.g. after a select()
- * call on the descriptor.
+ * Send commands to the receiver. This should be used when a write() to the
+ * given file descriptor is known to be non-blocking; e.g. after a poll()
+ * call on the descriptor. Normally a single command is sent; an eISCP
+ * receiver with a pipeline depth gets up to that many ready commands in one
+ * write. A write the link only partly takes, or not at all, is not a
+ * failure: the rest is kept and finished on the next call, before anything
+ * else is sent.
  * @param rcvr the receiver to send a command to from the attached queue
- * @return 0 on success or no action taken, -1 on failure
+ * @return 0 on success or no action taken, -1 on failure, -2 if the link to
+ * the receiver failed
  */
 int rcvr_send_command(struct receiver *rcvr)
 {
-	struct cmdqueue *ptr;
-
+	struct cmdqueue *sent[PIPELINE_MAX];
+	struct timeval intended, wait, now;
+	struct iovec iov[PIPELINE_MAX];
+	char packets[PIPELINE_MAX][BUF_SIZE * 2];
+	ssize_t retval;
+	size_t written;
+	int count = 0, depth, i, err;
+
+	/* finish what the last write left before sending anything new */
+	if(rcvr->out_len) {
+		do {
+			retval = write(rcvr->fd, rcvr->out_buf, rcvr->out_len);
+		} while(retval < 0 && errno == EINTR);
+		if(retval < 0 && errno == EAGAIN)
+			return 0;
+		if(retval < 0) {
+			perror("send_command, write");
+			printf("%s", rcvr_err);
+			return -2;
+		}
+		rcvr->out_len -= (size_t)retval;
+		memmove(rcvr->out_buf, rcvr->out_buf + retval, rcvr->out_len);
+		return 0;
+	}
 	if(!rcvr->queue)
 		return -1;
 
-	ptr = next_rcvr_command(rcvr);
-	if(ptr) {
-		ssize_t retval;
-		size_t cmdsize;
-		char fullcmd[BUF_SIZE * 2];
-
-		cmdsize = strlen(START_SEND) + strlen(ptr->cmd) + strlen(END_SEND);
-		if(cmdsize >= BUF_SIZE * 2) {
-			fprintf(stderr, "send_command, command too large: %zd\n", cmdsize);
-			return -1;
+	/* the earliest the next command was allowed out */
+	wait.tv_sec = shard_pacing() / 1000;
+	wait.tv_usec = (shard_pacing() % 1000) * 1000;
+	timeval_add(&rcvr->last_cmd, &wait, &intended);
+
+	depth = rcvr->type == RCVR_EISCP ? rcvr->depth : 1;
+	if(depth < 1 || depth > PIPELINE_MAX)
+		depth = 1;
+	gettimeofday(&now, NULL);
+	while(count < depth) {
+		struct cmdqueue *ptr;
+		size_t len;
+
+		if(count && !can_pipeline(rcvr, sent[count - 1], &now))
+			break;
+		ptr = next_rcvr_command(rcvr);
+		if(!ptr)
+			break;
+		len = format_command(rcvr, ptr->cmd, packets[count],
+				sizeof(packets[count]));
+		if(len == 0) {
+			cmdqueue_free(ptr);
+			break;
+		}
+		iov[count].iov_base = packets[count];
+		iov[count].iov_len = len;
+		sent[count++] = ptr;
+	}
+	if(count == 0)
+		return 0;
+
+	/* write the commands */
+	do {
+		retval = writev(rcvr->fd, iov, count);
+	} while(retval < 0 && errno == EINTR);
+	err = retval < 0 ? errno : 0;
+	/* set our last sent time */
+	gettimeofday(&(rcvr->last_cmd), NULL);
+
+	for(i = 0; i < count; i++) {
+		note_send_jitter(rcvr, sent[i], &intended);
+		/* remember group commands so we can time their confirmation */
+		if(sent[i]->sync) {
+			rcvr->sync_group = sent[i]->sync;
+			memcpy(rcvr->sync_prefix, sent[i]->cmd, 3);
+			rcvr->sync_prefix[3] = '\0';
+			rcvr->sync_sent = rcvr->last_cmd;
 		}
-
-		sprintf(fullcmd, START_SEND "%s" END_SEND, ptr->cmd);
-
-		/* write the command */
-		retval = xwrite(rcvr->fd, fullcmd, cmdsize);
-		/* set our last sent time */
-		gettimeofday(&(rcvr->last_cmd), NULL);
 		/* print command to console; newline is already in command */
-		printf("command:  %s", fullcmd);
-		free(ptr);
+		printf("command:  " START_SEND "%s" END_SEND, sent[i]->cmd);
+		cmdqueue_free(sent[i]);
+	}
 
-		if(retval < 0 || ((size_t)retval) != cmdsize) {
-			fprintf(stderr, "send_command, write returned %zd\n", retval);
-			printf("%s", rcvr_err);
-			return -1;
+	if(err && err != EAGAIN) {
+		fprintf(stderr, "send_command, writev: %s\n", strerror(err));
+		printf("%s", rcvr_err);
+		return -2;
+	}
+	/* the link is busy; keep what it did not take for when it can */
+	written = retval < 0 ? 0 : (size_t)retval;
+	for(i = 0; i < count; i++) {
+		size_t len = iov[i].iov_len;
+		if(written >= len) {
+			written -= len;
+			continue;
 		}
-		rcvr->cmds_sent++;
+		memcpy(rcvr->out_buf + rcvr->out_len,
+				packets[i] + written, len - written);
+		rcvr->out_len += len - written;
+		written = 0;
 	}
+	rcvr->cmds_sent += (unsigned long)count;
+	rcvr->cmds_pipelined += (unsigned long)(count - 1);
 	return 0;
 }
 
@@ -124,28 +575,27 @@ int rcvr_send_command(struct receiver *rcvr)
  * not block. It may also be used to get the status message that is returned
  * after sending a command.
  * @param serialfd the file descriptor the receiver is accessible on
- * @param status the status string returned by the receiver
- * @return the read size on success, -1 on failure
+ * @param status location to store the status string returned by the
+ * receiver, NUL-terminated
+ * @param len the size of status
+ * @return the read size on success, -1 on failure, -2 if nothing was ready
  */
-static ssize_t rcvr_handle_status(int serialfd, char **status)
+static ssize_t rcvr_handle_status(int serialfd, char *status, size_t len)
 {
 	ssize_t retval;
-	char buf[BUF_SIZE];
 
-	memset(buf, 0, BUF_SIZE);
+	memset(status, 0, len);
 	/* read the status message that should be present */
-	retval = xread(serialfd, &buf, BUF_SIZE - 1);
+	do {
+		retval = read(serialfd, status, len - 1);
+	} while(retval < 0 && errno == EINTR);
+	/* the device is non-blocking; this was a spurious wakeup */
+	if(retval < 0 && errno == EAGAIN)
+		return -2;
 
 	/* if we had a returned status, we are good to go */
 	if(retval > 0) {
-		buf[retval] = '\0';
-		/* return the status message if asked for */
-		if(status)  {
-			size_t alloc_size = (size_t)retval + 1;
-			*status = malloc(alloc_size * sizeof(char));
-			if(*status)
-				memcpy(*status, buf, alloc_size);
-		}
+		status[retval] = '\0';
 		return retval;
 	}
 
@@ -220,52 +670,6 @@ static struct status statuses[] = {
 	{ 0, "MEMUNLK", "OK:memory:unlocked\n" },
 	{ 0, "MEMN/A",  "ERROR:memory:N/A\n" },
 
-	{ 0, "ZMT00", "OK:zone2mute:off\n" },
-	{ 0, "ZMT01", "OK:zone2mute:on\n" },
-
-	{ 0, "ZVLN/A", "ERROR:zone2volume:N/A\n" },
-
-	{ 0, "SLZ00", "OK:zone2input:DVR\n" },
-	{ 0, "SLZ01", "OK:zone2input:Cable\n" },
-	{ 0, "SLZ02", "OK:zone2input:TV\n" },
-	{ 0, "SLZ03", "OK:zone2input:AUX\n" },
-	{ 0, "SLZ04", "OK:zone2input:AUX2\n" },
-	{ 0, "SLZ10", "OK:zone2input:DVD\n" },
-	{ 0, "SLZ20", "OK:zone2input:Tape\n" },
-	{ 0, "SLZ22", "OK:zone2input:Phono\n" },
-	{ 0, "SLZ23", "OK:zone2input:CD\n" },
-	{ 0, "SLZ24", "OK:zone2input:FM Tuner\n" },
-	{ 0, "SLZ25", "OK:zone2input:AM Tuner\n" },
-	{ 0, "SLZ26", "OK:zone2input:Tuner\n" },
-	{ 0, "SLZ30", "OK:zone2input:Multichannel\n" },
-	{ 0, "SLZ31", "OK:zone2input:XM Radio\n" },
-	{ 0, "SLZ32", "OK:zone2input:Sirius Radio\n" },
-	{ 0, "SLZ7F", "OK:zone2input:Off\n" },
-	{ 0, "SLZ80", "OK:zone2input:Source\n" },
-
-	{ 0, "MT300", "OK:zone3mute:off\n" },
-	{ 0, "MT301", "OK:zone3mute:on\n" },
-
-	{ 0, "VL3N/A", "ERROR:zone3volume:N/A\n" },
-
-	{ 0, "SL300", "OK:zone3input:DVR\n" },
-	{ 0, "SL301", "OK:zone3input:Cable\n" },
-	{ 0, "SL302", "OK:zone3input:TV\n" },
-	{ 0, "SL303", "OK:zone3input:AUX\n" },
-	{ 0, "SL304", "OK:zone3input:AUX2\n" },
-	{ 0, "SL310", "OK:zone3input:DVD\n" },
-	{ 0, "SL320", "OK:zone3input:Tape\n" },
-	{ 0, "SL322", "OK:zone3input:Phono\n" },
-	{ 0, "SL323", "OK:zone3input:CD\n" },
-	{ 0, "SL324", "OK:zone3input:FM Tuner\n" },
-	{ 0, "SL325", "OK:zone3input:AM Tuner\n" },
-	{ 0, "SL326", "OK:zone3input:Tuner\n" },
-	{ 0, "SL330", "OK:zone3input:Multichannel\n" },
-	{ 0, "SL331", "OK:zone3input:XM Radio\n" },
-	{ 0, "SL332", "OK:zone3input:Sirius Radio\n" },
-	{ 0, "SL37F", "OK:zone3input:Off\n" },
-	{ 0, "SL380", "OK:zone3input:Source\n" },
-
 	{ 0, "DIF00", "OK:display:Volume\n" },
 	{ 0, "DIF01", "OK:display:Mode\n" },
 	{ 0, "DIF02", "OK:display:Digital Format\n" },
@@ -322,40 +726,148 @@ static struct status statuses[] = {
 	{ 0, NULL,    NULL },
 };
 
-static struct power_status power_statuses[] = {
-	{ 0, "PWR00", "OK:power:off\n",      1, 0 },
-	{ 0, "PWR01", "OK:power:on\n",       1, 1 },
+static const struct zone_status zone_status_list[] = {
+	{ CODE_MUTE,   "00",  "OK:zone%dmute:off\n" },
+	{ CODE_MUTE,   "01",  "OK:zone%dmute:on\n" },
+
+	{ CODE_VOLUME, "N/A", "ERROR:zone%dvolume:N/A\n" },
+
+	{ CODE_INPUT,  "00",  "OK:zone%dinput:DVR\n" },
+	{ CODE_INPUT,  "01",  "OK:zone%dinput:Cable\n" },
+	{ CODE_INPUT,  "02",  "OK:zone%dinput:TV\n" },
+	{ CODE_INPUT,  "03",  "OK:zone%dinput:AUX\n" },
+	{ CODE_INPUT,  "04",  "OK:zone%dinput:AUX2\n" },
+	{ CODE_INPUT,  "10",  "OK:zone%dinput:DVD\n" },
+	{ CODE_INPUT,  "20",  "OK:zone%dinput:Tape\n" },
+	{ CODE_INPUT,  "22",  "OK:zone%dinput:Phono\n" },
+	{ CODE_INPUT,  "23",  "OK:zone%dinput:CD\n" },
+	{ CODE_INPUT,  "24",  "OK:zone%dinput:FM Tuner\n" },
+	{ CODE_INPUT,  "25",  "OK:zone%dinput:AM Tuner\n" },
+	{ CODE_INPUT,  "26",  "OK:zone%dinput:Tuner\n" },
+	{ CODE_INPUT,  "30",  "OK:zone%dinput:Multichannel\n" },
+	{ CODE_INPUT,  "31",  "OK:zone%dinput:XM Radio\n" },
+	{ CODE_INPUT,  "32",  "OK:zone%dinput:Sirius Radio\n" },
+	{ CODE_INPUT,  "7F",  "OK:zone%dinput:Off\n" },
+	{ CODE_INPUT,  "80",  "OK:zone%dinput:Source\n" },
+};
 
-	{ 0, "ZPW00", "OK:zone2power:off\n", 2, 0 },
-	{ 0, "ZPW01", "OK:zone2power:on\n",  2, 1 },
+#define ZONE_STATUSES \
+	(sizeof(zone_status_list) / sizeof(zone_status_list[0]))
 
-	{ 0, "PW300", "OK:zone3power:off\n", 3, 0 },
-	{ 0, "PW301", "OK:zone3power:on\n",  3, 1 },
+/** The zone statuses expanded for zones 2 and up */
+static struct status zone_statuses[(ZONE_COUNT - 1) * ZONE_STATUSES + 1];
 
-	/* Do not remove! */
-	{ 0, NULL,    NULL,            -1,-1 },
-};
+/** Power statuses for every zone, filled in by init_statuses() */
+static struct power_status power_statuses[ZONE_COUNT * 2 + 1];
+
+/** The text of the statuses expanded by init_statuses(), packed together */
+static struct strpool status_text;
+
+/**
+ * Build the status field name used for a zone, e.g. "volume" for the main
+ * zone and "zone2volume" for zone 2.
+ * @param buf location to store the field name
+ * @param len the size of buf
+ * @param zone the zone number
+ * @param field the field name used for the main zone
+ */
+static void zone_field(char *buf, size_t len, int zone, const char *field)
+{
+	if(zone == 1)
+		snprintf(buf, len, "%s", field);
+	else
+		snprintf(buf, len, "zone%d%s", zone, field);
+}
+
+/**
+ * Find the zone a receiver status message belongs to by its command prefix.
+ * @param status the receiver status message, e.g. "ZVL28"
+ * @param code the per-zone command prefix to look for
+ * @return the zone number, 0 if the status does not use the prefix
+ */
+static int status_zone(const char *status, enum zone_code code)
+{
+	int zone;
+	for(zone = 1; zone <= ZONE_COUNT; zone++) {
+		if(strncmp(status, zone_codes[zone - 1][code], 3) == 0)
+			return zone;
+	}
+	return 0;
+}
 
 /**
  * Initialize our list of static statuses. This must be called before the first
  * call to process_incoming_message(). This initialization gives us a slight
  * performance gain by pre-hashing our status values to unsigned longs,
  * allowing the status lookups to be relatively low-cost.
+ * @return 0 on success, -1 on allocation failure
  */
-void init_statuses(void)
+int init_statuses(void)
 {
+	/* offsets of each expanded key and value in the status text; the text
+	 * may move while it is being added to */
+	long zone_text[(ZONE_COUNT - 1) * ZONE_STATUSES][2];
+	long power_text[ZONE_COUNT * 2][2];
 	unsigned int status_count = 0;
 	struct status *status;
 	struct power_status *pwr_status;
+	int zone, power;
+	size_t i, n;
+
 	for(status = statuses; status->key; status++) {
 		status->hash = hash_sdbm(status->key);
 		status_count++;
 	}
-	for(pwr_status = power_statuses; pwr_status->key; pwr_status++) {
+
+	n = 0;
+	for(zone = 2; zone <= ZONE_COUNT; zone++) {
+		for(i = 0; i < ZONE_STATUSES; i++) {
+			const struct zone_status *zs = &zone_status_list[i];
+			zone_text[n][0] = strpool_add(&status_text, "%s%s",
+					zone_codes[zone - 1][zs->code], zs->suffix);
+			zone_text[n][1] = strpool_add(&status_text, zs->value, zone);
+			if(zone_text[n][0] == -1 || zone_text[n][1] == -1)
+				return -1;
+			n++;
+		}
+	}
+
+	n = 0;
+	for(zone = 1; zone <= ZONE_COUNT; zone++) {
+		char field[16];
+		zone_field(field, sizeof(field), zone, "power");
+		for(power = 0; power <= 1; power++) {
+			power_text[n][0] = strpool_add(&status_text, "%s%02d",
+					zone_codes[zone - 1][CODE_POWER], power);
+			power_text[n][1] = strpool_add(&status_text, "OK:%s:%s\n",
+					field, power ? "on" : "off");
+			if(power_text[n][0] == -1 || power_text[n][1] == -1)
+				return -1;
+			pwr_status = &power_statuses[n];
+			pwr_status->zone = zone;
+			pwr_status->power = power;
+			n++;
+		}
+	}
+	strpool_trim(&status_text);
+
+	/* the text is all in place now, so it can be pointed to */
+	for(n = 0; n < (ZONE_COUNT - 1) * ZONE_STATUSES; n++) {
+		status = &zone_statuses[n];
+		status->key = status_text.buf + zone_text[n][0];
+		status->value = status_text.buf + zone_text[n][1];
+		status->hash = hash_sdbm(status->key);
+		status_count++;
+	}
+	for(n = 0; n < ZONE_COUNT * 2; n++) {
+		pwr_status = &power_statuses[n];
+		pwr_status->key = status_text.buf + power_text[n][0];
+		pwr_status->value = status_text.buf + power_text[n][1];
 		pwr_status->hash = hash_sdbm(pwr_status->key);
 		status_count++;
 	}
 	printf("%u status messages prehashed in status list.\n", status_count);
+	return 0;
 }
 
 static void update_power_status(struct receiver *rcvr, int zone, int value);
@@ -377,6 +889,7 @@ static int parse_status(struct receiver *rcvr, size_t size, char *status)
 	char *sptr, *eptr;
 	struct status *st;
 	struct power_status *pwr_st;
+	int zone;
 
 	/* Trim the start and end portions off. We want to strip any leading
 	 * garbage, including null bytes, and just start where we find the
@@ -389,16 +902,28 @@ static int parse_status(struct receiver *rcvr, size_t size, char *status)
 			*eptr = '\0';
 	} else {
 		/* Hmm, we couldn't find the start chars. WTF? */
-		write_to_connections(rcvr_err);
+		write_status(rcvr, rcvr_err);
 		return -1;
 	}
 
+	if(rcvr->sync_group)
+		group_confirm(rcvr, sptr);
+
 	hashval = hash_sdbm(sptr);
 	/* this depends on the {NULL} entry at the end of the list */
 	st = statuses;
 	while(st->hash != 0) {
 		if(st->hash == hashval) {
-			write_to_connections(st->value);
+			write_status(rcvr, st->value);
+			return 0;
+		}
+		st++;
+	}
+
+	st = zone_statuses;
+	while(st->hash != 0) {
+		if(st->hash == hashval) {
+			write_status(rcvr, st->value);
 			return 0;
 		}
 		st++;
@@ -408,7 +933,7 @@ static int parse_status(struct receiver *rcvr, size_t size, char *status)
 	while(pwr_st->hash != 0) {
 		if(pwr_st->hash == hashval) {
 			update_power_status(rcvr, pwr_st->zone, pwr_st->power);
-			write_to_connections(pwr_st->value);
+			write_status(rcvr, pwr_st->value);
 			return 0;
 		}
 		pwr_st++;
@@ -417,69 +942,48 @@ static int parse_status(struct receiver *rcvr, size_t size, char *status)
 	/* We couldn't use our easy method of matching statuses to messages,
 	 * so handle the special cases. */
 
-	if(strncmp(sptr, "MVL", 3) == 0 || strncmp(sptr, "ZVL", 3) == 0
-			|| strncmp(sptr, "VL3", 3) == 0) {
+	if((zone = status_zone(sptr, CODE_VOLUME))) {
 		char buf2[BUF_SIZE];
+		char field[16];
 		/* parse the volume number out */
 		char *pos;
 		/* read volume level in as a base 16 (hex) number */
 		long level = strtol(sptr + 3, &pos, 16);
-		if(*sptr == 'M') {
-			/* main volume level */
-			snprintf(buf, BUF_SIZE, "OK:volume:%ld\n", level);
-			snprintf(buf2, BUF_SIZE, "OK:dbvolume:%ld\n", level - 82);
-		} else if(*sptr == 'Z') {
-			/* zone 2 volume level */
-			snprintf(buf, BUF_SIZE, "OK:zone2volume:%ld\n", level);
-			snprintf(buf2, BUF_SIZE, "OK:zone2dbvolume:%ld\n", level - 82);
-		} else if(*sptr == 'V') {
-			/* zone 3 volume level */
-			snprintf(buf, BUF_SIZE, "OK:zone3volume:%ld\n", level);
-			snprintf(buf2, BUF_SIZE, "OK:zone3dbvolume:%ld\n", level - 82);
-		}
+		zone_field(field, sizeof(field), zone, "volume");
+		snprintf(buf, BUF_SIZE, "OK:%s:%ld\n", field, level);
+		zone_field(field, sizeof(field), zone, "dbvolume");
+		snprintf(buf2, BUF_SIZE, "OK:%s:%ld\n", field, level - 82);
 		/* this block is special compared to the rest; we write out buf2 here
 		 * but let the normal write at the end handle buf as usual */
-		write_to_connections(buf2);
+		write_status(rcvr, buf2);
 	}
 
-	/* TUN, TUZ, TU3 */
-	else if(strncmp(sptr, "TU", 2) == 0) {
+	else if((zone = status_zone(sptr, CODE_TUNE))) {
 		/* parse the frequency number out */
-		char *pos, *tunemsg;
+		char *pos;
+		char field[16];
 		/* read frequency in as a base 10 number */
 		long freq = strtol(sptr + 3, &pos, 10);
-		/* decide whether we are main or zones */
-		tunemsg = "OK:tune:";
-		if(sptr[2] == 'Z') {
-			tunemsg = "OK:zone2tune:";
-		} else if(sptr[2] == '3') {
-			tunemsg = "OK:zone3tune:";
-		}
+		zone_field(field, sizeof(field), zone, "tune");
 		if(freq > 8000) {
 			/* FM frequency, something like 09790 was read */
 			/* Use some awesome integer math to format the output */
-			snprintf(buf, BUF_SIZE, "%s%ld.%ld FM\n", tunemsg,
+			snprintf(buf, BUF_SIZE, "OK:%s:%ld.%ld FM\n", field,
 					freq / 100, (freq / 10) % 10);
 		} else {
 			/* AM frequency, something like 00780 was read */
-			snprintf(buf, BUF_SIZE, "%s%ld AM\n", tunemsg, freq);
+			snprintf(buf, BUF_SIZE, "OK:%s:%ld AM\n", field, freq);
 		}
 	}
 
-	else if(strncmp(sptr, "PRS", 3) == 0 || strncmp(sptr, "PRZ", 3) == 0
-			|| strncmp(sptr, "PR3", 3) == 0) {
+	else if((zone = status_zone(sptr, CODE_PRESET))) {
 		/* parse the preset number out */
-		char *pos, *prsmsg;
+		char *pos;
+		char field[16];
 		/* read value in as a base 16 (hex) number */
 		long value = strtol(sptr + 3, &pos, 16);
-		/* decide whether we are main or zones */
-		prsmsg = "OK:preset:";
-		if(sptr[2] == 'Z') {
-			prsmsg = "OK:zone2preset:";
-		} else if(sptr[2] == '3') {
-			prsmsg = "OK:zone3preset:";
-		}
-		snprintf(buf, BUF_SIZE, "%s%ld\n", prsmsg, value);
+		zone_field(field, sizeof(field), zone, "preset");
+		snprintf(buf, BUF_SIZE, "OK:%s:%ld\n", field, value);
 	}
 
 	else if(strncmp(sptr, "SLP", 3) == 0) {
@@ -512,7 +1016,7 @@ static int parse_status(struct receiver *rcvr, size_t size, char *status)
 		snprintf(buf, BUF_SIZE, "OK:todo:%s\n", sptr);
 	}
 
-	write_to_connections(buf);
+	write_status(rcvr, buf);
 	return 0;
 }
 
@@ -522,44 +1026,122 @@ static int parse_status(struct receiver *rcvr, size_t size, char *status)
  * will not be updated. If it is, perform some bitmask-foo to update the power
  * status depending on what zone was turned on or off.
  * @param rcvr the receiver the message was received from
- * @param zone the value 1, 2, or 3 corresponding to the zone
+ * @param zone the zone number, 1 being the main zone
  * @param value 1 for on, 0 for off
  */
 static void update_power_status(struct receiver *rcvr, int zone, int value)
 {
-	/* var is a bitmask, manage power/zone2power separately */
-	if(zone == 1 && value == 0) {
-		rcvr->power &= ~MAIN_POWER;
-	} else if(zone == 1 && value == 1) {
-		rcvr->power |= MAIN_POWER;
-	} else if(zone == 2 && value == 0) {
-		rcvr->power &= ~ZONE2_POWER;
-		timeval_clear(rcvr->zone2_sleep);
-	} else if(zone == 2 && value == 1) {
-		rcvr->power |= ZONE2_POWER;
-	} else if(zone == 3 && value == 0) {
-		rcvr->power &= ~ZONE3_POWER;
-		timeval_clear(rcvr->zone3_sleep);
-	} else if(zone == 3 && value == 1) {
-		rcvr->power |= ZONE3_POWER;
+	/* var is a bitmask with one bit per zone */
+	if(value) {
+		rcvr->power |= ZONE_POWER(zone);
+	} else {
+		rcvr->power &= ~ZONE_POWER(zone);
+		/* a zone that is off has nothing left to sleep */
+		timeval_clear(rcvr->zones[zone - 1].sleep);
 	}
 }
 
+/**
+ * Read from an eISCP receiver and handle every complete packet read so far.
+ * TCP does not keep packets apart, so partial packets are kept until the
+ * rest arrives; anything that does not start with a packet header is
+ * skipped until one is found, and packets too big for a status message are
+ * skipped whole.
+ * @param rcvr the receiver to read from
+ * @param logfd the fd used for logging raw status messages
+ * @return 0 on success, -2 if the link to the receiver failed
+ */
+static int eiscp_incoming(struct receiver *rcvr, int logfd)
+{
+	char *buf = rcvr->net_buf;
+	ssize_t got;
+
+	do {
+		got = read(rcvr->fd, buf + rcvr->net_len,
+				sizeof(rcvr->net_buf) - rcvr->net_len);
+	} while(got < 0 && errno == EINTR);
+	if(got < 0 && errno == EAGAIN)
+		return 0;
+	if(got <= 0) {
+		write_status(rcvr, rcvr_err);
+		return -2;
+	}
+	rcvr->net_len += (size_t)got;
+
+	for(;;) {
+		char status[BUF_SIZE];
+		unsigned char *hdr = (unsigned char *)buf;
+		size_t hdrsize, datasize, skip;
+		char *start;
+
+		if(rcvr->net_skip) {
+			skip = rcvr->net_skip < rcvr->net_len ?
+				rcvr->net_skip : rcvr->net_len;
+			rcvr->net_skip -= skip;
+			rcvr->net_len -= skip;
+			memmove(buf, buf + skip, rcvr->net_len);
+		}
+		/* find the next packet, keeping a possible partial "ISCP" */
+		start = memmem(buf, rcvr->net_len, "ISCP", 4);
+		skip = start ? (size_t)(start - buf) :
+			(rcvr->net_len > 3 ? rcvr->net_len - 3 : 0);
+		if(skip) {
+			rcvr->net_len -= skip;
+			memmove(buf, buf + skip, rcvr->net_len);
+		}
+		if(!start || rcvr->net_len < 16)
+			break;
+
+		hdrsize = (size_t)hdr[4] << 24 | (size_t)hdr[5] << 16 |
+			(size_t)hdr[6] << 8 | hdr[7];
+		datasize = (size_t)hdr[8] << 24 | (size_t)hdr[9] << 16 |
+			(size_t)hdr[10] << 8 | hdr[11];
+		if(hdrsize < 16 || hdrsize > BUF_SIZE) {
+			/* not a real header; look for the next one */
+			rcvr->net_skip = 4;
+			continue;
+		}
+		if(datasize >= sizeof(status)) {
+			rcvr->net_skip = hdrsize + datasize;
+			continue;
+		}
+		if(rcvr->net_len < hdrsize + datasize)
+			break;
+
+		memcpy(status, buf + hdrsize, datasize);
+		status[datasize] = '\0';
+		rcvr->net_len -= hdrsize + datasize;
+		memmove(buf, buf + hdrsize + datasize, rcvr->net_len);
+
+		if(logfd > 0)
+			xwrite(logfd, status, datasize + 1);
+		if(parse_status(rcvr, datasize, status) == 0)
+			rcvr->msgs_received++;
+	}
+	return 0;
+}
+
 /**
  * Process a status message to be read from the receiver (one that the
  * receiver initiated). Return a human-readable status message.
  * @param rcvr the receiver to process the command for
  * @param logfd the fd used for logging raw status messages
- * @return 0 on successful processing, -1 on failure
+ * @return 0 on successful processing, -1 on failure, -2 if the link to the
+ * receiver failed
  */
 int process_incoming_message(struct receiver *rcvr, int logfd)
 {
 	int ret;
 	ssize_t size;
-	char *status = NULL;
+	char status[BUF_SIZE];
+
+	if(rcvr->type == RCVR_EISCP)
+		return eiscp_incoming(rcvr, logfd);
 
 	/* get the output from the receiver */
-	size = rcvr_handle_status(rcvr->fd, &status);
+	size = rcvr_handle_status(rcvr->fd, status, sizeof(status));
+	if(size == -2)
+		return 0;
 	if(size >= 0) {
 		/* log the message if we have a logfd */
 		if(logfd > 0)
@@ -569,11 +1151,10 @@ int process_incoming_message(struct receiver *rcvr, int logfd)
 		if(!ret)
 			rcvr->msgs_received++;
 	} else {
-		write_to_connections(rcvr_err);
-		ret = -1;
+		write_status(rcvr, rcvr_err);
+		ret = -2;
 	}
 
-	free(status);
 	return ret;
 }
 
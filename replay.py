@@ -0,0 +1,147 @@
+#!/usr/bin/env python2
+"""
+Replay client sessions recorded by onkyocontrol's --record option against
+a running daemon. Each recorded connection is reopened as its own socket and
+its lines are sent with the original timing, optionally scaled.
+"""
+
+import select, socket, sys, time
+from optparse import OptionParser
+
+HOST = 'localhost'
+PORT = 8701
+
+def parse_record(path):
+    """
+    Read a session record file, returning a list of (time, id, op, text)
+    tuples where time is the absolute offset in seconds from the start of
+    the recording.
+    """
+    events = []
+    elapsed = 0
+    f = open(path)
+    try:
+        for lineno, line in enumerate(f):
+            line = line.rstrip('\n')
+            if not line:
+                continue
+            try:
+                delta, connid, rest = line.split(' ', 2)
+                elapsed += int(delta)
+                events.append((elapsed / 1000.0, int(connid), rest[0], rest[1:]))
+            except (ValueError, IndexError):
+                sys.stderr.write("%s:%d: malformed record line\n" %
+                        (path, lineno + 1))
+    finally:
+        f.close()
+    return events
+
+class Replayer:
+    """
+    Holds the replay sockets keyed by recorded connection id and drives the
+    recorded events against the target daemon.
+    """
+
+    def __init__(self, host, port, speed):
+        self.host = host
+        self.port = port
+        self.speed = speed
+        self.socks = dict()
+        self.sent = 0
+        self.received = 0
+
+    def _open(self, connid):
+        self._close(connid)
+        try:
+            sock = socket.create_connection((self.host, self.port))
+        except socket.error, msg:
+            sys.stderr.write("connection %d failed: %s\n" % (connid, msg))
+            return
+        sock.setblocking(0)
+        self.socks[connid] = sock
+
+    def _close(self, connid):
+        sock = self.socks.pop(connid, None)
+        if sock:
+            sock.close()
+
+    def _send(self, connid, text):
+        sock = self.socks.get(connid)
+        if not sock:
+            return
+        sock.setblocking(1)
+        try:
+            sock.sendall(text + '\n')
+            self.sent += 1
+        except socket.error:
+            self._close(connid)
+            return
+        sock.setblocking(0)
+
+    def _drain(self, timeout):
+        """Read and discard daemon output until timeout seconds pass."""
+        deadline = time.time() + max(timeout, 0)
+        while True:
+            remaining = deadline - time.time()
+            socks = self.socks.values()
+            if not socks:
+                if remaining > 0:
+                    time.sleep(remaining)
+                return
+            readable = select.select(socks, [], [], max(remaining, 0))[0]
+            for sock in readable:
+                try:
+                    data = sock.recv(4096)
+                except socket.error:
+                    data = ''
+                if not data:
+                    for connid, s in self.socks.items():
+                        if s is sock:
+                            self._close(connid)
+                    continue
+                self.received += data.count('\n')
+            if remaining <= 0:
+                return
+
+    def run(self, events):
+        start = time.time()
+        for when, connid, op, text in events:
+            if self.speed > 0:
+                self._drain(start + when / self.speed - time.time())
+            else:
+                self._drain(0)
+            if op == '+':
+                self._open(connid)
+            elif op == '-':
+                self._close(connid)
+            elif op == '>':
+                self._send(connid, text)
+        # give the daemon a moment to answer the last commands
+        self._drain(0.5)
+        for connid in self.socks.keys():
+            self._close(connid)
+        return time.time() - start
+
+def main():
+    parser = OptionParser(usage="%prog [options] <record file>")
+    parser.add_option("-H", "--host", default=HOST,
+            help="daemon host to connect to [default: %default]")
+    parser.add_option("-p", "--port", type="int", default=PORT,
+            help="daemon port to connect to [default: %default]")
+    parser.add_option("-s", "--speed", type="float", default=1.0,
+            help="replay speed factor, 0 for as fast as possible "
+            "[default: %default]")
+    (options, args) = parser.parse_args()
+    if len(args) != 1:
+        parser.error("a single record file is required")
+
+    events = parse_record(args[0])
+    replayer = Replayer(options.host, options.port, options.speed)
+    duration = replayer.run(events)
+    print "replayed %d events, %d commands sent, %d lines received in %.3fs" % \
+            (len(events), replayer.sent, replayer.received, duration)
+
+if __name__ == "__main__":
+    main()
+
+# vim: set ts=4 sw=4 et:
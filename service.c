@@ -0,0 +1,120 @@
+/*
+ *  service.c - Onkyo receiver daemon service manager integration
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A service manager such as systemd can open our listening sockets for us
+ * and pass them in when it starts us (socket activation), so clients can
+ * connect while we are still starting up. It can also be told when we are
+ * ready to serve, reloading, or stopping. Both use the plain environment
+ * variable and datagram protocols, so no service manager library is needed.
+ */
+
+#define _XOPEN_SOURCE 600 /* unsetenv */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h> /* offsetof */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "onkyo.h"
+
+/**
+ * Take over the listening sockets the service manager passed to us, if any.
+ * They start at descriptor LISTEN_FDS_START and are only meant for us if
+ * LISTEN_PID names our process. The variables are removed from our
+ * environment so nothing we start thinks they are meant for it.
+ * @return the number of descriptors passed, 0 if none were
+ */
+int service_listen_fds(void)
+{
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	char *end;
+	long count;
+	int fd;
+
+	if(!pid || !fds)
+		return 0;
+	if(strtol(pid, &end, 10) != (long)getpid() || *end != '\0')
+		return 0;
+	count = strtol(fds, &end, 10);
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	if(*end != '\0' || count <= 0 || count > MAX_CONNECTIONS)
+		return 0;
+
+	for(fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + (int)count; fd++)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return (int)count;
+}
+
+/**
+ * Tell the service manager about a change in our state, e.g. "READY=1".
+ * Nothing is sent unless we were started with a notify socket.
+ * @param state the newline-separated state assignments to send
+ * @return 0 on success or if there is no one to tell, -1 on failure
+ */
+int service_notify(const char *state)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un addr;
+	socklen_t len;
+	ssize_t ret;
+	int fd;
+
+	if(!path || (path[0] != '/' && path[0] != '@'))
+		return 0;
+	if(strlen(path) > sizeof(addr.sun_path) - 1) {
+		fprintf(stderr, "notify socket path too long\n");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + strlen(path));
+	/* a leading '@' names a socket in the abstract namespace */
+	if(addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';
+	else
+		len++;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if(fd == -1) {
+		perror("socket()");
+		return -1;
+	}
+	do {
+		ret = sendto(fd, state, strlen(state), 0,
+				(struct sockaddr *)&addr, len);
+	} while(ret == -1 && errno == EINTR);
+	if(ret == -1)
+		perror("sendto()");
+	xclose(fd);
+	return ret == -1 ? -1 : 0;
+}
+
+/* vim: set ts=4 sw=4 noet: */
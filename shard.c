@@ -0,0 +1,1100 @@
+/*
+ *  shard.c - Onkyo receiver event loops
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A shard is a set of receivers sharing one epoll set and timer heap. By
+ * default there is a single shard run inline by the main loop in onkyo.c.
+ * With --threads, receivers are spread over worker shards that each run
+ * their own loop on their own thread. Status messages from worker shards
+ * are handed to the main thread through a single-producer, single-consumer
+ * ring per shard, so the client-facing side never waits on a receiver.
+ *
+ * Receiver state that the main thread also touches (the command queue and
+ * the virtual sleep timers) is protected by the per-receiver lock. Only
+ * the owning shard touches its epoll set and timer heap; the main thread
+ * asks for a receiver to be rescheduled with rcvr_changed().
+ */
+
+#define _GNU_SOURCE 1 /* sched_yield, pthread_sigmask, CPU_SET */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+
+#include "onkyo.h"
+
+extern int logfd;
+extern const char * const rcvr_err;
+
+/** Ready receivers a shard handles per pass; the rest are next */
+#define SHARD_EVENTS 64
+
+/** Pipe the worker shards use to wake up the main loop */
+static int notifypipe[2] = { -1, -1 };
+
+/** Time (in milliseconds) to wait between commands to a receiver */
+static int pacing = COMMAND_WAIT;
+/** Time (in milliseconds) commands wait for a disconnected receiver */
+static int expire = QUEUE_EXPIRE;
+/** Slack (in milliseconds) low-precision receiver deadlines are aligned to */
+static int slack = TIMER_SLACK;
+/** Kernel timer slack (in nanoseconds) for every thread, 0 for the kernel
+ * default, -1 to leave whatever we were started with */
+static long timerslack = -1;
+/** SCHED_FIFO priority for threads running receivers, 0 for none, and the
+ * CPU to pin them to, -1 for any */
+static int rt_priority = 0;
+static int rt_cpu = -1;
+
+/**
+ * Get the time to wait between commands to a receiver.
+ * @return the wait in milliseconds
+ */
+int shard_pacing(void)
+{
+	return __atomic_load_n(&pacing, __ATOMIC_RELAXED);
+}
+
+/**
+ * Change the time to wait between commands to a receiver. Receivers pick
+ * up the new value the next time they are rescheduled.
+ * @param ms the wait in milliseconds
+ */
+void shard_set_pacing(int ms)
+{
+	__atomic_store_n(&pacing, ms, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the slack low-precision receiver deadlines are aligned to, see
+ * timer_align().
+ * @return the slack in milliseconds, 0 if deadlines are exact
+ */
+int shard_slack(void)
+{
+	return __atomic_load_n(&slack, __ATOMIC_RELAXED);
+}
+
+/**
+ * Change the slack low-precision receiver deadlines are aligned to.
+ * Receivers pick up the new value the next time they are rescheduled.
+ * @param ms the slack in milliseconds, 0 for exact deadlines
+ */
+void shard_set_slack(int ms)
+{
+	__atomic_store_n(&slack, ms, __ATOMIC_RELAXED);
+}
+
+/**
+ * Change the kernel timer slack (PR_SET_TIMERSLACK) of every thread. The
+ * calling thread gets it right away, worker threads on their next wakeup.
+ * The kernel may let poll() timeouts run this much late, which lets it
+ * batch our wakeups with others; real-time threads are never given slack.
+ * @param us the slack in microseconds, 0 for the kernel default
+ */
+void shard_set_timerslack(long us)
+{
+	__atomic_store_n(&timerslack, us * 1000, __ATOMIC_RELAXED);
+	shard_apply_timerslack(NULL);
+}
+
+/**
+ * Apply the kernel timer slack to the calling thread if it changed.
+ * @param applied the slack last applied by this thread, updated; NULL to
+ * apply it regardless
+ */
+void shard_apply_timerslack(long *applied)
+{
+	long ns = __atomic_load_n(&timerslack, __ATOMIC_RELAXED);
+
+	if(applied) {
+		if(*applied == ns)
+			return;
+		*applied = ns;
+	}
+	if(ns >= 0 && prctl(PR_SET_TIMERSLACK, (unsigned long)ns, 0, 0, 0) == -1)
+		perror("prctl(PR_SET_TIMERSLACK)");
+}
+
+/**
+ * Get the time commands may wait for a receiver that is not connected.
+ * @return the wait in milliseconds, 0 to wait forever
+ */
+int shard_expire(void)
+{
+	return __atomic_load_n(&expire, __ATOMIC_RELAXED);
+}
+
+/**
+ * Change the time commands may wait for a receiver that is not connected.
+ * @param ms the wait in milliseconds, 0 to wait forever
+ */
+void shard_set_expire(int ms)
+{
+	__atomic_store_n(&expire, ms, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set the real-time scheduling for threads running receivers. Worker shard
+ * threads pick it up when they are started.
+ * @param priority the SCHED_FIFO priority, 0 to leave scheduling alone
+ * @param cpu the CPU to pin threads to, -1 to not pin them
+ */
+void shard_set_realtime(int priority, int cpu)
+{
+	rt_priority = priority;
+	rt_cpu = cpu;
+}
+
+/**
+ * Apply the real-time scheduling set with shard_set_realtime() to the
+ * calling thread.
+ * @return 0 on success, -1 on failure
+ */
+int shard_apply_realtime(void)
+{
+	struct sched_param param;
+	int ret = 0, err;
+
+	if(rt_priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = rt_priority;
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if(err) {
+			fprintf(stderr, "could not set real-time priority: %s\n",
+					strerror(err));
+			ret = -1;
+		}
+	}
+	if(rt_cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(rt_cpu, &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if(err) {
+			fprintf(stderr, "could not pin to CPU %d: %s\n", rt_cpu,
+					strerror(err));
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/**
+ * Determine if we can send a command to the receiver by ensuring it has been
+ * a certain time since the previous sent command. If we can send a command,
+ * 1 is returned and timeoutval is left undefined. If we cannot send, then 0
+ * is returned and the timeoutval is set accordingly.
+ * @param receiver the receiver to check for last time sent
+ * @param now time value to use as 'now'
+ * @param timeoutval location to store timeout before next permitted send
+ * @return 1 if we can send a command, 0 if we cannot (and timeoutval is set)
+ */
+static int can_send_command(struct receiver *receiver,
+		struct timeval * restrict now,
+		struct timeval * restrict timeoutval)
+{
+	struct timeval diff, wait;
+
+	/* ensure it has been long enough since the last sent command */
+	timeval_diff(now, &receiver->last_cmd, &diff);
+
+	wait.tv_usec = 1000 * (long)shard_pacing();
+	wait.tv_sec = wait.tv_usec / 1000000;
+	wait.tv_usec -= wait.tv_sec * 1000000;
+
+	/* first, sanity check that now > last_cmd; if not, we had a clock rollback
+	 * scenario and we should just forget the prior last sent command time */
+	if(diff.tv_sec < 0) {
+		/* clock went backwards; reset the last_cmd time and wait another
+		 * pacing milliseconds */
+		receiver->last_cmd.tv_sec = now->tv_sec;
+		receiver->last_cmd.tv_usec = now->tv_usec;
+		timeoutval->tv_sec = wait.tv_sec;
+		timeoutval->tv_usec = wait.tv_usec;
+		return 0;
+	}
+
+	/* check if both of our difference values are > wait values */
+	if(diff.tv_sec > wait.tv_sec ||
+			(diff.tv_sec == wait.tv_sec && diff.tv_usec >= wait.tv_usec)) {
+		/* it has been long enough, note that timeoutval is untouched */
+		return 1;
+	}
+
+	/* it hasn't been long enough, set the timeout as necessary */
+	timeval_diff(&wait, &diff, timeoutval);
+	return 0;
+}
+
+/**
+ * Queue up any sleep timer work that is due for the given receiver. This
+ * powers off zones whose virtual sleep timer has run out and sends the
+ * periodic sleep timer status updates.
+ * @param r the receiver to check
+ * @param now time value to use as 'now'
+ */
+static void rcvr_check_sleep(struct receiver *r, struct timeval *now)
+{
+	struct timeval diff;
+	int zone;
+
+	/* do we need to queue a power off command for sleep? */
+	for(zone = 2; zone <= ZONE_COUNT; zone++) {
+		struct zone *z = &r->zones[zone - 1];
+		if(!z->sleep.tv_sec)
+			continue;
+		timeval_diff(&z->sleep, now, &diff);
+		if(!timeval_positive(&diff)) {
+			char cmd[32];
+			snprintf(cmd, sizeof(cmd), "zone%dpower off", zone);
+			process_command(r, cmd);
+			write_fakesleep_status(r, *now, zone);
+			timeval_clear(z->sleep);
+		}
+	}
+
+	/* do we need to send a sleep status update? */
+	if(r->next_sleep_update.tv_sec) {
+		struct timeval *next = &r->next_sleep_update;
+
+		timeval_diff(now, next, &diff);
+		if(timeval_positive(&diff) || (diff.tv_sec == 0 && diff.tv_usec == 0)) {
+			for(zone = 2; zone <= ZONE_COUNT; zone++) {
+				if(r->zones[zone - 1].sleep.tv_sec)
+					write_fakesleep_status(r, *now, zone);
+			}
+			/* now that we've notified, schedule it again not 60
+			 * seconds from now, but at 60 second intervals from when
+			 * we should have notified */
+			do {
+				next->tv_sec += 60;
+				diff.tv_sec -= 60;
+			} while(timeval_positive(&diff));
+			*next = timer_align(*next, shard_slack());
+		}
+	}
+}
+
+/**
+ * Drop commands that have waited too long for a receiver that is not
+ * connected. Clients are told once if anything was dropped.
+ * @param r the receiver to check
+ * @param now time value to use as 'now'
+ */
+static void rcvr_expire(struct receiver *r, struct timeval *now)
+{
+	struct cmdqueue **pos = &r->queue;
+	struct timeval limit, wait;
+	unsigned int dropped = 0;
+	int ms = shard_expire();
+
+	if(!ms)
+		return;
+	wait.tv_sec = ms / 1000;
+	wait.tv_usec = (ms % 1000) * 1000;
+	timeval_diff(now, &wait, &limit);
+
+	while(*pos) {
+		struct cmdqueue *q = *pos;
+		struct timeval diff;
+		timeval_diff(&q->queued, &limit, &diff);
+		if(diff.tv_sec < 0) {
+			*pos = q->next;
+			cmdqueue_free(q);
+			dropped++;
+			continue;
+		}
+		pos = &q->next;
+	}
+	if(dropped) {
+		printf("dropped %u commands for disconnected receiver %s\n",
+				dropped, r->name);
+		write_status(r, rcvr_err);
+	}
+}
+
+/**
+ * Change what the shard epoll set watches a connected receiver for. The
+ * kernel is only asked when the events actually change.
+ * @param r the receiver to watch
+ * @param events the epoll events to wait for, 0 to leave the set
+ */
+static void rcvr_watch(struct receiver *r, unsigned int events)
+{
+	struct epoll_event ev;
+	int op;
+
+	if(events == r->events)
+		return;
+	if(!events)
+		op = EPOLL_CTL_DEL;
+	else if(!r->events)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = r;
+	if(epoll_ctl(r->shard->epfd, op, r->fd, &ev) == -1) {
+		perror("epoll_ctl()");
+		return;
+	}
+	r->events = events;
+}
+
+/**
+ * Schedule the next attempt to reopen a receiver link, waiting twice as long
+ * as last time, up to RECONNECT_MAX_WAIT.
+ * @param r the receiver to reopen
+ * @param now time value to use as 'now'
+ */
+static void rcvr_backoff(struct receiver *r, struct timeval *now)
+{
+	struct timeval wait;
+
+	if(!r->backoff)
+		r->backoff = RECONNECT_MIN_WAIT;
+	else if(r->backoff < RECONNECT_MAX_WAIT / 2)
+		r->backoff *= 2;
+	else
+		r->backoff = RECONNECT_MAX_WAIT;
+	wait.tv_sec = r->backoff / 1000;
+	wait.tv_usec = (r->backoff % 1000) * 1000;
+	timeval_add(now, &wait, &r->reopen_at);
+	/* a long wait can be stretched to share a wakeup slot */
+	if(r->backoff >= shard_slack())
+		r->reopen_at = timer_align(r->reopen_at, shard_slack());
+}
+
+/**
+ * Try to open the link to a receiver that is not connected. On success the
+ * receiver is asked for its power status so we know where it is at;
+ * otherwise another attempt is scheduled.
+ * @param r the receiver to open
+ * @param now time value to use as 'now'
+ */
+static void rcvr_link_open(struct receiver *r, struct timeval *now)
+{
+	struct cmdqueue *queue, **tail;
+	int fd;
+
+	rcvr_expire(r, now);
+	fd = rcvr_open(r);
+	if(fd == -1) {
+		rcvr_backoff(r, now);
+		return;
+	}
+	r->fd = fd;
+	r->backoff = 0;
+	timeval_clear(r->reopen_at);
+	rcvr_watch(r, EPOLLIN);
+	printf("receiver %s connected\n", r->name);
+
+	/* ask for the power status ahead of anything queued while we were
+	 * down, as commands are skipped while the receiver looks off */
+	queue = r->queue;
+	r->queue = NULL;
+	process_command(r, "power");
+	for(tail = &r->queue; *tail; tail = &(*tail)->next)
+		;
+	*tail = queue;
+}
+
+/**
+ * Close the link to a receiver after a read or write on it failed, e.g.
+ * because the adapter was unplugged, and schedule an attempt to reopen it.
+ * Queued commands are kept until they expire.
+ * @param r the receiver whose link failed
+ * @param now time value to use as 'now'
+ */
+static void rcvr_link_down(struct receiver *r, struct timeval *now)
+{
+	fprintf(stderr, "receiver %s disconnected\n", r->name);
+	rcvr_watch(r, 0);
+	xclose(r->fd);
+	r->fd = -1;
+	/* a half written command means nothing on a new link */
+	r->out_len = 0;
+	r->backoff = 0;
+	rcvr_backoff(r, now);
+}
+
+/**
+ * Recompute what the given receiver is waiting for. This arms the receiver
+ * timer for the earliest of its sleep timers, sleep status updates, and
+ * the end of the wait between commands, and asks for write readiness only
+ * when a queued command may be sent right now. This must be called any time
+ * the receiver queue or timers change.
+ * @param r the receiver to reschedule
+ * @param now time value to use as 'now'
+ */
+void rcvr_reschedule(struct receiver *r, struct timeval *now)
+{
+	struct timeval next = { 0, 0 }, diff;
+	unsigned int events = EPOLLIN;
+	int zone, sleeping = 0;
+	long lax = shard_slack();
+
+	/* sleep timers run for minutes, so they can wait for a shared slot */
+	for(zone = 2; zone <= ZONE_COUNT; zone++) {
+		if(r->zones[zone - 1].sleep.tv_sec) {
+			struct timeval when = timer_align(r->zones[zone - 1].sleep, lax);
+			next = timeval_min(&next, &when);
+			sleeping = 1;
+		}
+	}
+
+	/* if we still have sleep timers, we'll wake up at 60-second
+	 * intervals to give an update on the virtual sleep timers */
+	if(sleeping) {
+		/* set the next sleep update the first time or if the time
+		 * is too far in the future (clock changes) */
+		struct timeval ahead, limit;
+		ahead.tv_sec = 60 + lax / 1000;
+		ahead.tv_usec = (lax % 1000) * 1000;
+		timeval_add(now, &ahead, &limit);
+		timeval_diff(&r->next_sleep_update, &limit, &ahead);
+		if(!r->next_sleep_update.tv_sec || timeval_positive(&ahead)) {
+			r->next_sleep_update = *now;
+			r->next_sleep_update.tv_sec += 60;
+			r->next_sleep_update = timer_align(r->next_sleep_update, lax);
+		}
+		next = timeval_min(&next, &r->next_sleep_update);
+	} else {
+		/* clear any sleep update if we have no timers running */
+		timeval_clear(r->next_sleep_update);
+	}
+
+	/* a receiver that is not connected only waits to be reopened */
+	if(r->fd < 0) {
+		if(r->reopen_at.tv_sec)
+			next = timeval_min(&next, &r->reopen_at);
+	} else if(r->out_len) {
+		/* the rest of the last write goes out as soon as it can */
+		events |= EPOLLOUT;
+	} else if(r->queue) {
+		/* check for write possibility if we have commands in queue */
+		if(r->queue->not_before.tv_sec) {
+			timeval_diff(&r->queue->not_before, now, &diff);
+		}
+		if(r->queue->not_before.tv_sec && timeval_positive(&diff)) {
+			/* held back so all group members send at once */
+			next = timeval_min(&next, &r->queue->not_before);
+		} else if(can_send_command(r, now, &diff)) {
+			events |= EPOLLOUT;
+		} else {
+			struct timeval when;
+			timeval_add(now, &diff, &when);
+			next = timeval_min(&next, &when);
+		}
+	}
+
+	if(r->fd > -1)
+		rcvr_watch(r, events);
+	if(next.tv_sec || next.tv_usec)
+		timer_arm(&r->shard->timers, &r->timer, next);
+	else
+		timer_disarm(&r->shard->timers, &r->timer);
+}
+
+/**
+ * Timer callback for receivers; does whatever work is due and schedules
+ * the next wakeup.
+ * @param t the receiver timer
+ * @param now time value to use as 'now'
+ */
+static void rcvr_timer_fired(struct timer *t, struct timeval *now)
+{
+	struct receiver *r = t->data;
+	struct timeval diff;
+
+	rcvr_lock(r);
+	if(r->fd < 0 && r->reopen_at.tv_sec) {
+		timeval_diff(&r->reopen_at, now, &diff);
+		if(!timeval_positive(&diff))
+			rcvr_link_open(r, now);
+	}
+	rcvr_check_sleep(r, now);
+	rcvr_reschedule(r, now);
+	rcvr_unlock(r);
+}
+
+/**
+ * Take the lock protecting receiver state shared with the main thread. This
+ * is a no-op for receivers in the inline shard.
+ * @param r the receiver to lock
+ */
+void rcvr_lock(struct receiver *r)
+{
+	if(r->shard && r->shard->threaded)
+		pthread_mutex_lock(&r->lock);
+}
+
+void rcvr_unlock(struct receiver *r)
+{
+	if(r->shard && r->shard->threaded)
+		pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * Wake a worker shard out of its poll() call.
+ * @param sh the shard to wake
+ */
+static void shard_wake(struct shard *sh)
+{
+	if(__atomic_exchange_n(&sh->woken, 1, __ATOMIC_ACQ_REL) == 0) {
+		char c = 0;
+		xwrite(sh->wakeup[WRITE], &c, 1);
+	}
+}
+
+/**
+ * Let the shard owning a receiver know the receiver queue or timers have
+ * changed. Receivers in the inline shard are rescheduled right away; worker
+ * shards are woken up to reschedule the receiver on their own thread.
+ * @param r the receiver that changed
+ */
+void rcvr_changed(struct receiver *r)
+{
+	struct timeval now;
+
+	if(r->shard->threaded) {
+		__atomic_store_n(&r->dirty, 1, __ATOMIC_RELEASE);
+		shard_wake(r->shard);
+		return;
+	}
+	gettimeofday(&now, NULL);
+	rcvr_reschedule(r, &now);
+}
+
+/**
+ * Make sure a shard poll set has room for at least the given number of
+ * entries.
+ * @param sh the shard to grow
+ * @param count the number of entries needed
+ * @return 0 on success, -1 on allocation failure
+ */
+int shard_reserve(struct shard *sh, size_t count)
+{
+	struct pollfd *new_pollfds;
+	size_t new_size = sh->pollfd_size ? sh->pollfd_size : 16;
+
+	if(count <= sh->pollfd_size)
+		return 0;
+	while(new_size < count)
+		new_size *= 2;
+	new_pollfds = realloc(sh->pollfds, new_size * sizeof(struct pollfd));
+	if(!new_pollfds) {
+		perror("realloc()");
+		return -1;
+	}
+	sh->pollfds = new_pollfds;
+	sh->pollfd_size = new_size;
+	return 0;
+}
+
+/**
+ * Add a receiver to a shard, watching it in the shard epoll set if its link
+ * is already open.
+ * @param sh the shard to add the receiver to
+ * @param r the receiver to add
+ * @return 0 on success, -1 on allocation failure
+ */
+int shard_add(struct shard *sh, struct receiver *r)
+{
+	struct receiver **new_receivers;
+
+	new_receivers = realloc(sh->receivers,
+			(sh->receiver_count + 1) * sizeof(struct receiver *));
+	if(!new_receivers)
+		return -1;
+	sh->receivers = new_receivers;
+	if(sh->threaded && pthread_mutex_init(&r->lock, NULL) != 0)
+		return -1;
+
+	r->shard = sh;
+	r->events = 0;
+	timer_init(&r->timer, rcvr_timer_fired, r);
+	sh->receivers[sh->receiver_count++] = r;
+	if(r->fd > -1)
+		rcvr_watch(r, EPOLLIN);
+	return 0;
+}
+
+/**
+ * Handle the receivers in a shard that are ready, once poll() reports the
+ * shard epoll set readable. Only ready receivers are looked at, however
+ * many the shard has.
+ * @param sh the shard to handle
+ */
+void shard_process(struct shard *sh)
+{
+	struct epoll_event ready[SHARD_EVENTS];
+	int i, count;
+
+	count = epoll_wait(sh->epfd, ready, SHARD_EVENTS, 0);
+	for(i = 0; i < count; i++) {
+		struct receiver *r = ready[i].data.ptr;
+		unsigned int revents = ready[i].events;
+		struct timeval now;
+
+		rcvr_lock(r);
+		gettimeofday(&now, NULL);
+		/* check if we have a status message from the receivers; an error or
+		 * hangup shows up here as a failed read */
+		if(revents & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			if(process_incoming_message(r, logfd) == -2) {
+				rcvr_link_down(r, &now);
+				rcvr_reschedule(r, &now);
+				rcvr_unlock(r);
+				continue;
+			}
+		}
+		/* check if we have outgoing messages to send to receiver */
+		if((r->queue != NULL || r->out_len) && (revents & EPOLLOUT)) {
+			if(rcvr_send_command(r) == -2)
+				rcvr_link_down(r, &now);
+			gettimeofday(&now, NULL);
+			rcvr_reschedule(r, &now);
+		}
+		rcvr_unlock(r);
+	}
+}
+
+/**
+ * Wake the main loop to deliver what a worker shard has queued, unless it
+ * has been woken already and not drained since.
+ * @param sh the shard with queued messages
+ */
+static void shard_notify(struct shard *sh)
+{
+	if(__atomic_exchange_n(&sh->notified, 1, __ATOMIC_ACQ_REL) == 0) {
+		char c = 0;
+		xwrite(notifypipe[WRITE], &c, 1);
+	}
+}
+
+/**
+ * Move as many overflowed messages as fit into the outbox of a shard.
+ * @param sh the shard to move messages for
+ * @return 1 if every overflowed message was moved, 0 otherwise
+ */
+static int shard_overflow_move(struct shard *sh)
+{
+	struct status_ring *ring = &sh->outbox;
+	unsigned int tail = ring->tail;
+	size_t i = 0;
+
+	while(i < sh->overflow_count &&
+			tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) < RING_SIZE)
+		ring->msgs[tail++ % RING_SIZE] = sh->overflow[i++];
+	if(i) {
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		sh->overflow_count -= i;
+		memmove(sh->overflow, sh->overflow + i,
+				sh->overflow_count * sizeof(struct status_msg));
+		shard_notify(sh);
+	}
+	return sh->overflow_count == 0;
+}
+
+/**
+ * Hand a status message or group confirmation to the main thread if we are
+ * running on a worker shard thread. This never waits: we are called with
+ * the receiver lock held, which the main thread may be waiting on instead
+ * of draining the outbox. When the outbox is full, the message is kept in
+ * the shard overflow until shard_flush() is called without any lock held.
+ * @param r the receiver the message came from
+ * @param g the group confirmed, NULL for a status message
+ * @param latency the group confirmation latency in milliseconds
+ * @param msg the status message, NULL for a group confirmation
+ * @return 1 if the message was queued for the main thread, 0 if the caller
+ * should deliver it directly
+ */
+int shard_offload(struct receiver *r, struct group *g, long latency,
+		const char *msg)
+{
+	struct shard *sh = r->shard;
+	struct status_ring *ring;
+	struct status_msg *m;
+	unsigned int tail;
+	int overflowed;
+
+	if(!sh || !sh->threaded || !pthread_equal(pthread_self(), sh->thread))
+		return 0;
+
+	/* keep messages in order behind anything already overflowed */
+	if(sh->overflow_count)
+		shard_overflow_move(sh);
+	ring = &sh->outbox;
+	tail = ring->tail;
+	overflowed = sh->overflow_count ||
+		tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE;
+	if(overflowed) {
+		if(sh->overflow_count == sh->overflow_size) {
+			size_t size = sh->overflow_size ? sh->overflow_size * 2 : RING_SIZE;
+			struct status_msg *overflow = realloc(sh->overflow,
+					size * sizeof(struct status_msg));
+			if(!overflow) {
+				perror("realloc()");
+				return 1;
+			}
+			sh->overflow = overflow;
+			sh->overflow_size = size;
+		}
+		m = &sh->overflow[sh->overflow_count++];
+	} else {
+		m = &ring->msgs[tail % RING_SIZE];
+	}
+
+	m->rcvr = r;
+	m->group = g;
+	m->latency = latency;
+	if(msg)
+		snprintf(m->msg, sizeof(m->msg), "%s", msg);
+	else
+		m->msg[0] = '\0';
+	if(!overflowed) {
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+		shard_notify(sh);
+	}
+	return 1;
+}
+
+/**
+ * Wait for the main thread to take every overflowed message of a worker
+ * shard. This must only be called from the shard thread while it holds no
+ * receiver lock, so the main thread is always free to drain the outbox.
+ * @param sh the shard to flush
+ */
+static void shard_flush(struct shard *sh)
+{
+	while(!shard_overflow_move(sh)) {
+		if(__atomic_load_n(&sh->quit, __ATOMIC_ACQUIRE))
+			return;
+		shard_notify(sh);
+		sched_yield();
+	}
+}
+
+/**
+ * Deliver everything the worker shards have queued for the main thread.
+ * This should be called from the main thread when the notify descriptor is
+ * readable.
+ * @param shards the array of worker shards
+ * @param count the number of worker shards
+ */
+void shard_drain(struct shard *shards, size_t count)
+{
+	char buf[64];
+	size_t i;
+
+	/* empty the pipe; flags below tell us which shards have messages */
+	while(read(notifypipe[READ], buf, sizeof(buf)) == sizeof(buf))
+		;
+	for(i = 0; i < count; i++) {
+		struct shard *sh = &shards[i];
+		struct status_ring *ring = &sh->outbox;
+		unsigned int head = ring->head, tail;
+
+		/* clear the flag first so a message queued while we drain will
+		 * notify us again */
+		__atomic_store_n(&sh->notified, 0, __ATOMIC_RELEASE);
+		/* only take what is there now; a busy shard could otherwise keep
+		 * us from ever getting back to our clients */
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		while(head != tail) {
+			struct status_msg *m = &ring->msgs[head % RING_SIZE];
+			shard_deliver(m->rcvr, m->group, m->latency, m->msg);
+			head++;
+			__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/**
+ * Get the descriptor the main loop should watch for messages from worker
+ * shards.
+ * @return the notify descriptor, -1 if no worker shards were set up
+ */
+int shard_notify_fd(void)
+{
+	return notifypipe[READ];
+}
+
+/**
+ * Event loop run by each worker shard thread. This is the threaded
+ * counterpart of the receiver handling in the main loop.
+ * @param arg the shard to run
+ */
+static void *shard_main(void *arg)
+{
+	struct shard *sh = arg;
+	struct timeval now;
+	/* nothing applied yet; -1 already means leave the slack alone */
+	long timerslack_applied = -2;
+	size_t i;
+
+	shard_apply_realtime();
+
+	/* receivers queued commands before we started; schedule them all */
+	gettimeofday(&now, NULL);
+	for(i = 0; i < sh->receiver_count; i++) {
+		struct receiver *r = sh->receivers[i];
+		__atomic_store_n(&r->dirty, 0, __ATOMIC_RELEASE);
+		rcvr_lock(r);
+		rcvr_reschedule(r, &now);
+		rcvr_unlock(r);
+	}
+
+	while(!__atomic_load_n(&sh->quit, __ATOMIC_ACQUIRE)) {
+		int retval, timeout = -1;
+		struct timeval timeoutval;
+
+		shard_apply_timerslack(&timerslack_applied);
+		gettimeofday(&now, NULL);
+		timer_run(&sh->timers, &now);
+		shard_flush(sh);
+
+		if(timer_next(&sh->timers, &now, &timeoutval)) {
+			/* round up so we don't wake just before a timer is due */
+			timeout = (int)(timeoutval.tv_sec * 1000 +
+					(timeoutval.tv_usec + 999) / 1000);
+		}
+		retval = poll(sh->pollfds, 2, timeout);
+		__atomic_add_fetch(&sh->wakeups, 1, __ATOMIC_RELAXED);
+		if(retval == -1 && errno == EINTR)
+			continue;
+		if(retval == -1) {
+			perror("poll()");
+			break;
+		}
+
+		if(sh->pollfds[0].revents) {
+			char buf[64];
+			__atomic_store_n(&sh->woken, 0, __ATOMIC_RELEASE);
+			while(read(sh->wakeup[READ], buf, sizeof(buf)) == sizeof(buf))
+				;
+			/* pick up receivers the main thread has changed */
+			gettimeofday(&now, NULL);
+			for(i = 0; i < sh->receiver_count; i++) {
+				struct receiver *r = sh->receivers[i];
+				if(!__atomic_exchange_n(&r->dirty, 0, __ATOMIC_ACQ_REL))
+					continue;
+				rcvr_lock(r);
+				rcvr_reschedule(r, &now);
+				rcvr_unlock(r);
+			}
+		}
+		if(sh->pollfds[1].revents)
+			shard_process(sh);
+		shard_flush(sh);
+	}
+	return NULL;
+}
+
+/**
+ * Set up worker shards so receivers can be added to them. The threads are
+ * not started until shard_start() is called.
+ * @param shards the array of shards to set up
+ * @param count the number of shards
+ * @return 0 on success, -1 on failure
+ */
+int shard_init(struct shard *shards, size_t count)
+{
+	size_t i;
+
+	if(pipe(notifypipe) == -1) {
+		perror("pipe()");
+		return -1;
+	}
+	fcntl(notifypipe[READ], F_SETFL, O_NONBLOCK);
+	fcntl(notifypipe[WRITE], F_SETFL, O_NONBLOCK);
+
+	for(i = 0; i < count; i++) {
+		memset(&shards[i], 0, sizeof(struct shard));
+		shards[i].epfd = -1;
+	}
+	for(i = 0; i < count; i++) {
+		struct shard *sh = &shards[i];
+		sh->threaded = 1;
+		sh->outbox.msgs = calloc(RING_SIZE, sizeof(struct status_msg));
+		if(!sh->outbox.msgs || shard_init_inline(sh) == -1)
+			return -1;
+		if(pipe(sh->wakeup) == -1) {
+			perror("pipe()");
+			return -1;
+		}
+		fcntl(sh->wakeup[READ], F_SETFL, O_NONBLOCK);
+		fcntl(sh->wakeup[WRITE], F_SETFL, O_NONBLOCK);
+		sh->pollfds[0].fd = sh->wakeup[READ];
+		sh->pollfds[0].events = POLLIN;
+	}
+	return 0;
+}
+
+/**
+ * Set up the epoll set of a shard and the poll slot that watches it. The
+ * shard run inline by the main loop only needs this; worker shards get it
+ * from shard_init().
+ * @param sh the shard to set up
+ * @return 0 on success, -1 on failure
+ */
+int shard_init_inline(struct shard *sh)
+{
+	sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(sh->epfd == -1) {
+		perror("epoll_create1()");
+		return -1;
+	}
+	if(shard_reserve(sh, 2) == -1)
+		return -1;
+	sh->pollfds[1].fd = sh->epfd;
+	sh->pollfds[1].events = POLLIN;
+	return 0;
+}
+
+/**
+ * Start the threads for worker shards. Signals are blocked in the worker
+ * threads so they are always handled by the main loop.
+ * @param shards the array of shards to start
+ * @param count the number of shards
+ * @return 0 on success, -1 on failure
+ */
+int shard_start(struct shard *shards, size_t count)
+{
+	sigset_t all, old;
+	size_t i;
+	int ret = 0;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for(i = 0; i < count; i++) {
+		if(pthread_create(&shards[i].thread, NULL, shard_main, &shards[i])) {
+			perror("pthread_create()");
+			ret = -1;
+			break;
+		}
+		shards[i].running = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return ret;
+}
+
+/**
+ * Stop the thread of a worker shard, if it is running, and wait for it.
+ * @param sh the shard to stop
+ */
+static void shard_join(struct shard *sh)
+{
+	if(!sh->running)
+		return;
+	__atomic_store_n(&sh->quit, 1, __ATOMIC_RELEASE);
+	shard_wake(sh);
+	pthread_join(sh->thread, NULL);
+	sh->running = 0;
+}
+
+/**
+ * Keep worker shards from touching their receivers, e.g. while receiver
+ * state is handed to another process, by stopping their threads. What the
+ * threads left in their outboxes is delivered once they are gone, so no
+ * receiver lock is held while status messages are written.
+ * @param shards the array of worker shards
+ * @param count the number of worker shards
+ */
+void shard_pause(struct shard *shards, size_t count)
+{
+	size_t i, j;
+
+	for(i = 0; i < count; i++)
+		shard_join(&shards[i]);
+	shard_drain(shards, count);
+	/* the overflow is behind the ring, so it goes out last */
+	for(i = 0; i < count; i++) {
+		struct shard *sh = &shards[i];
+		for(j = 0; j < sh->overflow_count; j++) {
+			struct status_msg *m = &sh->overflow[j];
+			shard_deliver(m->rcvr, m->group, m->latency, m->msg);
+		}
+		sh->overflow_count = 0;
+	}
+}
+
+/**
+ * Let worker shards carry on after shard_pause() by starting their threads
+ * again. The threads reschedule all of their receivers when they start.
+ * @param shards the array of worker shards
+ * @param count the number of worker shards
+ */
+void shard_resume(struct shard *shards, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++)
+		__atomic_store_n(&shards[i].quit, 0, __ATOMIC_RELEASE);
+	shard_start(shards, count);
+}
+
+/**
+ * Stop worker shard threads and free shard resources. Receivers themselves
+ * are owned and freed by the caller.
+ * @param shards the array of shards to stop
+ * @param count the number of shards
+ */
+void shard_stop(struct shard *shards, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++)
+		shard_join(&shards[i]);
+	for(i = 0; i < count; i++) {
+		struct shard *sh = &shards[i];
+		if(sh->wakeup[READ] > -1 && sh->threaded) {
+			xclose(sh->wakeup[READ]);
+			xclose(sh->wakeup[WRITE]);
+		}
+		if(sh->epfd > -1) {
+			xclose(sh->epfd);
+			sh->epfd = -1;
+		}
+		free(sh->receivers);
+		free(sh->pollfds);
+		free(sh->timers.timers);
+		free(sh->outbox.msgs);
+		free(sh->overflow);
+	}
+	if(notifypipe[READ] > -1) {
+		xclose(notifypipe[READ]);
+		xclose(notifypipe[WRITE]);
+		notifypipe[READ] = notifypipe[WRITE] = -1;
+	}
+}
+
+/* vim: set ts=4 sw=4 noet: */
@@ -0,0 +1,649 @@
+/*
+ *  state.c - Onkyo receiver state cache and replication journal
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The state cache holds the last status message seen for every field of
+ * every receiver, e.g. "OK:volume:30\n" for field "volume". It is fed from
+ * the main thread as status messages are delivered to clients.
+ *
+ * Every change to the cache is also written to the state journal, a UNIX
+ * socket a standby daemon can subscribe to. A new subscriber first gets the
+ * full cache, then each change as it happens, one "<receiver> <message>"
+ * line at a time. This keeps the standby cache warm so it can serve
+ * snapshots right away if it has to take over from the primary. Writes to
+ * subscribers never block; a standby that stops reading has its output
+ * buffered up to JOURNAL_BACKLOG, then it is dropped and gets the full
+ * cache again when it subscribes again. The tiny build leaves the journal
+ * out.
+ */
+
+#define _XOPEN_SOURCE 600 /* strdup */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h> /* struct timeval */
+#include <unistd.h>
+
+#include "onkyo.h"
+
+/** Number of hash buckets in the state cache */
+#define STATE_BUCKETS 256
+
+/** hash buckets of cache entries, chained through bucket_next */
+static struct state_entry *buckets[STATE_BUCKETS];
+/** all cache entries in the order they were first seen */
+static struct state_entry *entries = NULL;
+static struct state_entry *entries_tail = NULL;
+
+/** journal listening socket and its path */
+static int journal_listener = -1;
+static char *journal_path = NULL;
+/** A standby daemon subscribed to the journal */
+struct subscriber {
+	int fd;
+	/** journal output the standby has not taken yet */
+	char *out;
+	size_t out_len;
+};
+
+/** standby daemons subscribed to the journal */
+static struct subscriber *subscribers = NULL;
+static size_t subscriber_count = 0;
+#ifndef TINY
+/** partial line buffer for a standby reading the journal */
+static char journal_buf[BUF_SIZE * 4];
+static size_t journal_buf_len = 0;
+#endif
+
+/**
+ * Hash a receiver name and field name pair for the cache.
+ * @param rcvr the receiver name
+ * @param field the field name
+ * @return the combined hash value
+ */
+static unsigned long state_hash(const char *rcvr, const char *field)
+{
+	return hash_sdbm(field) * 31 + hash_sdbm(rcvr);
+}
+
+/**
+ * Pull the field name out of a status message, e.g. "volume" out of
+ * "OK:volume:30\n". Only messages describing receiver state are cached;
+ * errors, group confirmations, and unknown messages are not.
+ * @param msg the status message
+ * @param field location to store the field name
+ * @param len the size of field
+ * @return 0 if the message describes receiver state, -1 otherwise
+ */
+int state_field(const char *msg, char *field, size_t len)
+{
+	const char *start, *end;
+
+	if(strncmp(msg, "OK:", 3) != 0)
+		return -1;
+	start = msg + 3;
+	end = strchr(start, ':');
+	if(!end || end == start || (size_t)(end - start) >= len)
+		return -1;
+	memcpy(field, start, (size_t)(end - start));
+	field[end - start] = '\0';
+	if(strcmp(field, "group") == 0 || strcmp(field, "todo") == 0
+			|| strcmp(field, "snapshot") == 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Look up the cached state of a receiver field.
+ * @param rcvr the receiver name
+ * @param field the field name, e.g. "volume"
+ * @return the cache entry, NULL if nothing is cached for the field
+ */
+struct state_entry *state_lookup(const char *rcvr, const char *field)
+{
+	unsigned long hashval = state_hash(rcvr, field);
+	struct state_entry *e;
+
+	for(e = buckets[hashval % STATE_BUCKETS]; e; e = e->bucket_next) {
+		if(e->hash == hashval && strcmp(e->field, field) == 0
+				&& strcmp(e->rcvr, rcvr) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/**
+ * Get the first entry in the state cache. Entries are linked through their
+ * next pointer in the order they were first seen.
+ * @return the first cache entry, NULL if the cache is empty
+ */
+struct state_entry *state_entries(void)
+{
+	return entries;
+}
+
+/**
+ * Write a journal line to a single subscriber. Whatever the subscriber does
+ * not take right away is buffered, up to JOURNAL_BACKLOG.
+ * @param sub the subscriber
+ * @param rcvr the receiver name
+ * @param msg the status message, including trailing newline
+ * @return 0 on success, -1 on failure or if the subscriber fell too far
+ * behind
+ */
+static int journal_write(struct subscriber *sub, const char *rcvr,
+		const char *msg)
+{
+	char buf[BUF_SIZE * 2], *out;
+	size_t pos = 0;
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%s %s", rcvr, msg);
+	if(len < 0 || (size_t)len >= sizeof(buf))
+		return -1;
+	if(!sub->out_len) {
+		ssize_t count = write(sub->fd, buf, (size_t)len);
+		if(count == len)
+			return 0;
+		if(count == -1 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		if(count > 0)
+			pos = (size_t)count;
+	}
+	if(sub->out_len + ((size_t)len - pos) > JOURNAL_BACKLOG)
+		return -1;
+	out = realloc(sub->out, sub->out_len + ((size_t)len - pos));
+	if(!out)
+		return -1;
+	memcpy(out + sub->out_len, buf + pos, (size_t)len - pos);
+	sub->out = out;
+	sub->out_len += (size_t)len - pos;
+	return 0;
+}
+
+/**
+ * Disconnect a subscriber. A dropped standby will find the primary still
+ * listening and subscribe again.
+ * @param i the index of the subscriber
+ */
+static void subscriber_drop(size_t i)
+{
+	fprintf(stderr, "dropping state journal subscriber\n");
+	xclose(subscribers[i].fd);
+	free(subscribers[i].out);
+	subscribers[i] = subscribers[--subscriber_count];
+}
+
+/**
+ * Write a journal line to every subscriber, dropping any that fail or have
+ * fallen too far behind.
+ * @param rcvr the receiver name
+ * @param msg the status message, including trailing newline
+ */
+static void journal_publish(const char *rcvr, const char *msg)
+{
+	size_t i = 0;
+
+	while(i < subscriber_count) {
+		if(journal_write(&subscribers[i], rcvr, msg) == -1) {
+			subscriber_drop(i);
+			continue;
+		}
+		i++;
+	}
+}
+
+/**
+ * Note a status message for a receiver in the state cache. Messages that
+ * change the cached state are also written to the state journal.
+ * @param rcvr the receiver name
+ * @param msg the status message, including trailing newline
+ * @return 1 if the cached state changed, 0 if it did not, -1 if the
+ * message does not describe receiver state
+ */
+int state_update(const char *rcvr, const char *msg)
+{
+	char field[64];
+	struct state_entry *e;
+
+	if(!rcvr || state_field(msg, field, sizeof(field)) == -1)
+		return -1;
+	if(strlen(msg) >= sizeof(e->msg))
+		return -1;
+
+	e = state_lookup(rcvr, field);
+	if(e) {
+		gettimeofday(&e->updated, NULL);
+		if(strcmp(e->msg, msg) == 0)
+			return 0;
+	} else {
+		e = calloc(1, sizeof(struct state_entry));
+		if(!e)
+			return -1;
+		e->rcvr = strdup(rcvr);
+		e->field = strdup(field);
+		if(!e->rcvr || !e->field) {
+			free(e->rcvr);
+			free(e->field);
+			free(e);
+			return -1;
+		}
+		e->hash = state_hash(rcvr, field);
+		e->bucket_next = buckets[e->hash % STATE_BUCKETS];
+		buckets[e->hash % STATE_BUCKETS] = e;
+		if(entries_tail)
+			entries_tail->next = e;
+		else
+			entries = e;
+		entries_tail = e;
+		gettimeofday(&e->updated, NULL);
+	}
+	strcpy(e->msg, msg);
+	e->changed = e->updated;
+
+	journal_publish(rcvr, msg);
+	return 1;
+}
+
+/**
+ * Free everything in the state cache.
+ */
+void state_clear(void)
+{
+	while(entries) {
+		struct state_entry *e = entries;
+		entries = e->next;
+		free(e->rcvr);
+		free(e->field);
+		free(e);
+	}
+	entries_tail = NULL;
+	memset(buckets, 0, sizeof(buckets));
+}
+
+#ifndef TINY
+/**
+ * Fill in a UNIX socket address for the journal.
+ * @param addr the address to fill in
+ * @param path the socket path
+ * @return 0 on success, -1 if the path is too long
+ */
+static int journal_addr(struct sockaddr_un *addr, const char *path)
+{
+	if(strlen(path) > sizeof(addr->sun_path) - 1) {
+		fprintf(stderr, "journal socket path too long\n");
+		return -1;
+	}
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
+	return 0;
+}
+
+/**
+ * Start serving the state journal on a UNIX socket. A stale socket left
+ * behind by a primary we are taking over from is replaced.
+ * @param path the socket path
+ * @return the listening descriptor, -1 on failure
+ */
+int journal_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(journal_addr(&addr, path) == -1)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1) {
+		perror("socket()");
+		return -1;
+	}
+	unlink(path);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) != 0) {
+		perror("bind()");
+		xclose(fd);
+		return -1;
+	}
+	if(listen(fd, 4) != 0) {
+		perror("listen()");
+		xclose(fd);
+		return -1;
+	}
+	journal_path = strdup(path);
+	journal_listener = fd;
+	return fd;
+}
+#endif
+
+/**
+ * Get the journal listening descriptor.
+ * @return the descriptor, -1 if we are not serving a journal
+ */
+int journal_fd(void)
+{
+	return journal_listener;
+}
+
+#ifndef TINY
+/**
+ * Accept a standby subscribing to the journal and send it the full state
+ * cache. Changes from then on are sent as they happen.
+ */
+void journal_accept(void)
+{
+	struct subscriber *new_subscribers, *sub;
+	struct state_entry *e;
+	int fd;
+
+	fd = accept(journal_listener, NULL, NULL);
+	if(fd == -1) {
+		if(errno != EAGAIN && errno != EINTR)
+			perror("accept()");
+		return;
+	}
+	new_subscribers = realloc(subscribers,
+			(subscriber_count + 1) * sizeof(struct subscriber));
+	if(!new_subscribers) {
+		xclose(fd);
+		return;
+	}
+	subscribers = new_subscribers;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	sub = &subscribers[subscriber_count++];
+	sub->fd = fd;
+	sub->out = NULL;
+	sub->out_len = 0;
+
+	for(e = entries; e; e = e->next) {
+		if(journal_write(sub, e->rcvr, e->msg) == -1) {
+			subscriber_drop(subscriber_count - 1);
+			return;
+		}
+	}
+	printf("state journal subscriber connected\n");
+}
+
+/**
+ * Count the subscribers with buffered journal output.
+ * @return the number of subscribers journal_poll() would add
+ */
+size_t journal_pending(void)
+{
+	size_t i, count = 0;
+
+	for(i = 0; i < subscriber_count; i++) {
+		if(subscribers[i].out_len)
+			count++;
+	}
+	return count;
+}
+
+/**
+ * Add a poll entry for every subscriber with buffered journal output, so we
+ * wake up when it can take more.
+ * @param pollfds where to add the entries; there must be room for one per
+ * subscriber
+ * @return the number of entries added
+ */
+size_t journal_poll(struct pollfd *pollfds)
+{
+	size_t i, count = 0;
+
+	for(i = 0; i < subscriber_count; i++) {
+		if(!subscribers[i].out_len)
+			continue;
+		pollfds[count].fd = subscribers[i].fd;
+		pollfds[count].events = POLLOUT;
+		pollfds[count].revents = 0;
+		count++;
+	}
+	return count;
+}
+
+/**
+ * Write out as much buffered journal output as a subscriber will take
+ * without blocking.
+ * @param sub the subscriber
+ * @return 0 on success, -1 if the subscriber failed
+ */
+static int subscriber_flush(struct subscriber *sub)
+{
+	while(sub->out_len) {
+		ssize_t count = write(sub->fd, sub->out, sub->out_len);
+		if(count == -1 && errno == EINTR)
+			continue;
+		if(count == -1 && errno == EAGAIN)
+			return 0;
+		if(count <= 0)
+			return -1;
+		sub->out_len -= (size_t)count;
+		memmove(sub->out, sub->out + count, sub->out_len);
+	}
+	free(sub->out);
+	sub->out = NULL;
+	return 0;
+}
+
+/**
+ * Write out buffered journal output to every subscriber that will take it,
+ * dropping any that fail.
+ */
+void journal_flush(void)
+{
+	size_t i = 0;
+
+	while(i < subscriber_count) {
+		if(subscriber_flush(&subscribers[i]) == -1) {
+			subscriber_drop(i);
+			continue;
+		}
+		i++;
+	}
+}
+
+/**
+ * Subscribe to the state journal of a primary daemon.
+ * @param path the journal socket path
+ * @return the subscribed descriptor, -1 if no primary is listening
+ */
+int journal_subscribe(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(journal_addr(&addr, path) == -1)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1) {
+		perror("socket()");
+		return -1;
+	}
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) != 0) {
+		xclose(fd);
+		return -1;
+	}
+	journal_buf_len = 0;
+	return fd;
+}
+
+/**
+ * Read whatever the primary has written to the journal and apply it to our
+ * state cache.
+ * @param fd the subscribed descriptor
+ * @return 0 on success, -1 if the primary closed the journal
+ */
+int journal_receive(int fd)
+{
+	ssize_t count;
+	char *start, *nl;
+
+	count = xread(fd, journal_buf + journal_buf_len,
+			sizeof(journal_buf) - journal_buf_len - 1);
+	if(count <= 0)
+		return -1;
+	journal_buf_len += (size_t)count;
+	journal_buf[journal_buf_len] = '\0';
+
+	start = journal_buf;
+	while((nl = strchr(start, '\n'))) {
+		char *msg = strchr(start, ' ');
+		char saved = nl[1];
+		if(msg && msg < nl) {
+			*msg++ = '\0';
+			/* keep the newline as part of the message */
+			nl[1] = '\0';
+			state_update(start, msg);
+			nl[1] = saved;
+		}
+		start = nl + 1;
+	}
+	journal_buf_len -= (size_t)(start - journal_buf);
+	memmove(journal_buf, start, journal_buf_len);
+	/* a line longer than our buffer is garbage; drop it */
+	if(journal_buf_len == sizeof(journal_buf) - 1)
+		journal_buf_len = 0;
+	return 0;
+}
+#endif
+
+/**
+ * Stop serving the state journal and disconnect any subscribers.
+ */
+void journal_close(void)
+{
+	size_t i;
+
+	for(i = 0; i < subscriber_count; i++) {
+		xclose(subscribers[i].fd);
+		free(subscribers[i].out);
+	}
+	free(subscribers);
+	subscribers = NULL;
+	subscriber_count = 0;
+	if(journal_listener > -1) {
+		xclose(journal_listener);
+		journal_listener = -1;
+		unlink(journal_path);
+	}
+	free(journal_path);
+	journal_path = NULL;
+}
+
+#ifndef TINY
+/**
+ * Hand the state cache and journal over to a new instance of the daemon in
+ * a live upgrade. Each cache entry is sent as an "S" record, the journal
+ * listener as a "J" record and each subscriber as a "j" record. Subscribers
+ * still waiting on buffered output are left out, as the new instance could
+ * not finish the line they are in the middle of; they subscribe again.
+ * @param sock the handoff socket
+ * @return 0 on success, -1 on failure
+ */
+int state_handoff(int sock)
+{
+	struct state_entry *e;
+	size_t i;
+
+	for(e = entries; e; e = e->next) {
+		if(upgrade_send(sock, -1, "S %ld %ld %ld %ld %s %s",
+					(long)e->updated.tv_sec, (long)e->updated.tv_usec,
+					(long)e->changed.tv_sec, (long)e->changed.tv_usec,
+					e->rcvr, e->msg) == -1)
+			return -1;
+	}
+	if(journal_listener > -1 &&
+			upgrade_send(sock, journal_listener, "J %s", journal_path) == -1)
+		return -1;
+	for(i = 0; i < subscriber_count; i++) {
+		if(subscribers[i].out_len)
+			continue;
+		if(upgrade_send(sock, subscribers[i].fd, "j") == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Take over a state cache entry, the journal listener, or a journal
+ * subscriber from a handoff record written by state_handoff(). Cache
+ * entries keep the times they were originally updated and changed.
+ * @param record the handoff record
+ * @param fd the descriptor passed with the record, -1 if none
+ * @return 0 on success, -1 on an invalid record
+ */
+int state_adopt(char *record, int fd)
+{
+	if(record[0] == 'S') {
+		struct timeval updated, changed;
+		struct state_entry *e;
+		char field[64], *rcvr, *msg;
+		long vals[4];
+		int pos = 0;
+
+		if(sscanf(record, "S %ld %ld %ld %ld %n", &vals[0], &vals[1],
+					&vals[2], &vals[3], &pos) != 4 || pos == 0)
+			return -1;
+		rcvr = record + pos;
+		msg = strchr(rcvr, ' ');
+		if(!msg)
+			return -1;
+		*msg++ = '\0';
+		if(state_update(rcvr, msg) == -1 ||
+				state_field(msg, field, sizeof(field)) == -1)
+			return -1;
+		e = state_lookup(rcvr, field);
+		updated.tv_sec = vals[0];
+		updated.tv_usec = vals[1];
+		changed.tv_sec = vals[2];
+		changed.tv_usec = vals[3];
+		e->updated = updated;
+		e->changed = changed;
+		return 0;
+	} else if(record[0] == 'J' && record[1] == ' ' && fd > -1) {
+		journal_path = strdup(record + 2);
+		journal_listener = fd;
+		return 0;
+	} else if(record[0] == 'j' && fd > -1) {
+		struct subscriber *new_subscribers = realloc(subscribers,
+				(subscriber_count + 1) * sizeof(struct subscriber));
+		if(!new_subscribers) {
+			xclose(fd);
+			return -1;
+		}
+		subscribers = new_subscribers;
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		subscribers[subscriber_count].fd = fd;
+		subscribers[subscriber_count].out = NULL;
+		subscribers[subscriber_count].out_len = 0;
+		subscriber_count++;
+		return 0;
+	}
+	return -1;
+}
+#endif
+
+/* vim: set ts=4 sw=4 noet: */
@@ -0,0 +1,210 @@
+/*
+ *  timer.c - Onkyo receiver timer handling
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h> /* struct timeval */
+
+#include "onkyo.h"
+
+/**
+ * Compare the expiry times of two timers.
+ * @return non-zero if a expires before b
+ */
+static int timer_before(const struct timer *a, const struct timer *b)
+{
+	if(a->when.tv_sec != b->when.tv_sec)
+		return a->when.tv_sec < b->when.tv_sec;
+	return a->when.tv_usec < b->when.tv_usec;
+}
+
+static void timer_place(struct timer_heap *heap, struct timer *t, size_t slot)
+{
+	heap->timers[slot] = t;
+	t->slot = slot;
+}
+
+static void timer_sift_up(struct timer_heap *heap, size_t slot)
+{
+	struct timer *t = heap->timers[slot];
+	while(slot > 0) {
+		size_t parent = (slot - 1) / 2;
+		if(!timer_before(t, heap->timers[parent]))
+			break;
+		timer_place(heap, heap->timers[parent], slot);
+		slot = parent;
+	}
+	timer_place(heap, t, slot);
+}
+
+static void timer_sift_down(struct timer_heap *heap, size_t slot)
+{
+	struct timer *t = heap->timers[slot];
+	for(;;) {
+		size_t child = slot * 2 + 1;
+		if(child >= heap->count)
+			break;
+		if(child + 1 < heap->count &&
+				timer_before(heap->timers[child + 1], heap->timers[child]))
+			child++;
+		if(!timer_before(heap->timers[child], t))
+			break;
+		timer_place(heap, heap->timers[child], slot);
+		slot = child;
+	}
+	timer_place(heap, t, slot);
+}
+
+/**
+ * Initialize a timer so it can be armed in a timer heap.
+ * @param t the timer to initialize
+ * @param fire the callback to run when the timer expires
+ * @param data user data available to the callback
+ */
+void timer_init(struct timer *t, timer_cb *fire, void *data)
+{
+	timeval_clear(t->when);
+	t->slot = TIMER_IDLE;
+	t->fire = fire;
+	t->data = data;
+}
+
+/**
+ * Arm a timer to fire at the given time. If the timer is already armed,
+ * it is simply moved to its new position in the heap.
+ * @param heap the heap to arm the timer in
+ * @param t the timer to arm
+ * @param when the absolute time the timer should fire at
+ * @return 0 on success, -1 if the heap could not be grown
+ */
+int timer_arm(struct timer_heap *heap, struct timer *t, struct timeval when)
+{
+	if(t->slot != TIMER_IDLE) {
+		t->when = when;
+		timer_sift_up(heap, t->slot);
+		timer_sift_down(heap, t->slot);
+		return 0;
+	}
+
+	if(heap->count == heap->size) {
+		size_t new_size = heap->size ? heap->size * 2 : 16;
+		struct timer **new_timers = realloc(heap->timers,
+				new_size * sizeof(struct timer *));
+		if(!new_timers) {
+			perror("realloc()");
+			return -1;
+		}
+		heap->timers = new_timers;
+		heap->size = new_size;
+	}
+	t->when = when;
+	timer_place(heap, t, heap->count++);
+	timer_sift_up(heap, t->slot);
+	return 0;
+}
+
+/**
+ * Remove a timer from the heap so it will not fire. This is a no-op for a
+ * timer that is not armed.
+ * @param heap the heap the timer was armed in
+ * @param t the timer to disarm
+ */
+void timer_disarm(struct timer_heap *heap, struct timer *t)
+{
+	size_t slot = t->slot;
+	struct timer *moved;
+
+	if(slot == TIMER_IDLE)
+		return;
+
+	t->slot = TIMER_IDLE;
+	heap->count--;
+	if(slot == heap->count)
+		return;
+	/* move the last timer into the hole and restore the heap order */
+	moved = heap->timers[heap->count];
+	timer_place(heap, moved, slot);
+	timer_sift_up(heap, slot);
+	timer_sift_down(heap, moved->slot);
+}
+
+/**
+ * Fire all timers that have expired. Each timer is disarmed before its
+ * callback runs, so callbacks are free to rearm it.
+ * @param heap the heap to run timers from
+ * @param now time value to use as 'now'
+ * @return the number of timers that fired
+ */
+unsigned int timer_run(struct timer_heap *heap, struct timeval *now)
+{
+	unsigned int fired = 0;
+	while(heap->count > 0) {
+		struct timer *t = heap->timers[0];
+		struct timeval diff;
+		timeval_diff(&t->when, now, &diff);
+		if(timeval_positive(&diff))
+			break;
+		timer_disarm(heap, t);
+		t->fire(t, now);
+		fired++;
+	}
+	return fired;
+}
+
+/**
+ * Push a time that can wait back to the next multiple of a slack interval,
+ * counted from the epoch. Deadlines that don't need to be exact are armed
+ * at such aligned times, so those of every receiver land in the same few
+ * wakeup slots rather than each waking us on its own phase.
+ * @param when the time to align
+ * @param slack the slack interval in milliseconds, 0 to leave it as is
+ * @return the aligned time, never before when
+ */
+struct timeval timer_align(struct timeval when, long slack)
+{
+	long long ms;
+
+	if(slack <= 0)
+		return when;
+	ms = (long long)when.tv_sec * 1000 + (when.tv_usec + 999) / 1000;
+	ms = (ms + slack - 1) / slack * slack;
+	when.tv_sec = (time_t)(ms / 1000);
+	when.tv_usec = (suseconds_t)(ms % 1000) * 1000;
+	return when;
+}
+
+/**
+ * Determine how long until the next timer in the heap expires.
+ * @param heap the heap to look at
+ * @param now time value to use as 'now'
+ * @param timeout location to store the time until the next expiry
+ * @return 1 if a timer is armed (and timeout is set), 0 otherwise
+ */
+int timer_next(struct timer_heap *heap, struct timeval * restrict now,
+		struct timeval * restrict timeout)
+{
+	if(heap->count == 0)
+		return 0;
+	timeval_diff(&heap->timers[0]->when, now, timeout);
+	if(!timeval_positive(timeout))
+		timeval_clear(*timeout);
+	return 1;
+}
+
+/* vim: set ts=4 sw=4 noet: */
@@ -0,0 +1,261 @@
+/*
+ *  upgrade.c - Onkyo receiver daemon live binary upgrade
+ *
+ *  Copyright (c) 2008-2010 Dan McGee <dpmcgee@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A live upgrade starts a new instance of the daemon binary connected to
+ * the running one by a socket pair. The running daemon then sends over its
+ * state as a series of records, one per packet. A record is a line of text
+ * and may carry a single descriptor (listener, serial device, connection)
+ * passed with SCM_RIGHTS. The new instance acknowledges the last record
+ * once it has taken everything over, and the old instance exits.
+ */
+
+#define _GNU_SOURCE 1 /* vsnprintf, SOCK_SEQPACKET */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "onkyo.h"
+
+/**
+ * Start a new instance of the daemon to hand our state to. The new instance
+ * gets every argument we were started with plus --upgrade-fd, naming its
+ * end of the socket pair; it inherits no other descriptors.
+ * @param exe the path of the daemon binary to run
+ * @param argv our original, NULL-terminated argument list
+ * @return our end of the socket pair, -1 on failure
+ */
+int upgrade_spawn(const char *exe, char * const argv[])
+{
+	int sv[2], maxfd, fd;
+	size_t argc = 0, i, j;
+	char **new_argv;
+	char fdarg[32];
+	pid_t pid;
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+		perror("socketpair()");
+		return -1;
+	}
+
+	while(argv[argc])
+		argc++;
+	new_argv = calloc(argc + 2, sizeof(char *));
+	if(!new_argv) {
+		xclose(sv[0]);
+		xclose(sv[1]);
+		return -1;
+	}
+	/* drop the option from any upgrade that started us */
+	for(i = 0, j = 0; i < argc; i++) {
+		if(strncmp(argv[i], "--upgrade-fd", 12) != 0)
+			new_argv[j++] = argv[i];
+	}
+	snprintf(fdarg, sizeof(fdarg), "--upgrade-fd=%d", sv[1]);
+	new_argv[j++] = fdarg;
+	new_argv[j] = NULL;
+
+	maxfd = (int)sysconf(_SC_OPEN_MAX);
+	if(maxfd < 0 || maxfd > 65536)
+		maxfd = 65536;
+
+	fflush(NULL);
+	pid = fork();
+	if(pid == 0) {
+		/* only pass along what we explicitly hand over */
+		for(fd = 3; fd < maxfd; fd++) {
+			if(fd != sv[1])
+				close(fd);
+		}
+		execv(exe, new_argv);
+		_exit(EXIT_FAILURE);
+	}
+	free(new_argv);
+	xclose(sv[1]);
+	if(pid < 0) {
+		perror("fork()");
+		xclose(sv[0]);
+		return -1;
+	}
+	return sv[0];
+}
+
+/**
+ * Send a single handoff record.
+ * @param sock the handoff socket
+ * @param fd a descriptor to pass along with the record, -1 for none
+ * @param fmt printf-style format of the record text
+ * @return 0 on success, -1 on failure
+ */
+int upgrade_send(int sock, int fd, const char *fmt, ...)
+{
+	char buf[UPGRADE_RECORD_SIZE];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if(len < 0 || (size_t)len >= sizeof(buf))
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = (size_t)len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(fd > -1) {
+		struct cmsghdr *cmsg;
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	while(sendmsg(sock, &msg, 0) == -1) {
+		if(errno == EINTR)
+			continue;
+		perror("sendmsg()");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Receive a single handoff record.
+ * @param sock the handoff socket
+ * @param buf location to store the record text, NUL-terminated
+ * @param len the size of buf
+ * @param fd location to store a descriptor passed with the record, -1 if
+ * none was passed
+ * @return the length of the record text, 0 if the socket was closed, -1 on
+ * failure
+ */
+ssize_t upgrade_recv(int sock, char *buf, size_t len, int *fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	*fd = -1;
+	while((ret = recvmsg(sock, &msg, 0)) == -1) {
+		if(errno == EINTR)
+			continue;
+		perror("recvmsg()");
+		return -1;
+	}
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	buf[ret] = '\0';
+	return ret;
+}
+
+/**
+ * Send raw bytes, e.g. half of a receiver packet, as handoff records: the
+ * given prefix followed by the bytes in hex, split over as many records as
+ * needed. At least one record is sent, even for no bytes at all.
+ * @param sock the handoff socket
+ * @param prefix the record text before the bytes, e.g. "O"
+ * @param data the bytes to send
+ * @param len the number of bytes
+ * @return 0 on success, -1 on failure
+ */
+int upgrade_send_bytes(int sock, const char *prefix, const char *data,
+		size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	char hex[UPGRADE_CHUNK * 2 + 1];
+
+	do {
+		size_t chunk = len < UPGRADE_CHUNK ? len : UPGRADE_CHUNK;
+		size_t i;
+
+		for(i = 0; i < chunk; i++) {
+			unsigned char c = (unsigned char)data[i];
+			hex[i * 2] = digits[c >> 4];
+			hex[i * 2 + 1] = digits[c & 0xf];
+		}
+		hex[chunk * 2] = '\0';
+		if(upgrade_send(sock, -1, "%s %s", prefix, hex) == -1)
+			return -1;
+		data += chunk;
+		len -= chunk;
+	} while(len);
+	return 0;
+}
+
+static int hex_value(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/**
+ * Decode the bytes of a record sent by upgrade_send_bytes().
+ * @param hex the bytes in hex, after the record prefix
+ * @param out location to store the bytes
+ * @param room the space left at out
+ * @return the number of bytes stored, -1 if the record is malformed or the
+ * bytes do not fit
+ */
+ssize_t upgrade_recv_bytes(const char *hex, char *out, size_t room)
+{
+	size_t len = strlen(hex), i;
+
+	if(len % 2 || len / 2 > room)
+		return -1;
+	for(i = 0; i < len / 2; i++) {
+		int hi = hex_value(hex[i * 2]), lo = hex_value(hex[i * 2 + 1]);
+		if(hi < 0 || lo < 0)
+			return -1;
+		out[i] = (char)(hi << 4 | lo);
+	}
+	return (ssize_t)(len / 2);
+}
+
+/* vim: set ts=4 sw=4 noet: */
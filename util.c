@@ -22,6 +22,9 @@
 #include <fcntl.h>  /* open */
 #include <unistd.h> /* close, read, write */
 #include <errno.h>  /* for errno refs */
+#include <stdarg.h> /* va_list */
+#include <stdio.h>  /* vsnprintf */
+#include <stdlib.h> /* realloc */
 
 #include "onkyo.h"
 
@@ -87,6 +90,63 @@ unsigned long hash_sdbm(const char *str)
 	return hash;
 }
 
+/**
+ * Add a formatted string to the end of a string pool, growing the pool as
+ * needed. Growing may move the pool, so keep the returned offset rather than
+ * a pointer until the last string is added.
+ * @param pool the pool to add to
+ * @param fmt format string, followed by its arguments
+ * @return the offset of the string in the pool, -1 on failure
+ */
+long strpool_add(struct strpool *pool, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+	long offset;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if(len < 0)
+		return -1;
+
+	if(pool->len + (size_t)len + 1 > pool->size) {
+		size_t size = pool->size ? pool->size : BUF_SIZE * 16;
+		char *buf;
+		while(pool->len + (size_t)len + 1 > size)
+			size *= 2;
+		buf = realloc(pool->buf, size);
+		if(!buf)
+			return -1;
+		pool->buf = buf;
+		pool->size = size;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(pool->buf + pool->len, (size_t)len + 1, fmt, ap);
+	va_end(ap);
+	offset = (long)pool->len;
+	pool->len += (size_t)len + 1;
+	return offset;
+}
+
+/**
+ * Give back the space a string pool has left over once it is complete.
+ * @param pool the pool to trim
+ */
+void strpool_trim(struct strpool *pool)
+{
+	char *buf;
+
+	if(pool->len == 0 || pool->len == pool->size)
+		return;
+	buf = realloc(pool->buf, pool->len);
+	if(buf) {
+		pool->buf = buf;
+		pool->size = pool->len;
+	}
+}
+
 void timeval_diff(struct timeval * restrict a,
 		struct timeval * restrict b, struct timeval * restrict result)
 {
@@ -100,6 +160,18 @@ void timeval_diff(struct timeval * restrict a,
 	}
 }
 
+void timeval_add(struct timeval * restrict a,
+		struct timeval * restrict b, struct timeval * restrict result)
+{
+	/* Calculate time sum as `a + b`, again keeping usecs in range. */
+	result->tv_sec = a->tv_sec + b->tv_sec;
+	result->tv_usec = a->tv_usec + b->tv_usec;
+	if(result->tv_usec >= 1000000) {
+		result->tv_usec -= 1000000;
+		result->tv_sec += 1;
+	}
+}
+
 struct timeval timeval_min(struct timeval *restrict a,
 		struct timeval * restrict b)
 {